@@ -0,0 +1,665 @@
+#include "headers/common.h"
+#include "headers/bcache.h"
+#include "headers/journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+// Block cache between the file system and its backing device
+//
+// Every block access goes through bcache_get()/bcache_put(). On the in-memory disk the cache is a
+// pass-through that returns the block's bytes of HARD_DISK. With an image file attached (bcache_open()) blocks
+// live in a fixed number of frames, so the memory used no longer depends on the image size:
+// - frames are split into shards by block number, each with its own lock, hash table and
+//   CLOCK hand; a miss evicts the first unpinned frame whose reference bit is clear
+// - a pinned frame (between get and put) is never evicted, bcache_pin() pins for good
+//   (superblock, bitmaps, file descriptor table)
+// - dirty data blocks are written to the image by a background thread, by eviction, or by the
+//   journal before a commit (ordered mode); metadata blocks are held by the journal from the
+//   change until their transaction committed, and reach the image through the journal only
+// - a miss reads the journal's committed copy first, since a released block may not be home yet
+// When every frame of a shard is pinned or held the shard borrows from a reserve of the same size
+// (address space only until used); running out of that is a fatal error, except for
+// bcache_get_view(), whose pins are capped per shard and which fails instead
+
+extern uint8_t *HARD_DISK;
+
+#define BCACHE_SHARDS 16
+#define BCACHE_WRITEBACK_INTERVAL_MS 100 // background write back period
+#define BCACHE_WRITE_RUN 64              // adjacent blocks written with one pwrite
+
+typedef struct {
+    uint32_t block;
+    uint16_t pins;    // bcache_get() calls not yet matched by bcache_put()
+    uint32_t hold;    // journal transaction holding the block, 0 if none
+    int32_t next;     // next frame in the hash chain, -1 at the end
+    bool valid;
+    bool dirty;       // changed since it was read or written back
+    bool referenced;  // CLOCK reference bit
+    bool fixed;       // pinned until the device is closed
+} CacheFrame;
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t first;   // first frame of the shard
+    uint32_t active;  // frames swept by the CLOCK hand
+    uint32_t limit;   // frames the shard may use, including the reserve
+    uint32_t view_pins; // frames pinned by bcache_get_view()
+    uint32_t hand;
+    int32_t *buckets; // hash table heads, -1 if empty
+    uint32_t bucket_mask;
+    uint64_t hits, misses, evictions, writes;
+} CacheShard;
+
+static int device_fd = -1;
+static uint32_t configured_capacity = BCACHE_DEFAULT_BLOCKS;
+static uint32_t capacity;
+static CacheShard shards[BCACHE_SHARDS];
+static CacheFrame *frames;
+static uint8_t *frame_data; // frame i holds bytes [i * BLOCK_SIZE_BYTES, (i + 1) * BLOCK_SIZE_BYTES)
+static size_t frame_data_bytes;
+static uint32_t frame_total;
+static uint8_t **pinned; // data of blocks pinned with bcache_pin(), for the blocks before the journal
+static uint32_t pinnable_blocks;
+
+// Background write back
+static pthread_t writeback_thread;
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeback_wakeup = PTHREAD_COND_INITIALIZER;
+static bool writeback_stop;
+
+static int device_read_block(uint32_t block, void *buffer)
+{
+    uint8_t *p = buffer;
+    size_t left = BLOCK_SIZE_BYTES;
+    off_t position = (off_t)block * BLOCK_SIZE_BYTES;
+    while (left > 0) {
+        ssize_t bytes_read = pread(device_fd, p, left, position);
+        if (bytes_read <= 0) {
+            return ERROR_IO;
+        }
+        p += bytes_read;
+        left -= bytes_read;
+        position += bytes_read;
+    }
+    return SUCCESS;
+}
+
+static int device_write_blocks(const void *buffer, uint32_t count, uint32_t block)
+{
+    const uint8_t *p = buffer;
+    size_t left = (size_t)count * BLOCK_SIZE_BYTES;
+    off_t position = (off_t)block * BLOCK_SIZE_BYTES;
+    while (left > 0) {
+        ssize_t written = pwrite(device_fd, p, left, position);
+        if (written <= 0) {
+            return ERROR_IO;
+        }
+        p += written;
+        left -= written;
+        position += written;
+    }
+    return SUCCESS;
+}
+
+static CacheShard* shard_of(uint32_t block)
+{
+    return &shards[block % BCACHE_SHARDS];
+}
+
+static uint32_t bucket_of(CacheShard *shard, uint32_t block)
+{
+    return (block / BCACHE_SHARDS) & shard->bucket_mask;
+}
+
+// Returns the frame caching block, or -1; called with the shard lock held
+static int32_t lookup_frame(CacheShard *shard, uint32_t block)
+{
+    int32_t index = shard->buckets[bucket_of(shard, block)];
+    while (index >= 0 && frames[index].block != block) {
+        index = frames[index].next;
+    }
+    return index;
+}
+
+static void link_frame(CacheShard *shard, int32_t index)
+{
+    int32_t *head = &shard->buckets[bucket_of(shard, frames[index].block)];
+    frames[index].next = *head;
+    *head = index;
+}
+
+static void unlink_frame(CacheShard *shard, int32_t index)
+{
+    int32_t *link = &shard->buckets[bucket_of(shard, frames[index].block)];
+    while (*link != index) {
+        link = &frames[*link].next;
+    }
+    *link = frames[index].next;
+}
+
+// Finds a frame for a new block with the CLOCK algorithm, writing it back first if it is dirty
+// Returns the frame, or -1 if every frame (reserve included) is pinned or held
+// Called with the shard lock held
+static int32_t claim_frame(CacheShard *shard)
+{
+    // Two turns of the hand: the first may only clear reference bits
+    for (uint32_t step = 0; step < 2 * shard->active; step++) {
+        int32_t index = shard->first + shard->hand;
+        shard->hand = (shard->hand + 1 < shard->active) ? shard->hand + 1 : 0;
+        CacheFrame *frame = &frames[index];
+        if (!frame->valid) {
+            return index;
+        }
+        if (frame->pins > 0 || frame->hold != 0 || frame->fixed) {
+            continue;
+        }
+        if (frame->referenced) {
+            frame->referenced = false; // Second chance
+            continue;
+        }
+        if (frame->dirty) {
+            if (device_write_blocks(frame_data + (size_t)index * BLOCK_SIZE_BYTES, 1, frame->block) != SUCCESS) {
+                continue; // Keep it, maybe the next write works
+            }
+            shard->writes++;
+        }
+        unlink_frame(shard, index);
+        frame->valid = false;
+        shard->evictions++;
+        return index;
+    }
+    if (shard->active < shard->limit) {
+        return shard->first + shard->active++;
+    }
+    return -1;
+}
+
+// Fills a frame for block: the journal's committed copy if it has one, else the image
+static void load_block(uint32_t block, uint8_t *buffer)
+{
+    if (!journal_read_copy(block, buffer) && device_read_block(block, buffer) != SUCCESS) {
+        memset(buffer, 0, BLOCK_SIZE_BYTES); // Unreadable blocks read as zeros
+    }
+}
+
+// Pins the frame caching block, loading the block first on a miss
+// Returns the frame, or -1 if every frame (reserve included) is pinned or held
+// Called with the shard lock held
+static int32_t pin_frame(CacheShard *shard, uint32_t block)
+{
+    int32_t index = lookup_frame(shard, block);
+    if (index >= 0) {
+        shard->hits++;
+    } else {
+        shard->misses++;
+        index = claim_frame(shard);
+        if (index < 0) {
+            return -1;
+        }
+        CacheFrame *frame = &frames[index];
+        load_block(block, frame_data + (size_t)index * BLOCK_SIZE_BYTES);
+        frame->block = block;
+        frame->pins = 0;
+        frame->hold = 0;
+        frame->valid = true;
+        frame->dirty = false;
+        frame->fixed = false;
+        link_frame(shard, index);
+    }
+    frames[index].pins++;
+    frames[index].referenced = true;
+    return index;
+}
+
+uint8_t* bcache_get(uint32_t block)
+{
+    if (device_fd < 0) {
+        return HARD_DISK + (size_t)block * BLOCK_SIZE_BYTES;
+    }
+    CacheShard *shard = shard_of(block);
+    pthread_mutex_lock(&shard->lock);
+    int32_t index = pin_frame(shard, block);
+    if (index < 0) {
+        fprintf(stderr, "block cache: every frame is in use, cannot load block %u\n", block);
+        abort();
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return frame_data + (size_t)index * BLOCK_SIZE_BYTES;
+}
+
+// Like bcache_get(), for pins held by the caller for an unknown time (fs_read_view()): at most a
+// quarter of a shard's frames (half without the reserve) are pinned this way, so they can never
+// leave the other users of the shard without a frame
+// Returns NULL instead when the shard has no frame to spare; put with bcache_put_view()
+uint8_t* bcache_get_view(uint32_t block)
+{
+    if (device_fd < 0) {
+        return HARD_DISK + (size_t)block * BLOCK_SIZE_BYTES;
+    }
+    CacheShard *shard = shard_of(block);
+    pthread_mutex_lock(&shard->lock);
+    int32_t index = -1;
+    if (shard->view_pins < shard->limit / 4) {
+        index = pin_frame(shard, block);
+    }
+    if (index < 0) {
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    shard->view_pins++;
+    pthread_mutex_unlock(&shard->lock);
+    return frame_data + (size_t)index * BLOCK_SIZE_BYTES;
+}
+
+void bcache_put_view(uint32_t block)
+{
+    if (device_fd < 0) {
+        return;
+    }
+    CacheShard *shard = shard_of(block);
+    pthread_mutex_lock(&shard->lock);
+    if (shard->view_pins > 0) {
+        shard->view_pins--;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    bcache_put(block, false);
+}
+
+void bcache_put(uint32_t block, bool dirty)
+{
+    if (device_fd < 0) {
+        return;
+    }
+    CacheShard *shard = shard_of(block);
+    pthread_mutex_lock(&shard->lock);
+    int32_t index = lookup_frame(shard, block);
+    if (index >= 0) {
+        if (dirty) {
+            frames[index].dirty = true;
+        }
+        if (frames[index].pins > 0) {
+            frames[index].pins--;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Returns a block that stays cached (and at the same address) until the device is closed,
+// for blocks used on every operation; no bcache_put() is needed
+// Only blocks before the journal (superblock, bitmaps, inode table, file descriptor table) can be pinned
+uint8_t* bcache_pin(uint32_t block)
+{
+    if (device_fd < 0) {
+        return HARD_DISK + (size_t)block * BLOCK_SIZE_BYTES;
+    }
+    if (block >= pinnable_blocks) {
+        fprintf(stderr, "block cache: block %u cannot be pinned\n", block);
+        abort();
+    }
+    uint8_t *data = __atomic_load_n(&pinned[block], __ATOMIC_ACQUIRE);
+    if (data != NULL) {
+        return data;
+    }
+    data = bcache_get(block);
+    CacheShard *shard = shard_of(block);
+    pthread_mutex_lock(&shard->lock);
+    int32_t index = lookup_frame(shard, block);
+    frames[index].fixed = true;
+    frames[index].pins--;
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_store_n(&pinned[block], data, __ATOMIC_RELEASE);
+    return data;
+}
+
+// Sets *block to the block whose data holds address (which must be pinned)
+// Returns false if address is not inside a cached block (e.g. a copy on the stack)
+bool bcache_block_of(const void *address, uint32_t *block)
+{
+    const uint8_t *p = address;
+    if (device_fd < 0) {
+        const uint8_t *disk = HARD_DISK;
+        if (p < disk || p >= disk + (size_t)BLOCK_NUM * BLOCK_SIZE_BYTES) {
+            return false;
+        }
+        *block = (uint32_t)((p - disk) / BLOCK_SIZE_BYTES);
+        return true;
+    }
+    const uint8_t *base = frame_data;
+    if (p < base || p >= base + (size_t)frame_total * BLOCK_SIZE_BYTES) {
+        return false;
+    }
+    *block = frames[(p - base) / BLOCK_SIZE_BYTES].block;
+    return true;
+}
+
+// Marks a changed metadata block as part of a journal transaction (the latest one wins)
+void bcache_hold(uint32_t block, uint32_t transaction)
+{
+    if (device_fd < 0) {
+        return;
+    }
+    CacheShard *shard = shard_of(block);
+    pthread_mutex_lock(&shard->lock);
+    int32_t index = lookup_frame(shard, block);
+    if (index >= 0) {
+        frames[index].hold = transaction;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Transaction committed: its copy of the block is durable in the journal, so the frame is clean
+// Does nothing if a later transaction changed the block again
+void bcache_release(uint32_t block, uint32_t transaction)
+{
+    if (device_fd < 0) {
+        return;
+    }
+    CacheShard *shard = shard_of(block);
+    pthread_mutex_lock(&shard->lock);
+    int32_t index = lookup_frame(shard, block);
+    if (index >= 0 && frames[index].hold == transaction) {
+        frames[index].hold = 0;
+        frames[index].dirty = false;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Copies a dirty block that is not held by the journal into buffer and marks it clean
+// Returns false if there is nothing to write
+static bool take_dirty_block(uint32_t block, uint8_t *buffer, bool skip_pinned)
+{
+    CacheShard *shard = shard_of(block);
+    bool taken = false;
+    pthread_mutex_lock(&shard->lock);
+    int32_t index = lookup_frame(shard, block);
+    if (index >= 0 && frames[index].dirty && frames[index].hold == 0 &&
+        !(skip_pinned && frames[index].pins > 0)) {
+        memcpy(buffer, frame_data + (size_t)index * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+        frames[index].dirty = false;
+        shard->writes++;
+        taken = true;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return taken;
+}
+
+// Writes a run of adjacent blocks; if that fails the blocks are marked dirty again
+static int write_run(const uint8_t *run, uint32_t start, uint32_t length)
+{
+    if (device_write_blocks(run, length, start) == SUCCESS) {
+        return SUCCESS;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+        CacheShard *shard = shard_of(start + i);
+        pthread_mutex_lock(&shard->lock);
+        int32_t index = lookup_frame(shard, start + i);
+        if (index >= 0) {
+            frames[index].dirty = true;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return ERROR_IO;
+}
+
+// Writes the dirty ones of blocks (sorted) to the image, adjacent blocks in one write
+static int write_back_blocks(const uint32_t *blocks, uint32_t count, bool skip_pinned)
+{
+    uint8_t *run = malloc((size_t)BCACHE_WRITE_RUN * BLOCK_SIZE_BYTES);
+    if (run == NULL) {
+        return ERROR_IO;
+    }
+    int result = SUCCESS;
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t block = blocks[i];
+        if (run_length > 0 && (block != run_start + run_length || run_length == BCACHE_WRITE_RUN)) {
+            if (write_run(run, run_start, run_length) != SUCCESS) {
+                result = ERROR_IO;
+            }
+            run_length = 0;
+        }
+        if (take_dirty_block(block, run + (size_t)run_length * BLOCK_SIZE_BYTES, skip_pinned)) {
+            if (run_length == 0) {
+                run_start = block;
+            }
+            run_length++;
+        }
+    }
+    if (run_length > 0 && write_run(run, run_start, run_length) != SUCCESS) {
+        result = ERROR_IO;
+    }
+    free(run);
+    return result;
+}
+
+// Writes the dirty, unheld ones of blocks (sorted) to the image, e.g. data blocks before the
+// journal commits metadata that points at them; the caller flushes the image afterwards
+int bcache_write_back(const uint32_t *blocks, uint32_t count)
+{
+    if (device_fd < 0) {
+        return SUCCESS;
+    }
+    return write_back_blocks(blocks, count, false);
+}
+
+static int compare_blocks(const void *a, const void *b)
+{
+    uint32_t block_a = *(const uint32_t *)a;
+    uint32_t block_b = *(const uint32_t *)b;
+    return (block_a > block_b) - (block_a < block_b);
+}
+
+// Writes every dirty block that is not held by the journal (and with skip_pinned, not in use)
+static int write_back_all(uint32_t *blocks, bool skip_pinned)
+{
+    uint32_t count = 0;
+    for (int s = 0; s < BCACHE_SHARDS; s++) {
+        CacheShard *shard = &shards[s];
+        pthread_mutex_lock(&shard->lock);
+        for (uint32_t i = 0; i < shard->active; i++) {
+            CacheFrame *frame = &frames[shard->first + i];
+            if (frame->valid && frame->dirty && frame->hold == 0 && !(skip_pinned && frame->pins > 0)) {
+                blocks[count++] = frame->block;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    qsort(blocks, count, sizeof(uint32_t), compare_blocks);
+    return write_back_blocks(blocks, count, skip_pinned);
+}
+
+// Background write back: keeps evictions from having to write, and the image close to the cache
+// A pass runs with writeback_lock held, so bcache_invalidate() never races with a copy in flight
+static void* writeback_main(void *arg)
+{
+    uint32_t *blocks = arg;
+    pthread_mutex_lock(&writeback_lock);
+    while (!writeback_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += BCACHE_WRITEBACK_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&writeback_wakeup, &writeback_lock, &deadline);
+        if (writeback_stop) {
+            break;
+        }
+        write_back_all(blocks, true);
+    }
+    pthread_mutex_unlock(&writeback_lock);
+    return blocks; // Freed by bcache_close()
+}
+
+// Number of blocks cached by the next bcache_open() (at least BCACHE_MIN_BLOCKS)
+void bcache_set_capacity(uint32_t blocks)
+{
+    configured_capacity = (blocks < BCACHE_MIN_BLOCKS) ? BCACHE_MIN_BLOCKS : blocks;
+}
+
+// Puts the cache in front of an image file instead of the in-memory disk
+// Returns SUCCESS, or ERROR_IO if the frames could not be allocated
+int bcache_open(int image_fd)
+{
+    if (device_fd >= 0) {
+        return ERROR_INVALID_INPUT;
+    }
+    uint32_t per_shard = (configured_capacity + BCACHE_SHARDS - 1) / BCACHE_SHARDS;
+    uint32_t limit = 2 * per_shard; // Second half is the reserve
+    capacity = per_shard * BCACHE_SHARDS;
+    frame_total = limit * BCACHE_SHARDS;
+    frame_data_bytes = (size_t)frame_total * BLOCK_SIZE_BYTES;
+
+    // Address space for every frame up front, so frames never move; pages are only
+    // committed once a frame is used
+    void *data = mmap(NULL, frame_data_bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    uint32_t bucket_count = 1;
+    while (bucket_count < limit) {
+        bucket_count *= 2;
+    }
+    frames = calloc(frame_total, sizeof(CacheFrame));
+    int32_t *buckets = malloc((size_t)BCACHE_SHARDS * bucket_count * sizeof(int32_t));
+    uint32_t *writeback_blocks = malloc(frame_total * sizeof(uint32_t));
+    pinnable_blocks = JOURNAL_START;
+    pinned = calloc(pinnable_blocks, sizeof(uint8_t *));
+    if (data == MAP_FAILED || frames == NULL || buckets == NULL || writeback_blocks == NULL || pinned == NULL) {
+        if (data != MAP_FAILED) {
+            munmap(data, frame_data_bytes);
+        }
+        free(frames);
+        free(buckets);
+        free(writeback_blocks);
+        free(pinned);
+        frames = NULL;
+        pinned = NULL;
+        return ERROR_IO;
+    }
+    frame_data = data;
+    memset(buckets, 0xFF, (size_t)BCACHE_SHARDS * bucket_count * sizeof(int32_t)); // all -1
+    for (int s = 0; s < BCACHE_SHARDS; s++) {
+        CacheShard *shard = &shards[s];
+        memset(shard, 0, sizeof(CacheShard));
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->first = s * limit;
+        shard->active = per_shard;
+        shard->limit = limit;
+        shard->buckets = buckets + (size_t)s * bucket_count;
+        shard->bucket_mask = bucket_count - 1;
+    }
+    device_fd = image_fd;
+
+    writeback_stop = false;
+    if (pthread_create(&writeback_thread, NULL, writeback_main, writeback_blocks) != 0) {
+        device_fd = -1;
+        munmap(frame_data, frame_data_bytes);
+        free(frames);
+        free(buckets);
+        free(writeback_blocks);
+        free(pinned);
+        frame_data = NULL;
+        frames = NULL;
+        pinned = NULL;
+        return ERROR_IO;
+    }
+    return SUCCESS;
+}
+
+// Writes every dirty block the journal does not hold and flushes the image
+int bcache_flush(void)
+{
+    if (device_fd < 0) {
+        return SUCCESS;
+    }
+    uint32_t *blocks = malloc(frame_total * sizeof(uint32_t));
+    if (blocks == NULL) {
+        return ERROR_IO;
+    }
+    int result = write_back_all(blocks, false);
+    free(blocks);
+    if (fdatasync(device_fd) != 0) {
+        result = ERROR_IO;
+    }
+    return result;
+}
+
+// The image was zero filled underneath the cache: cached blocks become zeros and clean
+// (pinned blocks keep their address)
+void bcache_invalidate(void)
+{
+    if (device_fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&writeback_lock);
+    for (int s = 0; s < BCACHE_SHARDS; s++) {
+        CacheShard *shard = &shards[s];
+        pthread_mutex_lock(&shard->lock);
+        for (uint32_t i = 0; i < shard->active; i++) {
+            CacheFrame *frame = &frames[shard->first + i];
+            if (frame->valid) {
+                memset(frame_data + (size_t)(shard->first + i) * BLOCK_SIZE_BYTES, 0, BLOCK_SIZE_BYTES);
+                frame->dirty = false;
+                frame->hold = 0;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+// Writes everything back and goes back to the in-memory disk (after the journal was closed)
+int bcache_close(void)
+{
+    if (device_fd < 0) {
+        return SUCCESS;
+    }
+    pthread_mutex_lock(&writeback_lock);
+    writeback_stop = true;
+    pthread_cond_signal(&writeback_wakeup);
+    pthread_mutex_unlock(&writeback_lock);
+    void *writeback_blocks;
+    pthread_join(writeback_thread, &writeback_blocks);
+    free(writeback_blocks);
+
+    int result = bcache_flush();
+    device_fd = -1;
+    for (int s = 0; s < BCACHE_SHARDS; s++) {
+        pthread_mutex_destroy(&shards[s].lock);
+    }
+    free(shards[0].buckets); // One allocation for every shard
+    free(frames);
+    munmap(frame_data, frame_data_bytes);
+    free(pinned);
+    frames = NULL;
+    frame_data = NULL;
+    pinned = NULL;
+    return result;
+}
+
+// Counters since bcache_open() (all zero on the in-memory disk)
+void bcache_get_stats(BlockCacheStats *stats)
+{
+    memset(stats, 0, sizeof(BlockCacheStats));
+    if (device_fd < 0) {
+        return;
+    }
+    for (int s = 0; s < BCACHE_SHARDS; s++) {
+        CacheShard *shard = &shards[s];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->writes += shard->writes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    stats->capacity = capacity;
+}
@@ -0,0 +1,164 @@
+#include "headers/common.h"
+#include "headers/dcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Dentry cache: remembers the result of find_directory_entry() for (parent inode, name)
+// Negative entries (inode 0) remember names that do not exist, so repeated failed lookups
+// and existence checks before a create do not read the directory either
+//
+// The cache is set associative: a name hashes to one set of DCACHE_WAYS slots and replaces
+// them round robin. Names longer than DCACHE_NAME_MAX are not cached
+// Sets are protected by striped mutexes, so lookups of different names rarely contend
+#define DCACHE_SETS 4096
+#define DCACHE_WAYS 4
+#define DCACHE_NAME_MAX 40
+#define DCACHE_LOCK_STRIPES 256
+
+typedef struct {
+    uint32_t hash;         // hash of (parent, name), 0 means the slot is empty
+    uint16_t parent_inode;
+    uint16_t inode_number; // 0 for a negative entry
+    uint8_t name_length;
+    char name[DCACHE_NAME_MAX];
+} DcacheEntry;
+
+typedef struct {
+    DcacheEntry entries[DCACHE_WAYS];
+    uint8_t next_victim; // round robin replacement
+} DcacheSet;
+
+static DcacheSet dcache[DCACHE_SETS];
+static DcacheStats dcache_stats; // updated with atomic increments
+static pthread_mutex_t dcache_locks[DCACHE_LOCK_STRIPES];
+static pthread_once_t dcache_locks_once = PTHREAD_ONCE_INIT;
+
+static void init_dcache_locks()
+{
+    for (int i = 0; i < DCACHE_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&dcache_locks[i], NULL);
+    }
+}
+
+static pthread_mutex_t* get_set_lock(uint32_t hash)
+{
+    pthread_once(&dcache_locks_once, init_dcache_locks);
+    return &dcache_locks[(hash % DCACHE_SETS) % DCACHE_LOCK_STRIPES];
+}
+
+static void count(uint64_t *counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+// FNV-1a over the parent inode and the name; never returns 0 (reserved for empty slots)
+static uint32_t dcache_hash(uint16_t parent_inode, const char *name, size_t name_len)
+{
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ (parent_inode & 0xFF)) * 16777619u;
+    hash = (hash ^ (parent_inode >> 8)) * 16777619u;
+    for (size_t i = 0; i < name_len; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+// Returns the slot holding (parent, name) in its set, or NULL
+static DcacheEntry* dcache_find(DcacheSet *set, uint32_t hash, uint16_t parent_inode,
+                                const char *name, size_t name_len)
+{
+    for (int way = 0; way < DCACHE_WAYS; way++) {
+        DcacheEntry *entry = &set->entries[way];
+        if (entry->hash == hash && entry->parent_inode == parent_inode &&
+            entry->name_length == name_len && memcmp(entry->name, name, name_len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+bool dcache_lookup(uint16_t parent_inode, const char *name, size_t name_len, uint16_t *out_inode)
+{
+    if (name_len > DCACHE_NAME_MAX) {
+        count(&dcache_stats.misses);
+        return false;
+    }
+    uint32_t hash = dcache_hash(parent_inode, name, name_len);
+    pthread_mutex_t *lock = get_set_lock(hash);
+    pthread_mutex_lock(lock);
+    DcacheEntry *entry = dcache_find(&dcache[hash % DCACHE_SETS], hash, parent_inode, name, name_len);
+    bool hit = (entry != NULL);
+    if (hit) {
+        *out_inode = entry->inode_number;
+    }
+    pthread_mutex_unlock(lock);
+    
+    if (!hit) {
+        count(&dcache_stats.misses);
+        return false;
+    }
+    count(&dcache_stats.hits);
+    if (*out_inode == 0) {
+        count(&dcache_stats.negative_hits);
+    }
+    return true;
+}
+
+void dcache_insert(uint16_t parent_inode, const char *name, size_t name_len, uint16_t inode_number)
+{
+    if (name_len > DCACHE_NAME_MAX) {
+        return; // Too long to cache
+    }
+    uint32_t hash = dcache_hash(parent_inode, name, name_len);
+    DcacheSet *set = &dcache[hash % DCACHE_SETS];
+    pthread_mutex_t *lock = get_set_lock(hash);
+    pthread_mutex_lock(lock);
+    DcacheEntry *entry = dcache_find(set, hash, parent_inode, name, name_len);
+    if (entry == NULL) {
+        entry = &set->entries[set->next_victim];
+        set->next_victim = (set->next_victim + 1) % DCACHE_WAYS;
+    }
+    entry->hash = hash;
+    entry->parent_inode = parent_inode;
+    entry->inode_number = inode_number;
+    entry->name_length = (uint8_t)name_len;
+    memcpy(entry->name, name, name_len);
+    pthread_mutex_unlock(lock);
+}
+
+void dcache_invalidate(uint16_t parent_inode, const char *name, size_t name_len)
+{
+    if (name_len > DCACHE_NAME_MAX) {
+        return; // Never cached
+    }
+    uint32_t hash = dcache_hash(parent_inode, name, name_len);
+    pthread_mutex_t *lock = get_set_lock(hash);
+    pthread_mutex_lock(lock);
+    DcacheEntry *entry = dcache_find(&dcache[hash % DCACHE_SETS], hash, parent_inode, name, name_len);
+    if (entry != NULL) {
+        entry->hash = 0;
+    }
+    pthread_mutex_unlock(lock);
+    if (entry != NULL) {
+        count(&dcache_stats.invalidations);
+    }
+}
+
+// Drops every entry, used when the disk is reset or another image is mounted
+// (no other thread may be using the file system at that point)
+void dcache_invalidate_all()
+{
+    memset(dcache, 0, sizeof(dcache));
+}
+
+void dcache_get_stats(DcacheStats *stats)
+{
+    stats->hits = __atomic_load_n(&dcache_stats.hits, __ATOMIC_RELAXED);
+    stats->negative_hits = __atomic_load_n(&dcache_stats.negative_hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&dcache_stats.misses, __ATOMIC_RELAXED);
+    stats->invalidations = __atomic_load_n(&dcache_stats.invalidations, __ATOMIC_RELAXED);
+}
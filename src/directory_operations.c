@@ -1,6 +1,12 @@
 #include "headers/common.h"
 #include "headers/utils.h"
 #include "headers/directory_operations.h"
+#include "headers/dcache.h"
+#include "headers/locks.h"
+#include "headers/journal.h"
+#include "headers/bcache.h"
+#include "headers/name_index.h"
+#include "headers/snapshot.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,12 +15,12 @@
 #include <time.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <assert.h>
 #include <stdbool.h>
 
 // External references to globals defined in file_operations.c
-extern SessionConfig *session_config;
-extern uint8_t HARD_DISK[BLOCK_NUM][BLOCK_SIZE_BYTES];
+extern _Thread_local SessionConfig *session_config;
 
 // should not be called by itself, already called in create_root_directory()
 void init_root_inode()
@@ -24,6 +30,10 @@ void init_root_inode()
     in->permissions = 420;                // 0000000rw-r--r--, owner, group, other/world i.e. 4+32+128+256=420
     in->file_size = 0;                    // in bytes
     in->directBlocks[0] = ROOT_DIRECTORY; // initialize first block
+    for (int i = 1; i < DIRECT_BLOCKS; i++)
+    {
+        in->directBlocks[i] = 0; // initialize remaining direct blocks to 0
+    }
     in->indirect = 0;
     in->second_level_indirect = 0;
     in->time = time(NULL);  // last accessed, since unix epoch
@@ -31,7 +41,10 @@ void init_root_inode()
     in->mtime = time(NULL); // last modified
     in->dtime = 0;          // file deletion time, not set
     in->flags = 2;          // 2 directory
-    memcpy(HARD_DISK[INODE_START], in, sizeof(Inode));//saved to hard disk array
+    memcpy(bcache_get(INODE_START), in, sizeof(Inode));//saved to hard disk array
+    journal_dirty_metadata(INODE_START);
+    bcache_put(INODE_START, true);
+    free(in);
 }
 
 // Creates root directory: initializes root inode and root directory data block
@@ -41,7 +54,7 @@ void create_root_directory(){
     init_root_inode();
     
     // Initialize root directory data block with . and .. entries
-    uint8_t *root_data_block = HARD_DISK[ROOT_DIRECTORY];
+    uint8_t *root_data_block = bcache_get(ROOT_DIRECTORY);
     uint16_t offset = 0;
     
     // Create . entry (points to root inode)
@@ -63,8 +76,12 @@ void create_root_directory(){
     dotdot_entry->record_length = sizeof(DirectoryEntry) + 3; // 3 bytes for ".." + null terminator
     
     // Update root inode file_size to reflect the directory entries
-    Inode *root_inode = (Inode *)HARD_DISK[INODE_START];
+    Inode *root_inode = (Inode *)bcache_get(INODE_START);
     root_inode->file_size = dot_entry->record_length + dotdot_entry->record_length;
+    journal_dirty_metadata(INODE_START);
+    journal_dirty_metadata(ROOT_DIRECTORY);
+    bcache_put(INODE_START, true);
+    bcache_put(ROOT_DIRECTORY, true);
 }
 
 // find_free_data_block() and find_free_inode() are now implemented in utils.c
@@ -76,10 +93,9 @@ void init_inode(uint16_t inode_number)
     in->ownerID = session_config->uid;            // set creator/owner to current session user
     in->permissions = 420;                        // 0000000rw-r--r--, owner, group, other/world i.e. 4+32+128+256=420
     in->file_size = 0;                            // in bytes
-    in->directBlocks[0] = find_free_data_block(); // initialize first block
-    for (int i = 1; i < 6; i++)
+    for (int i = 0; i < DIRECT_BLOCKS; i++)
     {
-        in->directBlocks[i] = 0; // initialize remaining direct blocks to 0
+        in->directBlocks[i] = 0; // no blocks yet, create_directory_in() adds the first one
     }
     in->indirect = 0;
     in->second_level_indirect = 0;
@@ -90,11 +106,13 @@ void init_inode(uint16_t inode_number)
     in->flags = 2;          // 2 directory
 
     // Calculate which block contains this inode and offset within that block
-    // Each inode is 64 bytes, each block is 2048 bytes, so 32 inodes per block
-    uint16_t inode_block = INODE_START + (inode_number / 32);
-    uint16_t inode_offset = (inode_number % 32) * sizeof(Inode);
+    // Each inode is 128 bytes, so INODES_PER_BLOCK (16 with 2 KiB blocks) inodes per block
+    uint32_t inode_block = INODE_START + (inode_number / INODES_PER_BLOCK);
+    uint16_t inode_offset = (inode_number % INODES_PER_BLOCK) * sizeof(Inode);
 
-    memcpy(HARD_DISK[inode_block] + inode_offset, in, sizeof(Inode));
+    memcpy(bcache_get(inode_block) + inode_offset, in, sizeof(Inode));
+    journal_dirty_metadata(inode_block);
+    bcache_put(inode_block, true);
     free(in);
 }
 
@@ -107,10 +125,28 @@ uint16_t create_directory(const char *dirname)
         printf("INVALID dirname: %s\n", dirname);
         return 0;
     }
+    return create_directory_in(session_config->current_dir_inode, dirname, strlen(dirname));
+}
+
+// Creates a directory named by the first name_len bytes of name in directory parent_inode
+// Returns inode number of the new directory, or 0 on error (invalid name, name exists, disk full,
+// the session has a snapshot mounted or parent_inode is part of a snapshot)
+uint16_t create_directory_in(uint16_t parent_inode, const char *name, size_t name_len)
+{
+    if (name == NULL || name_len == 0 || name_len > MAX_FILENAME || session_config->read_only ||
+        !snapshot_allows_change(parent_inode)) {
+        return 0;
+    }
+    
+    // Inode, directory block and parent entry are committed together
+    tree_lock_shared();
+    journal_begin_operation();
     
     // Find free inode for new directory
     uint16_t new_inode_num = find_free_inode();
     if (new_inode_num == 0) {
+        journal_end_operation();
+        tree_unlock_shared();
         printf("No free Inodes\n");
         return 0; // No free inodes
     }
@@ -118,10 +154,19 @@ uint16_t create_directory(const char *dirname)
     // Initialize the directory's inode
     init_inode(new_inode_num);
     
-    // Get the directory's data block
-    Inode *dir_inode = (Inode *)(HARD_DISK[INODE_START + (new_inode_num / 32)] + (new_inode_num % 32) * sizeof(Inode));
-    uint16_t dir_data_block = dir_inode->directBlocks[0];
-    uint8_t *dir_data = HARD_DISK[dir_data_block];
+    // Allocate the directory's first data block, which holds the . and .. entries
+    uint32_t dir_data_block = find_free_data_block();
+    if (dir_data_block == 0) {
+        // No free data block: block 0 would be the superblock
+        free_inode(new_inode_num);
+        journal_end_operation();
+        tree_unlock_shared();
+        return 0;
+    }
+    uint32_t inode_block = INODE_START + (new_inode_num / INODES_PER_BLOCK);
+    Inode *dir_inode = (Inode *)(bcache_get(inode_block) + (new_inode_num % INODES_PER_BLOCK) * sizeof(Inode));
+    dir_inode->directBlocks[0] = dir_data_block;
+    uint8_t *dir_data = bcache_get(dir_data_block);
     uint16_t offset = 0;
     
     // Create . entry (points to this directory's inode)
@@ -134,9 +179,8 @@ uint16_t create_directory(const char *dirname)
     offset += dot_entry->record_length;
     
     // Create .. entry (points to parent directory's inode)
-    // Use current_dir_inode from session_config as the parent
     DirectoryEntry *dotdot_entry = (DirectoryEntry *)(dir_data + offset);
-    dotdot_entry->inode_number = session_config->current_dir_inode; // Parent directory's inode
+    dotdot_entry->inode_number = parent_inode; // Parent directory's inode
     dotdot_entry->name_length = 2;
     dotdot_entry->name[0] = '.';
     dotdot_entry->name[1] = '.';
@@ -146,144 +190,958 @@ uint16_t create_directory(const char *dirname)
     
     // Update directory inode file_size
     dir_inode->file_size = offset;
+    journal_dirty_metadata(inode_block);
+    journal_dirty_metadata(dir_data_block);
+    bcache_put(dir_data_block, true);
+    bcache_put(inode_block, true);
     
     // Add entry to parent directory's data block
-    int result = add_directory_entry(session_config->current_dir_inode, dirname, new_inode_num);
+    int result = add_directory_entry_n(parent_inode, name, name_len, new_inode_num);
     if (result != SUCCESS) {
         // Failed to add directory entry, clean up
         free_inode(new_inode_num);
         free_data_block(dir_data_block);
+        journal_end_operation();
+        tree_unlock_shared();
         return 0; // Return 0 on error
     }
     
+    name_index_add(new_inode_num, parent_inode, name, name_len);
+    journal_end_operation();
+    tree_unlock_shared();
     return new_inode_num;
 }
 
-// Helper function: Get directory entry at a specific offset
-DirectoryEntry* get_directory_entry_at_offset(uint8_t *dir_data, uint16_t offset)
+// Helper function: Get directory entry at a specific byte offset of a directory
+// Entries never cross a block boundary, so the offset is mapped to its block through the block map
+// The entry stays valid until bcache_put(*data_block, ...)
+// Returns NULL if the block holding the offset is not allocated
+DirectoryEntry* get_directory_entry_at_offset(Inode *dir_inode, uint32_t offset, uint32_t *data_block)
 {
-    return (DirectoryEntry *)(dir_data + offset);
+    *data_block = inode_bmap(dir_inode, offset / BLOCK_SIZE_BYTES, false);
+    if (*data_block == 0) {
+        return NULL;
+    }
+    return (DirectoryEntry *)(bcache_get(*data_block) + offset % BLOCK_SIZE_BYTES);
 }
 
 // Helper function: Get the offset of the next directory entry
-uint16_t get_next_directory_entry_offset(uint8_t *dir_data, uint16_t current_offset, uint16_t dir_size)
+uint32_t get_next_directory_entry_offset(Inode *dir_inode, uint32_t current_offset)
 {
+    uint32_t dir_size = dir_inode->file_size;
     if (current_offset >= dir_size) {
         return dir_size; // Reached end
     }
-    DirectoryEntry *entry = get_directory_entry_at_offset(dir_data, current_offset);
-    uint16_t next_offset = current_offset + entry->record_length;
+    uint32_t data_block;
+    DirectoryEntry *entry = get_directory_entry_at_offset(dir_inode, current_offset, &data_block);
+    if (entry == NULL) {
+        return dir_size; // Missing block, stop iterating
+    }
+    uint16_t record_length = entry->record_length;
+    bcache_put(data_block, false);
+    if (record_length == 0) {
+        return dir_size; // Corrupt entry, stop iterating
+    }
+    uint32_t next_offset = current_offset + record_length;
     return (next_offset > dir_size) ? dir_size : next_offset;
 }
 
-// Helper function: Find a directory entry by name in a directory
-// Returns the inode number if found, 0 if not found
-uint16_t find_directory_entry(uint16_t dir_inode, const char *name)
+// On-disk size of an entry with a name of name_len bytes (+1 for null terminator)
+static uint16_t directory_entry_size(uint16_t name_len)
 {
-    if (name == NULL || strlen(name) == 0) {
-        return 0;
-    }
-    
-    // Get the directory's inode
-    uint16_t inode_block = INODE_START + (dir_inode / 32);
-    uint16_t inode_offset = (dir_inode % 32) * sizeof(Inode);
-    Inode *dir_inode_ptr = (Inode *)(HARD_DISK[inode_block] + inode_offset);
+    return sizeof(DirectoryEntry) + name_len + 1;
+}
+
+// Returns true for the . and .. entries and for empty entries (e.g. the one starting an index node)
+static bool is_special_directory_entry(DirectoryEntry *entry)
+{
+    return entry->name_length == 0 ||
+           (entry->name_length == 1 && entry->name[0] == '.') ||
+           (entry->name_length == 2 && entry->name[0] == '.' && entry->name[1] == '.');
+}
+
+// Copies the entries of a directory other than . and .. into a malloc'd buffer, one after the
+// other (record_length is the size in the buffer), and sets *size to the bytes used
+// The directory is only locked while it is read, so it can be changed while its copy is made
+// Returns NULL if it is not a directory or memory runs out
+uint8_t* copy_directory_entries(uint16_t dir_inode, uint32_t *size)
+{
+    uint32_t inode_block = INODE_START + (dir_inode / INODES_PER_BLOCK);
+    uint16_t inode_offset = (dir_inode % INODES_PER_BLOCK) * sizeof(Inode);
+    Inode *dir_inode_ptr = (Inode *)(bcache_get(inode_block) + inode_offset);
     
-    // Check if it's actually a directory
+    inode_read_lock(dir_inode);
     if ((dir_inode_ptr->flags & 2) == 0) {
-        return 0; // Not a directory
+        inode_unlock(dir_inode);
+        bcache_put(inode_block, false);
+        return NULL; // Not a directory
     }
     
-    // Get the directory's first data block
-    uint16_t dir_data_block = dir_inode_ptr->directBlocks[0];
-    if (dir_data_block == 0) {
-        return 0; // No data block
-    }
-    
-    uint8_t *dir_data = HARD_DISK[dir_data_block];
-    uint16_t dir_size = dir_inode_ptr->file_size;
-    uint16_t offset = 0;
-    
-    // Iterate through directory entries
-    while (offset < dir_size) {
-        DirectoryEntry *entry = get_directory_entry_at_offset(dir_data, offset);
+    uint32_t capacity = BLOCK_SIZE_BYTES;
+    uint8_t *entries = malloc(capacity);
+    *size = 0;
+    uint32_t dir_size = dir_inode_ptr->file_size;
+    uint32_t offset = 0;
+    while (entries != NULL && offset < dir_size) {
+        uint32_t data_block;
+        DirectoryEntry *entry = get_directory_entry_at_offset(dir_inode_ptr, offset, &data_block);
+        if (entry == NULL) {
+            break; // Missing directory block
+        }
         
-        // Skip . and .. entries
-        if (entry->name_length > 0 && 
-            !(entry->name_length == 1 && entry->name[0] == '.') &&
-            !(entry->name_length == 2 && entry->name[0] == '.' && entry->name[1] == '.')) {
-            
-            // Compare names
-            if (entry->name_length == strlen(name) && 
-                strncmp(entry->name, name, entry->name_length) == 0) {
-                return entry->inode_number;
+        // Skip . and .. entries (and the empty entry starting an index node)
+        if (!is_special_directory_entry(entry)) {
+            // Entries stay 2 byte aligned for inode_number and record_length
+            uint16_t copy_size = (sizeof(DirectoryEntry) + entry->name_length + 2) & ~1u;
+            if (*size + copy_size > capacity) {
+                capacity *= 2;
+                uint8_t *grown = realloc(entries, capacity);
+                if (grown == NULL) {
+                    free(entries);
+                    entries = NULL;
+                    bcache_put(data_block, false);
+                    break;
+                }
+                entries = grown;
             }
+            DirectoryEntry *copy = (DirectoryEntry *)(entries + *size);
+            copy->inode_number = entry->inode_number;
+            copy->record_length = copy_size;
+            copy->name_length = entry->name_length;
+            memcpy(copy->name, entry->name, entry->name_length);
+            copy->name[entry->name_length] = '\0';
+            *size += copy_size;
         }
+        bcache_put(data_block, false);
         
         // Move to next entry
-        offset = get_next_directory_entry_offset(dir_data, offset, dir_size);
+        offset = get_next_directory_entry_offset(dir_inode_ptr, offset);
     }
     
-    return 0; // Not found
+    inode_unlock(dir_inode);
+    bcache_put(inode_block, false);
+    return entries;
 }
 
-// Helper function: Add a directory entry to a directory's data block
-// Returns SUCCESS on success, error code on failure
-int add_directory_entry(uint16_t dir_inode, const char *name, uint16_t target_inode)
+// Fills buffer with the entries of a directory and the attributes of their inodes, resuming at
+// the byte offset *cookie of the directory (the cookie is the offset of the next entry)
+// Each call holds the directory's read lock, and the read lock of each entry's inode while its
+// attributes are copied. Between calls the directory can change: as with getdents(), entries
+// added (or moved when a hashed directory leaf splits) meanwhile may be missed or returned twice
+// Returns the bytes filled, 0 at the end, ERROR_INVALID_INPUT if not a directory or if the
+// buffer cannot hold the next record
+int fs_readdir_plus(uint16_t dir_inode, uint32_t *cookie, void *buffer, size_t buffer_size)
 {
-    if (name == NULL || strlen(name) == 0 || strlen(name) > MAX_FILENAME) {
+    if (cookie == NULL || buffer == NULL || dir_inode >= MAX_INODES) {
         return ERROR_INVALID_INPUT;
     }
+    uint32_t inode_block = INODE_START + (dir_inode / INODES_PER_BLOCK);
+    uint16_t inode_offset = (dir_inode % INODES_PER_BLOCK) * sizeof(Inode);
+    Inode *dir_inode_ptr = (Inode *)(bcache_get(inode_block) + inode_offset);
     
-    // Check if entry already exists
-    if (find_directory_entry(dir_inode, name) != 0) {
-        return ERROR_INVALID_INPUT; // Entry already exists
+    tree_lock_shared(); // The directory may be part of a snapshot being deleted
+    inode_read_lock(dir_inode);
+    if ((dir_inode_ptr->flags & 2) == 0) {
+        inode_unlock(dir_inode);
+        tree_unlock_shared();
+        bcache_put(inode_block, false);
+        return ERROR_INVALID_INPUT; // Not a directory
     }
     
+    uint8_t *out = buffer;
+    size_t filled = 0;
+    bool full = false;
+    uint32_t dir_size = dir_inode_ptr->file_size;
+    uint32_t offset = *cookie;
+    while (offset < dir_size && !full) {
+        // Entries never cross a block boundary: walk the block holding offset in one go
+        uint32_t data_block = inode_bmap(dir_inode_ptr, offset / BLOCK_SIZE_BYTES, false);
+        if (data_block == 0) {
+            offset = dir_size; // Missing directory block, nothing more to list
+            break;
+        }
+        uint8_t *data = bcache_get(data_block);
+        uint32_t block_end = (offset / BLOCK_SIZE_BYTES + 1) * BLOCK_SIZE_BYTES;
+        if (block_end > dir_size) {
+            block_end = dir_size;
+        }
+        while (offset < block_end) {
+            DirectoryEntry *entry = (DirectoryEntry *)(data + offset % BLOCK_SIZE_BYTES);
+            if (entry->record_length == 0) {
+                offset = dir_size; // Corrupt entry, stop listing
+                break;
+            }
+            
+            if (!is_special_directory_entry(entry)) {
+                size_t record_size = (offsetof(DirectoryRecord, name) + entry->name_length + 1 + 7) & ~(size_t)7;
+                if (filled + record_size > buffer_size) {
+                    full = true; // Resume at this entry on the next call
+                    break;
+                }
+                
+                // Attributes of the entry's inode (read locks nest parent before child); in a
+                // snapshot, of the snapshot's version of it, which the lock keeps from being copied
+                uint16_t entry_inode = entry->inode_number;
+                uint32_t entry_inode_block = INODE_START + (entry_inode / INODES_PER_BLOCK);
+                Inode *entry_inode_ptr = (Inode *)(bcache_get(entry_inode_block) + (entry_inode % INODES_PER_BLOCK) * sizeof(Inode));
+                inode_read_lock(entry_inode);
+                Inode attributes = *entry_inode_ptr;
+                bool shown = true;
+                if (session_config->snapshot != 0) {
+                    uint16_t version = snapshot_version(session_config->snapshot, entry_inode);
+                    if (version != entry_inode) {
+                        uint32_t version_block = INODE_START + (version / INODES_PER_BLOCK);
+                        attributes = *(Inode *)(bcache_get(version_block) + (version % INODES_PER_BLOCK) * sizeof(Inode));
+                        bcache_put(version_block, false);
+                    } else if ((attributes.flags & SNAPSHOT_FLAG) != 0) {
+                        shown = false; // /.snapshots, which snapshots do not show
+                    }
+                }
+                inode_unlock(entry_inode);
+                bcache_put(entry_inode_block, false);
+                if (shown) {
+                    DirectoryRecord *record = (DirectoryRecord *)(out + filled);
+                    record->inode_number = entry->inode_number;
+                    record->record_length = record_size;
+                    record->name_length = entry->name_length;
+                    memcpy(record->name, entry->name, entry->name_length);
+                    record->name[entry->name_length] = '\0';
+                    record->file_size = attributes.file_size;
+                    record->mtime = attributes.mtime;
+                    record->permissions = attributes.permissions;
+                    record->type = (attributes.flags & 2) ? RECORD_TYPE_DIRECTORY : RECORD_TYPE_FILE;
+                    filled += record_size;
+                }
+            }
+            offset += entry->record_length;
+        }
+        bcache_put(data_block, false);
+    }
+    if (offset > dir_size) {
+        offset = dir_size;
+    }
+    
+    inode_unlock(dir_inode);
+    tree_unlock_shared();
+    bcache_put(inode_block, false);
+    if (filled == 0 && offset < dir_size) {
+        return ERROR_INVALID_INPUT; // Buffer too small for the next record
+    }
+    *cookie = offset;
+    return filled;
+}
+
+// FNV-1a hash of a name, used to place names in the leaves of a hashed directory
+static uint32_t directory_name_hash(const char *name, uint16_t name_len)
+{
+    uint32_t hash = 2166136261u;
+    for (uint16_t i = 0; i < name_len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Scans the entries in [start, end) of one directory block for name
+// Returns the inode number if found, 0 if not found
+static uint16_t find_entry_in_block(uint8_t *block, uint16_t start, uint16_t end, const char *name, uint16_t name_len)
+{
+    uint16_t offset = start;
+    while (offset < end) {
+        DirectoryEntry *entry = (DirectoryEntry *)(block + offset);
+        if (!is_special_directory_entry(entry) &&
+            entry->name_length == name_len &&
+            strncmp(entry->name, name, name_len) == 0) {
+            return entry->inode_number;
+        }
+        if (entry->record_length == 0) {
+            break; // Corrupt entry, stop scanning
+        }
+        offset += entry->record_length;
+    }
+    return 0;
+}
+
+// Inserts an entry into the first record of a (whole block) directory block with enough slack
+// Returns SUCCESS, or ERROR_INVALID_INPUT if the block is full
+static int insert_entry_in_block(uint8_t *block, const char *name, uint16_t name_len, uint16_t target_inode)
+{
+    uint16_t entry_size = directory_entry_size(name_len);
+    uint16_t offset = 0;
+    while (offset < BLOCK_SIZE_BYTES) {
+        DirectoryEntry *entry = (DirectoryEntry *)(block + offset);
+        if (entry->record_length == 0) {
+            break; // Corrupt entry, treat the block as full
+        }
+        uint16_t used = (entry->name_length == 0) ? 0 : directory_entry_size(entry->name_length);
+        if (entry->record_length - used >= entry_size) {
+            // Split the record: the existing entry keeps what it uses, the new one takes the rest
+            DirectoryEntry *new_entry = (DirectoryEntry *)(block + offset + used);
+            uint16_t new_record_length = entry->record_length - used;
+            if (used != 0) {
+                entry->record_length = used;
+            }
+            new_entry->inode_number = target_inode;
+            new_entry->record_length = new_record_length;
+            new_entry->name_length = name_len;
+            memcpy(new_entry->name, name, name_len);
+            new_entry->name[name_len] = '\0';
+            journal_dirty_address(block);
+            return SUCCESS;
+        }
+        offset += entry->record_length;
+    }
+    return ERROR_INVALID_INPUT;
+}
+
+// Entry of a directory block being redistributed: where it is in the old copy and its name hash
+typedef struct {
+    uint32_t hash;
+    uint16_t offset;
+} SortedDirectoryEntry;
+
+static int compare_sorted_directory_entries(const void *a, const void *b)
+{
+    uint32_t hash_a = ((const SortedDirectoryEntry *)a)->hash;
+    uint32_t hash_b = ((const SortedDirectoryEntry *)b)->hash;
+    return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+// Collects the named entries of a directory block copy, sorted by name hash
+// Returns the number of entries
+static int collect_sorted_entries(uint8_t *block, uint16_t start, uint16_t end, SortedDirectoryEntry *list)
+{
+    int count = 0;
+    uint16_t offset = start;
+    while (offset < end) {
+        DirectoryEntry *entry = (DirectoryEntry *)(block + offset);
+        if (!is_special_directory_entry(entry)) {
+            list[count].hash = directory_name_hash(entry->name, entry->name_length);
+            list[count].offset = offset;
+            count++;
+        }
+        if (entry->record_length == 0) {
+            break;
+        }
+        offset += entry->record_length;
+    }
+    qsort(list, count, sizeof(SortedDirectoryEntry), compare_sorted_directory_entries);
+    return count;
+}
+
+// Writes entries copied from old_block into block, packed from offset 0
+// The last entry's record_length is extended to the end of the block
+static void pack_entries_into_block(uint8_t *block, uint8_t *old_block, SortedDirectoryEntry *list, int count)
+{
+    memset(block, 0, BLOCK_SIZE_BYTES);
+    uint16_t offset = 0;
+    DirectoryEntry *last = NULL;
+    for (int i = 0; i < count; i++) {
+        DirectoryEntry *old_entry = (DirectoryEntry *)(old_block + list[i].offset);
+        uint16_t entry_size = directory_entry_size(old_entry->name_length);
+        last = (DirectoryEntry *)(block + offset);
+        memcpy(last, old_entry, entry_size);
+        last->record_length = entry_size;
+        offset += entry_size;
+    }
+    if (last != NULL) {
+        last->record_length += BLOCK_SIZE_BYTES - offset;
+    }
+    journal_dirty_address(block);
+}
+
+// Index header of the root (block 0) or of an index node of a hashed directory
+// Sets *block to the data block holding it, to be released with bcache_put()
+static DirIndexHeader* get_index_root(Inode *dir, uint32_t *block)
+{
+    *block = inode_bmap(dir, 0, false);
+    return (DirIndexHeader *)(bcache_get(*block) + DIR_INDEX_ROOT_OFFSET);
+}
+
+static DirIndexHeader* get_index_node(Inode *dir, uint32_t logical_block, uint32_t *block)
+{
+    *block = inode_bmap(dir, logical_block, false);
+    return (DirIndexHeader *)(bcache_get(*block) + DIR_INDEX_NODE_OFFSET);
+}
+
+// Returns the data block of a directory's logical block ready to be changed in place: a block
+// still shared with a snapshot's copy of the directory is copied first (see inode_bmap_writable())
+// Returns 0 if the disk is too full for the copy
+static uint32_t directory_block_for_write(Inode *dir, uint32_t logical_block)
+{
+    uint32_t data_block;
+    if (inode_bmap_writable(dir, logical_block, &data_block) != SUCCESS) {
+        return 0;
+    }
+    return data_block;
+}
+
+static DirIndexEntry* get_index_entries(DirIndexHeader *header)
+{
+    return (DirIndexEntry *)(header + 1);
+}
+
+// Binary search for the last index entry whose hash is <= hash (entry 0 always matches)
+static uint16_t search_index(DirIndexHeader *header, uint32_t hash)
+{
+    DirIndexEntry *entries = get_index_entries(header);
+    uint16_t low = 1;
+    uint16_t high = header->count;
+    while (low < high) {
+        uint16_t mid = low + (high - low) / 2;
+        if (entries[mid].hash <= hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low - 1;
+}
+
+// Inserts (hash, block) right after position 'after' of an index block that has room
+static void insert_index_entry(DirIndexHeader *header, uint16_t after, uint32_t hash, uint32_t block)
+{
+    DirIndexEntry *entries = get_index_entries(header);
+    memmove(&entries[after + 2], &entries[after + 1], (header->count - after - 1) * sizeof(DirIndexEntry));
+    entries[after + 1].hash = hash;
+    entries[after + 1].block = block;
+    header->count++;
+    journal_dirty_address(header);
+}
+
+// Where a lookup went through the index: the leaf plus the index slots that lead to it
+typedef struct {
+    uint32_t leaf;      // logical block of the leaf
+    uint32_t node;      // logical block of the index node (only if root levels == 1)
+    uint16_t root_slot; // root entry that was followed
+    uint16_t node_slot; // index node entry that was followed (only if root levels == 1)
+} DirIndexPath;
+
+// Walks the index of a hashed directory to the leaf for hash
+static void find_index_leaf(Inode *dir, uint32_t hash, DirIndexPath *path)
+{
+    uint32_t root_block;
+    DirIndexHeader *root = get_index_root(dir, &root_block);
+    path->root_slot = search_index(root, hash);
+    path->leaf = get_index_entries(root)[path->root_slot].block;
+    path->node = 0;
+    path->node_slot = 0;
+    if (root->levels == 1) {
+        path->node = path->leaf;
+        uint32_t node_block;
+        DirIndexHeader *node = get_index_node(dir, path->node, &node_block);
+        path->node_slot = search_index(node, hash);
+        path->leaf = get_index_entries(node)[path->node_slot].block;
+        bcache_put(node_block, false);
+    }
+    bcache_put(root_block, false);
+}
+
+// Appends a new block to a directory and returns its logical block number (0 if the disk is full)
+static uint32_t append_directory_block(Inode *dir)
+{
+    uint32_t logical_block = dir->file_size / BLOCK_SIZE_BYTES;
+    uint32_t data_block = inode_bmap(dir, logical_block, true);
+    if (data_block == 0) {
+        return 0;
+    }
+    memset(bcache_get(data_block), 0, BLOCK_SIZE_BYTES);
+    journal_dirty_metadata(data_block);
+    bcache_put(data_block, true);
+    dir->file_size += BLOCK_SIZE_BYTES;
+    return logical_block;
+}
+
+// Makes a new index node block: an empty entry spanning the block, then the index header
+// Sets *block to its data block, to be released with bcache_put()
+static DirIndexHeader* init_index_node(Inode *dir, uint32_t logical_block, uint32_t *block)
+{
+    DirIndexHeader *node = get_index_node(dir, logical_block, block);
+    DirectoryEntry *empty = (DirectoryEntry *)((uint8_t *)node - DIR_INDEX_NODE_OFFSET);
+    empty->inode_number = 0;
+    empty->record_length = BLOCK_SIZE_BYTES;
+    empty->name_length = 0;
+    journal_dirty_metadata(*block);
+    node->count = 0;
+    node->limit = (BLOCK_SIZE_BYTES - DIR_INDEX_NODE_OFFSET - sizeof(DirIndexHeader)) / sizeof(DirIndexEntry);
+    node->levels = 0;
+    return node;
+}
+
+// Adds (hash, leaf) to the index after the slots in path, growing the index when it is full:
+// a full root moves its entries to a new index node (levels 0 -> 1), a full node is split in half
+static int add_leaf_to_index(Inode *dir, DirIndexPath *path, uint32_t hash, uint32_t leaf)
+{
+    uint32_t root_block;
+    DirIndexHeader *root = get_index_root(dir, &root_block);
+    if (root->levels == 0) {
+        if (root->count < root->limit) {
+            insert_index_entry(root, path->root_slot, hash, leaf);
+            bcache_put(root_block, true);
+            return SUCCESS;
+        }
+        // Root is full: move its entries to a new index node and point the root at that node
+        uint32_t node_block = append_directory_block(dir);
+        if (node_block == 0) {
+            bcache_put(root_block, false);
+            return ERROR_INVALID_INPUT;
+        }
+        uint32_t node_data_block;
+        DirIndexHeader *node = init_index_node(dir, node_block, &node_data_block);
+        memcpy(get_index_entries(node), get_index_entries(root), root->count * sizeof(DirIndexEntry));
+        node->count = root->count;
+        bcache_put(node_data_block, true);
+        root->count = 1;
+        root->levels = 1;
+        get_index_entries(root)[0].hash = 0;
+        get_index_entries(root)[0].block = node_block;
+        journal_dirty_address(root);
+        path->node = node_block;
+        path->node_slot = path->root_slot;
+        path->root_slot = 0;
+    }
+
+    uint32_t node_data_block;
+    DirIndexHeader *node = get_index_node(dir, path->node, &node_data_block);
+    int result = SUCCESS;
+    if (node->count < node->limit) {
+        insert_index_entry(node, path->node_slot, hash, leaf);
+    } else if (root->count == root->limit) {
+        result = ERROR_INVALID_INPUT; // Directory index is full
+    } else {
+        // Index node is full: move its upper half to a new node and add that node to the root
+        uint32_t new_node_block = append_directory_block(dir);
+        if (new_node_block == 0) {
+            result = ERROR_INVALID_INPUT;
+        } else {
+            uint32_t new_node_data_block;
+            DirIndexHeader *new_node = init_index_node(dir, new_node_block, &new_node_data_block);
+            uint16_t half = node->count / 2;
+            memcpy(get_index_entries(new_node), get_index_entries(node) + half, (node->count - half) * sizeof(DirIndexEntry));
+            new_node->count = node->count - half;
+            node->count = half;
+            journal_dirty_address(node);
+            insert_index_entry(root, path->root_slot, get_index_entries(new_node)[0].hash, new_node_block);
+
+            if (path->node_slot >= half) {
+                insert_index_entry(new_node, path->node_slot - half, hash, leaf);
+            } else {
+                insert_index_entry(node, path->node_slot, hash, leaf);
+            }
+            bcache_put(new_node_data_block, true);
+        }
+    }
+    bcache_put(node_data_block, result == SUCCESS);
+    bcache_put(root_block, result == SUCCESS);
+    return result;
+}
+
+// Splits a full leaf of a hashed directory: names are sorted by hash and the upper half moves
+// to a new leaf, never separating equal hashes so every hash lives in exactly one leaf
+static int split_index_leaf(Inode *dir, DirIndexPath *path)
+{
+    // Make sure the split can complete before moving any entries: the leaf and the index blocks
+    // it changes are made private first, then new leaf + up to two index nodes + an indirect
+    // pointer block must be free
+    uint32_t leaf_block = directory_block_for_write(dir, path->leaf);
+    if (leaf_block == 0 || directory_block_for_write(dir, 0) == 0 ||
+        (path->node != 0 && directory_block_for_write(dir, path->node) == 0)) {
+        return ERROR_INVALID_INPUT;
+    }
+    if (__atomic_load_n(&get_superblock()->free_data_blocks, __ATOMIC_RELAXED) < 4) {
+        return ERROR_INVALID_INPUT;
+    }
+    uint32_t root_block;
+    DirIndexHeader *root = get_index_root(dir, &root_block);
+    bool index_full = false;
+    if (root->levels == 1 && root->count == root->limit) {
+        uint32_t node_block;
+        DirIndexHeader *node = get_index_node(dir, path->node, &node_block);
+        index_full = (node->count == node->limit);
+        bcache_put(node_block, false);
+    }
+    bcache_put(root_block, false);
+    if (index_full) {
+        return ERROR_INVALID_INPUT; // Directory index is full
+    }
+
+    uint8_t old_leaf[MAX_BLOCK_SIZE];
+    memcpy(old_leaf, bcache_get(leaf_block), BLOCK_SIZE_BYTES);
+    bcache_put(leaf_block, false);
+    SortedDirectoryEntry list[MAX_BLOCK_SIZE / sizeof(DirectoryEntry)];
+    int count = collect_sorted_entries(old_leaf, 0, BLOCK_SIZE_BYTES, list);
+
+    // Split at the middle, moved to the nearest hash boundary
+    int split = count / 2;
+    while (split < count && split > 0 && list[split].hash == list[split - 1].hash) {
+        split++;
+    }
+    if (split == count) {
+        split = count / 2;
+        while (split > 0 && list[split].hash == list[split - 1].hash) {
+            split--;
+        }
+    }
+    if (split == 0) {
+        return ERROR_INVALID_INPUT; // Every name in the leaf has the same hash
+    }
+
+    uint32_t new_leaf_block = append_directory_block(dir);
+    if (new_leaf_block == 0) {
+        return ERROR_INVALID_INPUT;
+    }
+    pack_entries_into_block(bcache_get(leaf_block), old_leaf, list, split);
+    bcache_put(leaf_block, true);
+    uint32_t new_leaf_data_block = inode_bmap(dir, new_leaf_block, false);
+    pack_entries_into_block(bcache_get(new_leaf_data_block), old_leaf, list + split, count - split);
+    bcache_put(new_leaf_data_block, true);
+
+    return add_leaf_to_index(dir, path, list[split].hash, new_leaf_block);
+}
+
+// Converts a full single block directory into a hashed directory:
+// its entries move to leaf block 1 and block 0 keeps . and .. with the index root
+static int convert_to_indexed_directory(Inode *dir)
+{
+    if (__atomic_load_n(&get_superblock()->free_data_blocks, __ATOMIC_RELAXED) < 2) {
+        return ERROR_INVALID_INPUT;
+    }
+    uint32_t first_block = directory_block_for_write(dir, 0);
+    if (first_block == 0) {
+        return ERROR_INVALID_INPUT;
+    }
+    uint8_t *first = bcache_get(first_block);
+    uint8_t old_first[MAX_BLOCK_SIZE];
+    memcpy(old_first, first, BLOCK_SIZE_BYTES);
+    uint16_t old_size = dir->file_size;
+
+    dir->file_size = BLOCK_SIZE_BYTES; // Block 0 now spans the whole block
+    uint32_t leaf_block = append_directory_block(dir);
+    if (leaf_block == 0) {
+        dir->file_size = old_size;
+        bcache_put(first_block, false);
+        return ERROR_INVALID_INPUT;
+    }
+    SortedDirectoryEntry list[MAX_BLOCK_SIZE / sizeof(DirectoryEntry)];
+    int count = collect_sorted_entries(old_first, 0, old_size, list);
+    uint32_t leaf_data_block = inode_bmap(dir, leaf_block, false);
+    pack_entries_into_block(bcache_get(leaf_data_block), old_first, list, count);
+    bcache_put(leaf_data_block, true);
+
+    // . stays first, .. now spans the rest of block 0 and hides the index root
+    DirectoryEntry *dot_entry = (DirectoryEntry *)first;
+    DirectoryEntry *dotdot_entry = (DirectoryEntry *)(first + dot_entry->record_length);
+    dotdot_entry->record_length = BLOCK_SIZE_BYTES - dot_entry->record_length;
+
+    DirIndexHeader *root = (DirIndexHeader *)(first + DIR_INDEX_ROOT_OFFSET);
+    memset(root, 0, BLOCK_SIZE_BYTES - DIR_INDEX_ROOT_OFFSET);
+    root->count = 1;
+    root->limit = (BLOCK_SIZE_BYTES - DIR_INDEX_ROOT_OFFSET - sizeof(DirIndexHeader)) / sizeof(DirIndexEntry);
+    root->levels = 0;
+    get_index_entries(root)[0].hash = 0;
+    get_index_entries(root)[0].block = leaf_block;
+
+    journal_dirty_metadata(first_block);
+    bcache_put(first_block, true);
+    dir->flags |= DIR_INDEX_FLAG;
+    return SUCCESS;
+}
+
+// Adds a name to a hashed directory, splitting the target leaf when it is full
+static int add_indexed_directory_entry(Inode *dir, const char *name, uint16_t name_len, uint16_t target_inode)
+{
+    uint32_t hash = directory_name_hash(name, name_len);
+    for (int attempt = 0; attempt < 3; attempt++) {
+        DirIndexPath path;
+        find_index_leaf(dir, hash, &path);
+        uint32_t leaf_block = directory_block_for_write(dir, path.leaf);
+        if (leaf_block == 0) {
+            return ERROR_INVALID_INPUT;
+        }
+        bool inserted = (insert_entry_in_block(bcache_get(leaf_block), name, name_len, target_inode) == SUCCESS);
+        bcache_put(leaf_block, inserted);
+        if (inserted) {
+            return SUCCESS;
+        }
+        int result = split_index_leaf(dir, &path);
+        if (result != SUCCESS) {
+            return result;
+        }
+    }
+    return ERROR_INVALID_INPUT;
+}
+
+// Reads the directory to find name (find_directory_entry() without the dentry cache)
+static uint16_t lookup_directory_entry(uint16_t dir_inode, const char *name, size_t name_len)
+{
     // Get the directory's inode
-    uint16_t inode_block = INODE_START + (dir_inode / 32);
-    uint16_t inode_offset = (dir_inode % 32) * sizeof(Inode);
-    Inode *dir_inode_ptr = (Inode *)(HARD_DISK[inode_block] + inode_offset);
+    uint32_t inode_block = INODE_START + (dir_inode / INODES_PER_BLOCK);
+    uint16_t inode_offset = (dir_inode % INODES_PER_BLOCK) * sizeof(Inode);
+    Inode *dir_inode_ptr = (Inode *)(bcache_get(inode_block) + inode_offset);
     
-    // Check if it's actually a directory
-    if ((dir_inode_ptr->flags & 2) == 0) {
-        return ERROR_INVALID_INPUT; // Not a directory
+    // Check if it's actually a directory, with a data block
+    uint32_t dir_data_block = dir_inode_ptr->directBlocks[0];
+    if ((dir_inode_ptr->flags & 2) == 0 || dir_data_block == 0) {
+        bcache_put(inode_block, false);
+        return 0; // Not a directory, or no data block
     }
     
-    // Get the directory's first data block
-    uint16_t dir_data_block = dir_inode_ptr->directBlocks[0];
-    if (dir_data_block == 0) {
-        return ERROR_INVALID_INPUT; // No data block
+    uint16_t found_inode;
+    if (dir_inode_ptr->flags & DIR_INDEX_FLAG) {
+        DirIndexPath path;
+        find_index_leaf(dir_inode_ptr, directory_name_hash(name, name_len), &path);
+        uint32_t leaf_block = inode_bmap(dir_inode_ptr, path.leaf, false);
+        found_inode = find_entry_in_block(bcache_get(leaf_block), 0, BLOCK_SIZE_BYTES, name, name_len);
+        bcache_put(leaf_block, false);
+    } else {
+        // Single block directory, scan its entries (. and .. are skipped)
+        found_inode = find_entry_in_block(bcache_get(dir_data_block), 0, dir_inode_ptr->file_size, name, name_len);
+        bcache_put(dir_data_block, false);
+    }
+    bcache_put(inode_block, false);
+    return found_inode;
+}
+
+// Helper function: Find a directory entry by name in a directory
+// Returns the inode number if found, 0 if not found
+uint16_t find_directory_entry(uint16_t dir_inode, const char *name)
+{
+    if (name == NULL) {
+        return 0;
+    }
+    return find_directory_entry_n(dir_inode, name, strlen(name));
+}
+
+// Same as find_directory_entry() for a name that is not null terminated (e.g. a path component)
+// Answers from the dentry cache when possible, otherwise reads the directory and caches
+// the result (including "not found")
+uint16_t find_directory_entry_n(uint16_t dir_inode, const char *name, size_t name_len)
+{
+    if (name == NULL || name_len == 0 || name_len > MAX_FILENAME) {
+        return 0;
     }
     
-    uint8_t *dir_data = HARD_DISK[dir_data_block];
-    uint16_t current_size = dir_inode_ptr->file_size;
+    uint16_t found_inode;
+    if (dcache_lookup(dir_inode, name, name_len, &found_inode)) {
+        return found_inode;
+    }
     
-    // Check if we have space (each block is 2048 bytes)
-    uint16_t name_len = strlen(name);
-    uint16_t entry_size = sizeof(DirectoryEntry) + name_len + 1; // +1 for null terminator
+    // Cache the result before releasing the directory, so a concurrent add_directory_entry()
+    // (which invalidates under the write lock) cannot be overtaken by a stale "not found"
+    inode_read_lock(dir_inode);
+    found_inode = lookup_directory_entry(dir_inode, name, name_len);
+    dcache_insert(dir_inode, name, name_len, found_inode);
+    inode_unlock(dir_inode);
+    return found_inode;
+}
+
+// Helper function: Get the parent of a directory from its .. entry (the second entry of block 0)
+// Returns the parent's inode number (0 for root, which is its own parent)
+uint16_t get_parent_directory(uint16_t dir_inode)
+{
+    uint32_t inode_block = INODE_START + (dir_inode / INODES_PER_BLOCK);
+    uint16_t inode_offset = (dir_inode % INODES_PER_BLOCK) * sizeof(Inode);
+    Inode *dir_inode_ptr = (Inode *)(bcache_get(inode_block) + inode_offset);
     
-    if (current_size + entry_size > BLOCK_SIZE_BYTES) {
-        // TODO: Handle case where we need to allocate another block
-        return ERROR_INVALID_INPUT; // Not enough space in current block
+    uint16_t parent_inode = 0;
+    inode_read_lock(dir_inode);
+    uint32_t first_block = dir_inode_ptr->directBlocks[0];
+    if ((dir_inode_ptr->flags & 2) != 0 && first_block != 0) {
+        uint8_t *first = bcache_get(first_block);
+        DirectoryEntry *dot_entry = (DirectoryEntry *)first;
+        DirectoryEntry *dotdot_entry = (DirectoryEntry *)(first + dot_entry->record_length);
+        parent_inode = dotdot_entry->inode_number;
+        bcache_put(first_block, false);
+    }
+    inode_unlock(dir_inode);
+    bcache_put(inode_block, false);
+    return parent_inode;
+}
+
+static int add_directory_entry_locked(uint16_t dir_inode, const char *name, size_t name_len, uint16_t target_inode);
+
+// Helper function: Add a directory entry to a directory
+// Returns SUCCESS on success, error code on failure
+int add_directory_entry(uint16_t dir_inode, const char *name, uint16_t target_inode)
+{
+    if (name == NULL) {
+        return ERROR_INVALID_INPUT;
+    }
+    return add_directory_entry_n(dir_inode, name, strlen(name), target_inode);
+}
+
+// Same as add_directory_entry() for a name that is not null terminated (e.g. a path component)
+// A single block directory is converted to a hashed directory when its block is full
+int add_directory_entry_n(uint16_t dir_inode, const char *name, size_t name_len, uint16_t target_inode)
+{
+    if (name == NULL || name_len == 0 || name_len > MAX_FILENAME) {
+        return ERROR_INVALID_INPUT;
     }
     
-    // Create the new directory entry at the end
-    DirectoryEntry *new_entry = (DirectoryEntry *)(dir_data + current_size);
-    new_entry->inode_number = target_inode;
-    new_entry->name_length = name_len;
-    new_entry->record_length = entry_size;
+    // The duplicate check and the insert happen under the directory's write lock,
+    // so two threads cannot add the same name
+    tree_lock_shared();
+    journal_begin_operation();
+    inode_write_lock(dir_inode);
+    int result = snapshot_preserve(dir_inode); // Snapshots that still share the directory keep a copy
+    if (result == SUCCESS) {
+        result = add_directory_entry_locked(dir_inode, name, name_len, target_inode);
+    }
+    if (result == SUCCESS) {
+        // The name now exists, drop the cached "not found" left by earlier lookups
+        dcache_invalidate(dir_inode, name, name_len);
+    }
+    inode_unlock(dir_inode);
+    journal_end_operation();
+    tree_unlock_shared();
+    return result;
+}
+
+// add_directory_entry_n() body, called with the directory's write lock held
+static int add_directory_entry_locked(uint16_t dir_inode, const char *name, size_t name_len, uint16_t target_inode)
+{
+    // Check if entry already exists (read the directory, the cache may be behind)
+    if (lookup_directory_entry(dir_inode, name, name_len) != 0) {
+        return ERROR_INVALID_INPUT; // Entry already exists
+    }
     
-    // Copy the name (including null terminator)
-    memcpy(new_entry->name, name, name_len);
-    new_entry->name[name_len] = '\0';
+    // Get the directory's inode
+    uint32_t inode_block = INODE_START + (dir_inode / INODES_PER_BLOCK);
+    uint16_t inode_offset = (dir_inode % INODES_PER_BLOCK) * sizeof(Inode);
+    Inode *dir_inode_ptr = (Inode *)(bcache_get(inode_block) + inode_offset);
     
-    // Update directory inode's file_size
-    dir_inode_ptr->file_size = current_size + entry_size;
-    dir_inode_ptr->mtime = time(NULL); // Update modification time
+    // Check if it's actually a directory, with a data block
+    uint32_t dir_data_block = dir_inode_ptr->directBlocks[0];
+    if ((dir_inode_ptr->flags & 2) == 0 || dir_data_block == 0) {
+        bcache_put(inode_block, false);
+        return ERROR_INVALID_INPUT; // Not a directory, or no data block
+    }
+    journal_dirty_metadata(inode_block); // size, block map and mtime change below
     
-    // Write back the updated inode
-    memcpy(HARD_DISK[inode_block] + inode_offset, dir_inode_ptr, sizeof(Inode));
+    uint16_t entry_size = directory_entry_size(name_len);
+    int result = SUCCESS;
+    
+    if ((dir_inode_ptr->flags & DIR_INDEX_FLAG) == 0 &&
+        dir_inode_ptr->file_size + entry_size <= BLOCK_SIZE_BYTES) {
+        // Room left in the single block: create the new directory entry at the end
+        dir_data_block = directory_block_for_write(dir_inode_ptr, 0);
+        if (dir_data_block == 0) {
+            bcache_put(inode_block, true); // Pointer blocks may have been copied
+            return ERROR_INVALID_INPUT;
+        }
+        uint8_t *dir_data = bcache_get(dir_data_block);
+        uint16_t current_size = dir_inode_ptr->file_size;
+        DirectoryEntry *new_entry = (DirectoryEntry *)(dir_data + current_size);
+        new_entry->inode_number = target_inode;
+        new_entry->name_length = name_len;
+        new_entry->record_length = entry_size;
+        
+        // Copy the name (including null terminator)
+        memcpy(new_entry->name, name, name_len);
+        new_entry->name[name_len] = '\0';
+        
+        // Update directory inode's file_size
+        dir_inode_ptr->file_size = current_size + entry_size;
+        journal_dirty_metadata(dir_data_block);
+        bcache_put(dir_data_block, true);
+    } else {
+        if ((dir_inode_ptr->flags & DIR_INDEX_FLAG) == 0) {
+            result = convert_to_indexed_directory(dir_inode_ptr);
+        }
+        if (result == SUCCESS) {
+            result = add_indexed_directory_entry(dir_inode_ptr, name, name_len, target_inode);
+        }
+        if (result != SUCCESS) {
+            bcache_put(inode_block, true); // The block map may have grown
+            return result;
+        }
+    }
+    
+    dir_inode_ptr->mtime = time(NULL); // Update modification time
+    bcache_put(inode_block, true);
     
     return SUCCESS;
 }
+
+// Removes the entry for the first name_len bytes of name from directory dir_inode (the inode it
+// names is left alone). Its space goes to the previous entry of its block, or the entry is left
+// empty if it starts its block; the last entry of a single block directory shrinks the directory
+// Returns SUCCESS, or ERROR_FILE_NOT_FOUND if there is no such entry
+int remove_directory_entry_n(uint16_t dir_inode, const char *name, size_t name_len)
+{
+    if (name == NULL || name_len == 0 || name_len > MAX_FILENAME) {
+        return ERROR_INVALID_INPUT;
+    }
+    
+    tree_lock_shared();
+    journal_begin_operation();
+    inode_write_lock(dir_inode);
+    uint32_t inode_block = INODE_START + (dir_inode / INODES_PER_BLOCK);
+    Inode *dir = (Inode *)(bcache_get(inode_block) + (dir_inode % INODES_PER_BLOCK) * sizeof(Inode));
+    int result = ERROR_FILE_NOT_FOUND;
+    if ((dir->flags & 2) != 0 && dir->directBlocks[0] != 0) {
+        // The block the name is in, and where its entries end
+        bool indexed = (dir->flags & DIR_INDEX_FLAG) != 0;
+        uint32_t logical_block = 0;
+        uint32_t end = dir->file_size;
+        if (indexed) {
+            DirIndexPath path;
+            find_index_leaf(dir, directory_name_hash(name, name_len), &path);
+            logical_block = path.leaf;
+            end = BLOCK_SIZE_BYTES;
+        }
+        uint32_t data_block = inode_bmap(dir, logical_block, false);
+        uint8_t *data = bcache_get(data_block);
+        uint32_t previous = end; // None
+        uint32_t offset = 0;
+        while (offset < end) {
+            DirectoryEntry *entry = (DirectoryEntry *)(data + offset);
+            if (!is_special_directory_entry(entry) && entry->name_length == name_len &&
+                strncmp(entry->name, name, name_len) == 0) {
+                break;
+            }
+            if (entry->record_length == 0) {
+                offset = end; // Corrupt entry, stop scanning
+                break;
+            }
+            previous = offset;
+            offset += entry->record_length;
+        }
+        if (offset < end) {
+            // Snapshots that still share the directory or the block keep them as they are
+            uint32_t writable_block = 0;
+            result = snapshot_preserve(dir_inode);
+            if (result == SUCCESS) {
+                writable_block = directory_block_for_write(dir, logical_block);
+                result = (writable_block != 0) ? SUCCESS : ERROR_INVALID_INPUT;
+            }
+            if (writable_block != 0 && writable_block != data_block) {
+                bcache_put(data_block, false);
+                data_block = writable_block;
+                data = bcache_get(data_block); // A copy, the same entries at the same offsets
+            }
+        }
+        if (result == SUCCESS) {
+            DirectoryEntry *entry = (DirectoryEntry *)(data + offset);
+            if (!indexed && offset + entry->record_length >= end) {
+                dir->file_size = offset; // New entries are appended here again
+            } else if (previous != end) {
+                ((DirectoryEntry *)(data + previous))->record_length += entry->record_length;
+            } else {
+                entry->inode_number = 0;
+                entry->name_length = 0;
+                entry->name[0] = '\0';
+            }
+            journal_dirty_metadata(data_block);
+            dir->mtime = time(NULL);
+            journal_dirty_metadata(inode_block);
+            dcache_invalidate(dir_inode, name, name_len);
+        }
+        bcache_put(data_block, result == SUCCESS);
+    }
+    inode_unlock(dir_inode);
+    bcache_put(inode_block, result == SUCCESS);
+    journal_end_operation();
+    tree_unlock_shared();
+    return result;
+}
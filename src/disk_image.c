@@ -0,0 +1,513 @@
+// fcntl.h must come before common.h: common.h reuses O_RDWR/O_CREAT as fs_open() flags,
+// so the host values are captured here for open() and the names are handed back to common.h
+#include <fcntl.h>
+static const int HOST_O_RDWR = O_RDWR;
+static const int HOST_O_CREAT = O_CREAT;
+#undef O_RDONLY
+#undef O_WRONLY
+#undef O_RDWR
+#undef O_CREAT
+#undef O_TRUNC
+
+#include "headers/common.h"
+#include "headers/disk_image.h"
+#include "headers/utils.h"
+#include "headers/dcache.h"
+#include "headers/journal.h"
+#include "headers/bcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+
+// Layout of the disk in use: the in-memory disk's, or the mounted image's
+// All zero until the first format (or mount), which sets up the default geometry if none was given
+DiskLayout disk_layout;
+
+// HARD DISK - actual storage array
+// HARD_DISK points at the in-memory disk by default; blocks are accessed through bcache.c, which
+// hands out blocks of HARD_DISK directly. While an image file is mounted the blocks live in the
+// block cache instead and HARD_DISK is NULL
+// Changes to cached blocks reach the file through the journal (metadata) and the cache's write
+// back (data), in an order that keeps the image consistent after a crash
+// The in-memory disk is mapped when its geometry is set, so only the pages in use take memory;
+// mappings are page aligned so bitmap blocks can be scanned in 64-bit words
+static uint8_t *MEMORY_DISK;
+static size_t memory_disk_bytes;
+static DiskLayout memory_disk_layout; // disk_layout again once an image is unmounted
+uint8_t *HARD_DISK;
+
+// File descriptor of the mounted image, -1 when running on MEMORY_DISK
+static int disk_image_fd = -1;
+
+// Blocks of MEMORY_DISK that may still hold old contents: formatting only clears the blocks the
+// format initializes, the others are zero filled when first handed out (zero_stale_blocks())
+// Set bits are changed atomically, a byte can cover blocks of two regions
+static uint8_t *stale_blocks;
+
+// The same for the mounted image: ftruncate() zero fills a new or formatted image, but the data
+// blocks that were free when an existing image was mounted may hold old contents
+static uint8_t *image_stale_blocks;
+
+// Zero fills the stale blocks among count blocks from first, before they are used for the first
+// time since the format or since they were freed. On an image the zeros go through the cache
+// like file data, so they reach the image before the metadata that hands the block out
+void zero_stale_blocks(uint32_t first, uint32_t count)
+{
+    uint8_t *stale = (disk_image_fd >= 0) ? image_stale_blocks : stale_blocks;
+    for (uint64_t block = first; block < (uint64_t)first + count && block < BLOCK_NUM; block++) {
+        uint8_t mask = 1 << (block % 8);
+        if ((__atomic_load_n(&stale[block / 8], __ATOMIC_RELAXED) & mask) == 0) {
+            continue;
+        }
+        if (disk_image_fd >= 0) {
+            memset(bcache_get(block), 0, BLOCK_SIZE_BYTES);
+            journal_dirty_data(block);
+            bcache_put(block, true);
+        } else {
+            memset(MEMORY_DISK + block * BLOCK_SIZE_BYTES, 0, BLOCK_SIZE_BYTES);
+        }
+        __atomic_fetch_and(&stale[block / 8], (uint8_t)~mask, __ATOMIC_RELAXED);
+    }
+}
+
+// Marks count blocks from first stale: freeing a data block only clears its bitmap bit, and it is
+// zero filled when it is allocated again
+void mark_stale_blocks(uint32_t first, uint32_t count)
+{
+    uint8_t *stale = (disk_image_fd >= 0) ? image_stale_blocks : stale_blocks;
+    for (uint64_t block = first; block < (uint64_t)first + count && block < BLOCK_NUM; block++) {
+        __atomic_fetch_or(&stale[block / 8], (uint8_t)(1 << (block % 8)), __ATOMIC_RELAXED);
+    }
+}
+
+// Blocks needed for bytes bytes
+static uint64_t blocks_for(uint64_t bytes, uint32_t block_size)
+{
+    return (bytes + block_size - 1) / block_size;
+}
+
+// Computes where every region of a disk of the given geometry goes (0 fields take the defaults)
+// Returns SUCCESS, or ERROR_INVALID_INPUT if the geometry is not supported or leaves no room
+// for data blocks
+int compute_disk_layout(const DiskGeometry *geometry, DiskLayout *layout)
+{
+    uint32_t block_size = (geometry->block_size != 0) ? geometry->block_size : DEFAULT_BLOCK_SIZE;
+    uint64_t block_num = (geometry->block_num != 0) ? geometry->block_num : DEFAULT_BLOCK_NUM;
+    uint64_t inode_count = (geometry->inode_count != 0) ? geometry->inode_count : DEFAULT_INODE_COUNT;
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        return ERROR_INVALID_INPUT;
+    }
+    // Whole inode table blocks, and whole 64-bit words of the inode bitmaps
+    uint32_t inodes_per_block = block_size / sizeof(Inode);
+    uint32_t inode_unit = (inodes_per_block > 64) ? inodes_per_block : 64;
+    inode_count = (inode_count + inode_unit - 1) / inode_unit * inode_unit;
+    if (inode_count > MAX_INODE_COUNT) {
+        return ERROR_INVALID_INPUT;
+    }
+
+    uint64_t bits_per_block = (uint64_t)block_size * 8;
+    uint64_t block = 1; // After the superblock
+    layout->inode_bitmap_start = block;
+    block += blocks_for(inode_count, bits_per_block);
+    layout->data_bitmap_start = block;
+    block += blocks_for(block_num, bits_per_block); // Covers the whole disk, the data blocks are fewer
+    layout->refcount_start = block;
+    block += blocks_for(block_num * sizeof(uint32_t), block_size);
+    layout->inode_start = block;
+    block += inode_count / inodes_per_block;
+    layout->root_directory = block;
+    block += 1;
+    layout->kernel_memory_start = block;
+    block += blocks_for((uint64_t)MAX_FILE_DESCRIPTORS * sizeof(FileDescriptor), block_size);
+    layout->journal_start = block;
+    block += JOURNAL_BLOCKS;
+    layout->name_index_start = block;
+    block += blocks_for(inode_count * NAME_INDEX_SLOT_SIZE, block_size) +
+             NAME_INDEX_BUCKETS * blocks_for(inode_count / 8, block_size);
+    layout->data_start = block;
+    if (block + DIRECT_BLOCKS > block_num) {
+        return ERROR_INVALID_INPUT; // Too small to hold anything
+    }
+    layout->block_size = block_size;
+    layout->block_num = block_num;
+    layout->inode_count = inode_count;
+    return SUCCESS;
+}
+
+// Parses "block_size[,blocks[,inodes]]" into a geometry (omitted numbers are 0, the defaults)
+// Returns false if the text is not of that form; the numbers are checked by compute_disk_layout()
+bool parse_disk_geometry(const char *text, DiskGeometry *geometry)
+{
+    memset(geometry, 0, sizeof(DiskGeometry));
+    char *end;
+    geometry->block_size = (uint32_t)strtoul(text, &end, 0);
+    if (*end == ',') {
+        geometry->block_num = (uint32_t)strtoul(end + 1, &end, 0);
+        if (*end == ',') {
+            geometry->inode_count = (uint32_t)strtoul(end + 1, &end, 0);
+        }
+    }
+    return end != text && *end == '\0';
+}
+
+// Maps a zero filled in-memory disk for the geometry in memory_disk_layout (in place of the old one)
+// Returns SUCCESS, or ERROR_IO if there is not enough address space
+static int map_memory_disk(void)
+{
+    size_t bytes = (size_t)memory_disk_layout.block_num * memory_disk_layout.block_size;
+    if (MEMORY_DISK != NULL) {
+        munmap(MEMORY_DISK, memory_disk_bytes);
+        free(stale_blocks);
+        MEMORY_DISK = NULL;
+        stale_blocks = NULL;
+    }
+    void *disk = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    stale_blocks = calloc((memory_disk_layout.block_num + 7) / 8, 1);
+    if (disk == MAP_FAILED || stale_blocks == NULL) {
+        if (disk != MAP_FAILED) {
+            munmap(disk, bytes);
+        }
+        free(stale_blocks);
+        stale_blocks = NULL;
+        memset(&memory_disk_layout, 0, sizeof(DiskLayout));
+        return ERROR_IO;
+    }
+    MEMORY_DISK = disk;
+    memory_disk_bytes = bytes;
+    return SUCCESS;
+}
+
+// Writes a fresh superblock describing the disk layout
+// should be called once when formatting, together with create_root_directory()
+void init_superblock()
+{
+    Superblock *sb = get_superblock();
+    memset(sb, 0, BLOCK_SIZE_BYTES);
+    sb->magic = FS_MAGIC;
+    sb->version = FS_VERSION;
+    sb->block_num = BLOCK_NUM;
+    sb->block_size = BLOCK_SIZE_BYTES;
+    sb->inode_start = INODE_START;
+    sb->inode_end = INODE_END;
+    sb->data_start = DATA_START;
+    sb->data_end = DATA_END;
+    sb->inode_hint = 0; // allocators clamp the hint to their first usable index
+    sb->data_hint = 0;
+    sb->ctime = time(NULL);
+    sb->mtime = sb->ctime;
+    sb->journal_start = JOURNAL_START;
+    sb->journal_end = JOURNAL_END;
+    sb->refcount_start = REFCOUNT_START;
+    sb->refcount_end = REFCOUNT_END;
+    sb->name_index_start = NAME_INDEX_START;
+    sb->name_index_end = NAME_INDEX_END;
+    sb->name_index_enabled = 0;
+    sb->inode_count = MAX_INODES;
+    sb->inode_bitmap_start = FREE_INODE_BITMAP;
+    sb->data_bitmap_start = FREE_DATA_BITMAP;
+    sb->root_directory = ROOT_DIRECTORY;
+    sb->kernel_memory_start = KERNEL_MEMORY_START;
+    recount_free_blocks();
+    journal_dirty_metadata(SUPERBLOCK);
+}
+
+// Returns true if sb is a superblock whose regions are where its geometry puts them, and sets
+// *layout to that layout
+static bool superblock_layout(const Superblock *sb, DiskLayout *layout)
+{
+    DiskGeometry geometry = { sb->block_size, sb->block_num, sb->inode_count };
+    if (sb->magic != FS_MAGIC || sb->version != FS_VERSION || geometry.block_size == 0 ||
+        geometry.block_num == 0 || geometry.inode_count == 0 ||
+        compute_disk_layout(&geometry, layout) != SUCCESS) {
+        return false;
+    }
+    return layout->block_size == sb->block_size &&
+           layout->block_num == sb->block_num &&
+           layout->inode_count == sb->inode_count &&
+           layout->inode_bitmap_start == sb->inode_bitmap_start &&
+           layout->data_bitmap_start == sb->data_bitmap_start &&
+           layout->refcount_start == sb->refcount_start &&
+           layout->inode_start - 1 == sb->refcount_end &&
+           layout->inode_start == sb->inode_start &&
+           layout->root_directory - 1 == sb->inode_end &&
+           layout->root_directory == sb->root_directory &&
+           layout->kernel_memory_start == sb->kernel_memory_start &&
+           layout->journal_start == sb->journal_start &&
+           layout->journal_start + JOURNAL_BLOCKS - 1 == sb->journal_end &&
+           layout->name_index_start == sb->name_index_start &&
+           layout->data_start - 1 == sb->name_index_end &&
+           layout->data_start == sb->data_start &&
+           layout->block_num == sb->data_end;
+}
+
+// Returns true if block SUPERBLOCK holds a superblock matching the disk layout in use
+bool superblock_is_valid()
+{
+    DiskLayout layout;
+    return superblock_layout(get_superblock(), &layout) && memcmp(&layout, &disk_layout, sizeof(DiskLayout)) == 0;
+}
+
+// Reads the superblock at the start of an image file, before the block size is known
+// Returns true if it holds a valid superblock (*layout is then its layout), false for anything
+// else, including an all zero block
+static bool read_image_superblock(int image_fd, DiskLayout *layout)
+{
+    Superblock sb;
+    return pread(image_fd, &sb, sizeof(Superblock), 0) == (ssize_t)sizeof(Superblock) && superblock_layout(&sb, layout);
+}
+
+// Attaches the block cache and the journal to an image file of the current disk layout
+static int open_image_device(int image_fd)
+{
+    free(image_stale_blocks);
+    image_stale_blocks = calloc((BLOCK_NUM + 7) / 8, 1);
+    if (image_stale_blocks == NULL || bcache_open(image_fd) != SUCCESS) {
+        free(image_stale_blocks);
+        image_stale_blocks = NULL;
+        return ERROR_IO;
+    }
+    disk_image_fd = image_fd;
+    HARD_DISK = NULL; // Every block access goes through the cache now
+    if (journal_open(image_fd) != SUCCESS) {
+        bcache_close();
+        disk_image_fd = -1;
+        HARD_DISK = MEMORY_DISK;
+        free(image_stale_blocks);
+        image_stale_blocks = NULL;
+        return ERROR_IO;
+    }
+    return SUCCESS;
+}
+
+// Mounts a disk image file behind the block cache, creating it if it does not exist
+// The geometry of an existing image comes from its superblock; a new image gets the geometry in
+// use (the default one if nothing was formatted yet), format_disk() can change it
+// Transactions left in the journal by a crash are replayed first
+// Returns SUCCESS if an existing file system was mounted, ERROR_NO_FILESYSTEM if the
+// image is new and still needs format_disk(), or a negative error
+// Blocks are read on first access, so mounting does not touch the whole image
+int mount_disk_image(const char *image_path)
+{
+    if (image_path == NULL || disk_image_fd >= 0) {
+        return ERROR_INVALID_INPUT;
+    }
+
+    int image_fd = open(image_path, HOST_O_RDWR | HOST_O_CREAT, 0644);
+    if (image_fd < 0) {
+        return ERROR_IO;
+    }
+
+    struct stat st;
+    if (fstat(image_fd, &st) != 0) {
+        close(image_fd);
+        return ERROR_IO;
+    }
+
+    // An all zero superblock means a crash before the format completed (format_disk() puts the
+    // superblock home before it returns): still a new image
+    DiskLayout layout;
+    bool new_image = (st.st_size == 0);
+    if (!new_image && !read_image_superblock(image_fd, &layout)) {
+        uint32_t magic = 0;
+        if (pread(image_fd, &magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) || magic != 0) {
+            close(image_fd);
+            return ERROR_INVALID_INPUT; // Refuse to use (and later overwrite) a file that is not one of our images
+        }
+        new_image = true;
+    }
+    if (new_image) {
+        DiskGeometry geometry = { BLOCK_SIZE_BYTES, BLOCK_NUM, MAX_INODES }; // 0 until the first format: defaults
+        compute_disk_layout(&geometry, &layout);
+    }
+
+    // A new image is grown to full size; ftruncate leaves it sparse and zero filled
+    off_t image_bytes = (off_t)layout.block_num * layout.block_size;
+    if (new_image && (ftruncate(image_fd, 0) != 0 || ftruncate(image_fd, image_bytes) != 0)) {
+        close(image_fd);
+        return ERROR_IO;
+    }
+    if (!new_image && st.st_size != image_bytes) {
+        close(image_fd);
+        return ERROR_INVALID_INPUT; // Not the size its superblock says
+    }
+
+    // Bring the file up to date before caching any of it
+    disk_layout = layout;
+    if (!new_image && journal_recover(image_fd) < 0) {
+        disk_layout = memory_disk_layout;
+        close(image_fd);
+        return ERROR_IO;
+    }
+    if (open_image_device(image_fd) != SUCCESS) {
+        disk_layout = memory_disk_layout;
+        close(image_fd);
+        return ERROR_IO;
+    }
+    dcache_invalidate_all(); // Cached names refer to the previous disk
+
+    if (new_image) {
+        return ERROR_NO_FILESYSTEM;
+    }
+    if (!superblock_is_valid()) {
+        unmount_disk_image(); // Replay left something else there
+        return ERROR_INVALID_INPUT;
+    }
+
+    // File descriptors from a previous run are stale, start with an empty table
+    // (the table is never written back, see allocate_file_descriptor())
+    for (uint32_t block = KERNEL_MEMORY_START; block <= KERNEL_MEMORY_END; block++) {
+        memset(bcache_pin(block), 0, BLOCK_SIZE_BYTES);
+    }
+
+    Superblock *sb = get_superblock();
+    sb->mtime = time(NULL);
+    journal_dirty_metadata(SUPERBLOCK);
+
+    // The bitmaps are authoritative, the counts only need the bitmap blocks to rebuild
+    recount_free_blocks();
+
+    // Blocks freed before the image was last closed still hold their old contents: every data
+    // block counts as stale (the bits of allocated ones are only looked at after a free)
+    mark_stale_blocks(DATA_START, DATA_END - DATA_START);
+
+    return SUCCESS;
+}
+
+// Makes every change so far durable in the mounted image (commits the journal)
+// Returns SUCCESS (also when running on the in-memory disk) or ERROR_IO
+int sync_disk_image()
+{
+    if (disk_image_fd < 0) {
+        return SUCCESS; // Nothing to flush for the in-memory disk
+    }
+    return journal_commit();
+}
+
+// Clears the blocks a format initializes and marks all the others stale
+static void clear_memory_disk(void)
+{
+    memset(MEMORY_DISK, 0, (size_t)(KERNEL_MEMORY_END + 1) * BLOCK_SIZE_BYTES);
+    memset(stale_blocks, 0xff, (BLOCK_NUM + 7) / 8);
+    for (uint32_t block = 0; block <= KERNEL_MEMORY_END; block++) {
+        stale_blocks[block / 8] &= ~(1 << (block % 8));
+    }
+}
+
+// Makes the in-memory disk the disk in use, cleared and mapped for layout, after a mounted image
+// failed (clear_disk_image(), set_disk_geometry())
+static void fall_back_to_memory_disk(const DiskLayout *layout)
+{
+    if (MEMORY_DISK == NULL || memcmp(&memory_disk_layout, layout, sizeof(DiskLayout)) != 0) {
+        memory_disk_layout = *layout;
+        map_memory_disk();
+    }
+    disk_layout = memory_disk_layout;
+    HARD_DISK = MEMORY_DISK;
+    if (MEMORY_DISK != NULL) {
+        clear_memory_disk();
+    }
+}
+
+// Zero fills the disk (before formatting it)
+// The in-memory disk only has the blocks up to the file descriptor table cleared (superblock,
+// bitmaps, share counts, inode table, root directory): everything else is found through them,
+// and the journal, name index and data blocks are zero filled on first use (zero_stale_blocks())
+// A mounted image is truncated, which is cheaper than writing zeros to it, and the cached
+// blocks are zeroed to match
+// Returns SUCCESS, or ERROR_IO if the image could not be truncated (the image is then unmounted
+// and HARD_DISK is the in-memory disk)
+int clear_disk_image()
+{
+    if (BLOCK_SIZE_BYTES == 0) {
+        int result = set_disk_geometry(NULL); // First use: the default geometry
+        if (result != SUCCESS) {
+            return result;
+        }
+    }
+    if (disk_image_fd < 0) {
+        clear_memory_disk();
+        return SUCCESS;
+    }
+    // Forget the journal first: nothing of the old contents may be written back
+    int result = journal_format();
+    bcache_invalidate();
+    off_t image_bytes = (off_t)BLOCK_NUM * BLOCK_SIZE_BYTES;
+    if (ftruncate(disk_image_fd, 0) != 0 || ftruncate(disk_image_fd, image_bytes) != 0) {
+        DiskLayout layout = disk_layout;
+        unmount_disk_image();
+        fall_back_to_memory_disk(&layout);
+        return ERROR_IO;
+    }
+    memset(image_stale_blocks, 0, (BLOCK_NUM + 7) / 8); // All zeros now
+    return result;
+}
+
+// Changes the geometry of the disk in use (NULL: the default geometry), which loses its contents;
+// format_disk() does this before it formats
+// The in-memory disk is mapped again at its new size, a mounted image is truncated to its new
+// size and its block cache and journal start over with the new block size
+// Returns SUCCESS, ERROR_INVALID_INPUT for an unsupported geometry, or ERROR_IO (a mounted image
+// is then unmounted)
+int set_disk_geometry(const DiskGeometry *geometry)
+{
+    DiskGeometry defaults = { 0, 0, 0 };
+    DiskLayout layout;
+    if (compute_disk_layout(geometry != NULL ? geometry : &defaults, &layout) != SUCCESS) {
+        return ERROR_INVALID_INPUT;
+    }
+    if (memcmp(&layout, &disk_layout, sizeof(DiskLayout)) == 0) {
+        return SUCCESS; // Same geometry, nothing to resize
+    }
+    if (disk_image_fd < 0) {
+        memory_disk_layout = layout;
+        int result = map_memory_disk();
+        disk_layout = memory_disk_layout;
+        HARD_DISK = MEMORY_DISK;
+        dcache_invalidate_all();
+        return result;
+    }
+
+    // Nothing of the old contents may be written back: drop the journal and the cache, which
+    // are sized for the old geometry, then resize the image
+    int image_fd = disk_image_fd;
+    journal_format();
+    bcache_invalidate();
+    journal_close();
+    bcache_close();
+    disk_image_fd = -1;
+    disk_layout = layout;
+    off_t image_bytes = (off_t)BLOCK_NUM * BLOCK_SIZE_BYTES;
+    if (ftruncate(image_fd, 0) != 0 || ftruncate(image_fd, image_bytes) != 0 ||
+        open_image_device(image_fd) != SUCCESS) {
+        close(image_fd);
+        fall_back_to_memory_disk(&layout);
+        return ERROR_IO;
+    }
+    dcache_invalidate_all();
+    return SUCCESS;
+}
+
+// Commits and checkpoints the journal, writes back the cache and closes the mounted image;
+// HARD_DISK falls back to the in-memory disk, with its own geometry
+void unmount_disk_image()
+{
+    if (disk_image_fd < 0) {
+        return;
+    }
+    journal_close();
+    bcache_close();
+    close(disk_image_fd);
+    disk_image_fd = -1;
+    free(image_stale_blocks);
+    image_stale_blocks = NULL;
+    HARD_DISK = MEMORY_DISK;
+    disk_layout = memory_disk_layout;
+    dcache_invalidate_all();
+}
@@ -2,6 +2,14 @@
 #include "headers/utils.h"
 #include "headers/file_operations.h"
 #include "headers/directory_operations.h"
+#include "headers/dcache.h"
+#include "headers/locks.h"
+#include "headers/journal.h"
+#include "headers/disk_image.h"
+#include "headers/bcache.h"
+#include "headers/search.h"
+#include "headers/name_index.h"
+#include "headers/snapshot.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,13 +20,44 @@
 #include <stdint.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <pthread.h>
 
-// Global session configuration
-SessionConfig *session_config;
+// Session configuration of the calling thread, set with init_session()
+_Thread_local SessionConfig *session_config;
 
-// HARD DISK - actual storage array
-// 16 bits is enough for number of blocks 2^16=65536>16384, each block is 2KiB
-uint8_t HARD_DISK[BLOCK_NUM][BLOCK_SIZE_BYTES];
+// Striped locks serializing fs_read()/fs_write() on the same descriptor, so the
+// offset read, the I/O and the offset update happen as one step
+#define FD_LOCK_STRIPES 64
+static pthread_mutex_t fd_locks[FD_LOCK_STRIPES];
+static pthread_once_t fd_locks_once = PTHREAD_ONCE_INIT;
+
+static void init_fd_locks(void)
+{
+    for (int i = 0; i < FD_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&fd_locks[i], NULL);
+    }
+}
+
+static pthread_mutex_t* get_fd_lock(uint16_t file_descriptor)
+{
+    pthread_once(&fd_locks_once, init_fd_locks);
+    return &fd_locks[file_descriptor % FD_LOCK_STRIPES];
+}
+
+// Make config the session of the calling thread, starting as uid in the root directory
+// Every thread that calls into the file system needs its own session
+void init_session(SessionConfig *config, uint16_t uid)
+{
+    config->uid = uid;
+    strcpy(config->current_working_dir, "/");
+    config->current_dir_inode = 0;
+    config->root_inode = 0;
+    config->snapshot = 0;
+    config->read_only = false;
+    config->show_hidden_files = false;
+    config->verbose_mode = true;
+    session_config = config;
+}
 
 // should not be called by itself, already called in create_file()
 void init_file_inode(uint16_t inode_number)
@@ -27,83 +66,81 @@ void init_file_inode(uint16_t inode_number)
     in->ownerID = session_config->uid;            // set creator/owner to current session user
     in->permissions = 420;                        // 0000000rw-r--r--, owner, group, other/world i.e. 4+32+128+256=420
     in->file_size = 0;                            // in bytes, empty file initially
-    in->directBlocks[0] = find_free_data_block(); // initialize first block
-    for (int i = 1; i < 6; i++)
-    {
-        in->directBlocks[i] = 0; // initialize remaining direct blocks to 0
-    }
-    in->indirect = 0;
-    in->second_level_indirect = 0;
+    memset(in->inline_data, 0, INLINE_DATA_SIZE); // no blocks until the file outgrows the inode
     in->time = time(NULL);  // last accessed, since unix epoch
     in->ctime = time(NULL); // creation time
     in->mtime = time(NULL); // last modified
     in->dtime = 0;          // file deletion time, not set
-    in->flags = 1;          // 1 regular file (not directory)
+    in->flags = 1 | INLINE_DATA_FLAG; // 1 regular file (not directory), data stored inline
 
     // Calculate which block contains this inode and offset within that block
-    // Each inode is 64 bytes, each block is 2048 bytes, so 32 inodes per block
-    uint16_t inode_block = INODE_START + (inode_number / 32);
-    uint16_t inode_offset = (inode_number % 32) * sizeof(Inode);
+    // Each inode is 128 bytes, so INODES_PER_BLOCK (16 with 2 KiB blocks) inodes per block
+    uint32_t inode_block = INODE_START + (inode_number / INODES_PER_BLOCK);
+    uint16_t inode_offset = (inode_number % INODES_PER_BLOCK) * sizeof(Inode);
 
-    memcpy(HARD_DISK[inode_block] + inode_offset, in, sizeof(Inode));
+    memcpy(bcache_get(inode_block) + inode_offset, in, sizeof(Inode));
+    journal_dirty_metadata(inode_block);
+    bcache_put(inode_block, true);
     free(in);
 }
 
 uint16_t create_file(const char *filename)
 {
     // Validate input
-    if (filename == NULL || strlen(filename) == 0)
+    if (filename == NULL)
     {
         return 0;
     }
+    return create_file_in(session_config->current_dir_inode, filename, strlen(filename));
+}
 
-    if (strlen(filename) > MAX_FILENAME)
+// Creates a file named by the first name_len bytes of name in directory parent_inode
+// Returns inode number of the new file, or 0 on error (invalid name, name exists, disk full,
+// or parent_inode is part of a snapshot)
+uint16_t create_file_in(uint16_t parent_inode, const char *name, size_t name_len)
+{
+    // Validate input
+    if (name == NULL || name_len == 0 || name_len > MAX_FILENAME || session_config->read_only ||
+        !snapshot_allows_change(parent_inode))
     {
         return 0;
     }
 
+    // Check if file already exists in the directory before allocating anything
+    if (find_directory_entry_n(parent_inode, name, name_len) != 0) {
+        return 0; // File already exists
+    }
+
+    // Inode and directory entry are committed together
+    tree_lock_shared();
+    journal_begin_operation();
+
     // Find a free inode for the new file
     uint16_t new_file_inode = find_free_inode();
     if (new_file_inode == 0)
     {
         // Assuming find_free_inode returns 0 when no free inode is found
+        journal_end_operation();
+        tree_unlock_shared();
         return 0; // No free inodes
     }
 
     // Initialize the inode for the file
     init_file_inode(new_file_inode);
 
-    // Check if file already exists in current directory
-    if (find_directory_entry(session_config->current_dir_inode, filename) != 0) {
-        // File already exists, clean up and return error
-        // Get the inode to find the data block before freeing
-        uint16_t inode_block = INODE_START + (new_file_inode / 32);
-        uint16_t inode_offset = (new_file_inode % 32) * sizeof(Inode);
-        Inode *temp_inode = (Inode *)(HARD_DISK[inode_block] + inode_offset);
-        uint16_t data_block = temp_inode->directBlocks[0];
-        free_inode(new_file_inode); // Free the inode we just allocated
-        if (data_block != 0) {
-            free_data_block(data_block);
-        }
-        return 0; // File already exists
-    }
-
-    // Add DirectoryEntry to current directory
-    int result = add_directory_entry(session_config->current_dir_inode, filename, new_file_inode);
+    // Add DirectoryEntry to the parent directory
+    int result = add_directory_entry_n(parent_inode, name, name_len, new_file_inode);
     if (result != SUCCESS) {
-        // Failed to add directory entry, clean up
-        // Get the inode to find the data block before freeing
-        uint16_t inode_block = INODE_START + (new_file_inode / 32);
-        uint16_t inode_offset = (new_file_inode % 32) * sizeof(Inode);
-        Inode *temp_inode = (Inode *)(HARD_DISK[inode_block] + inode_offset);
-        uint16_t data_block = temp_inode->directBlocks[0];
+        // Failed to add directory entry, clean up (a new file has no data blocks yet)
         free_inode(new_file_inode);
-        if (data_block != 0) {
-            free_data_block(data_block);
-        }
+        journal_end_operation();
+        tree_unlock_shared();
         return 0; // Return 0 on error
     }
 
+    name_index_add(new_file_inode, parent_inode, name, name_len);
+    journal_end_operation();
+    tree_unlock_shared();
     return new_file_inode; // Return inode number on success
 }
 
@@ -112,12 +149,15 @@ uint16_t create_file(const char *filename)
 int check_permissions(uint16_t inode_number, uint16_t operation)
 {
     // Get the inode
-    uint16_t inode_block = INODE_START + (inode_number / 32);
-    uint16_t inode_offset = (inode_number % 32) * sizeof(Inode);
-    Inode *inode = (Inode *)(HARD_DISK[inode_block] + inode_offset);
+    uint32_t inode_block = INODE_START + (inode_number / INODES_PER_BLOCK);
+    uint16_t inode_offset = (inode_number % INODES_PER_BLOCK) * sizeof(Inode);
+    Inode *inode = (Inode *)(bcache_get(inode_block) + inode_offset);
     
+    inode_read_lock(inode_number);
     uint16_t permissions = inode->permissions;
     uint16_t ownerID = inode->ownerID;
+    inode_unlock(inode_number);
+    bcache_put(inode_block, false);
     uint16_t uid = session_config->uid;
     
     // Determine which permission bits to check
@@ -125,7 +165,7 @@ int check_permissions(uint16_t inode_number, uint16_t operation)
     if (operation & O_RDONLY || operation & O_RDWR) {
         check_bits |= 0x0100; // Read bit (bit 8)
     }
-    if (operation & O_WRONLY || operation & O_RDWR) {
+    if (operation & O_WRONLY || operation & O_RDWR || operation & O_TRUNC) {
         check_bits |= 0x0080; // Write bit (bit 7)
     }
     
@@ -149,96 +189,140 @@ int check_permissions(uint16_t inode_number, uint16_t operation)
     return ERROR_PERMISSION_DENIED;
 }
 
-// Helper function: Traverse path and return target inode number
-// Returns SUCCESS and sets out_inode if found, ERROR_FILE_NOT_FOUND otherwise
-int traverse_path(const char *pathname, uint16_t *out_inode)
+// Helper function: Resolve a path in one pass without copying or modifying it
+// Components are walked in place as (pointer, length); redundant slashes are skipped,
+// "." stays in the current directory and ".." moves to its parent
+// Absolute paths start at root, relative paths at start_inode
+// Returns SUCCESS if every directory on the way exists (out->exists tells whether the last
+// component exists too), ERROR_FILE_NOT_FOUND if a directory on the way is missing or is a file,
+// or ERROR_INVALID_INPUT for a bad path
+// Keeps no state between calls, so concurrent resolutions do not interfere
+int resolve_path(const char *pathname, uint16_t start_inode, ResolvedPath *out)
 {
-    if (pathname == NULL || out_inode == NULL) {
+    if (pathname == NULL || out == NULL) {
         return ERROR_INVALID_INPUT;
     }
     
-    // Copy pathname since strtok modifies it
-    char path_copy[MAX_PATH_LENGTH];
-    strncpy(path_copy, pathname, MAX_PATH_LENGTH - 1);
-    path_copy[MAX_PATH_LENGTH - 1] = '\0';
-    
-    // Start from root if absolute path, or current directory if relative
-    uint16_t current_inode;
-    if (pathname[0] == '/') {
-        current_inode = 0; // Root inode
-        // Path is just "/"
-        if (strlen(path_copy) == 1) {
-            *out_inode = 0;
-            return SUCCESS;
+    // Start from root if absolute path, or start_inode if relative
+    // The root is the session's: a mounted snapshot's root, whose .. is the root itself
+    uint16_t root_inode = session_config->root_inode;
+    uint16_t current_inode = (pathname[0] == '/') ? root_inode : start_inode;
+    out->parent_inode = current_inode;
+    out->inode_number = current_inode;
+    out->exists = true;
+    out->name = pathname;
+    out->name_length = 0;
+    
+    const char *p = pathname;
+    while (true) {
+        while (*p == '/') {
+            p++; // Skip separators, including repeated and trailing ones
         }
-        // Move past leading slash for tokenization
-        memmove(path_copy, path_copy + 1, strlen(path_copy));
-    } else {
-        current_inode = session_config->current_dir_inode;
-    }
-    
-    // Tokenize path and traverse
-    char *component = strtok(path_copy, "/");
-    if (component == NULL) {
-        // Empty path after tokenization
-        *out_inode = current_inode;
-        return SUCCESS;
-    }
-    
-    while (component != NULL) {
-        // Find the component in current directory
-        uint16_t found_inode = find_directory_entry(current_inode, component);
-        if (found_inode == 0) {
-            return ERROR_FILE_NOT_FOUND;
+        if (*p == '\0') {
+            return SUCCESS; // No more components
+        }
+        const char *component = p;
+        while (*p != '\0' && *p != '/') {
+            p++;
+        }
+        size_t length = p - component;
+        if (length > MAX_FILENAME) {
+            return ERROR_INVALID_INPUT;
         }
         
-        // Check if it's a directory (for intermediate components)
-        uint16_t inode_block = INODE_START + (found_inode / 32);
-        uint16_t inode_offset = (found_inode % 32) * sizeof(Inode);
-        Inode *inode = (Inode *)(HARD_DISK[inode_block] + inode_offset);
-        
-        // Get next component
-        component = strtok(NULL, "/");
+        // There is another component, so what we have so far must be an existing directory
+        if (!out->exists) {
+            return ERROR_FILE_NOT_FOUND;
+        }
+        uint32_t inode_block = INODE_START + (current_inode / INODES_PER_BLOCK);
+        uint16_t inode_offset = (current_inode % INODES_PER_BLOCK) * sizeof(Inode);
+        Inode *inode = (Inode *)(bcache_get(inode_block) + inode_offset);
+        inode_read_lock(current_inode);
+        bool is_directory = (inode->flags & 2) != 0;
+        inode_unlock(current_inode);
+        bcache_put(inode_block, false);
+        if (!is_directory) {
+            return ERROR_FILE_NOT_FOUND; // Not a directory
+        }
         
-        if (component != NULL) {
-            // More components to traverse - must be a directory
-            if ((inode->flags & 2) == 0) {
-                return ERROR_FILE_NOT_FOUND; // Not a directory
+        out->parent_inode = current_inode;
+        if (length == 1 && component[0] == '.') {
+            out->name_length = 0; // Same directory
+        } else if (length == 2 && component[0] == '.' && component[1] == '.') {
+            if (current_inode != root_inode) {
+                current_inode = get_parent_directory(current_inode);
+                if (session_config->snapshot != 0 &&
+                    snapshot_resolve(session_config->snapshot, current_inode, &current_inode) != SUCCESS) {
+                    return ERROR_INVALID_INPUT; // No room to copy the parent
+                }
             }
-            current_inode = found_inode;
+            out->name_length = 0;
         } else {
-            // Last component - this is our target
-            *out_inode = found_inode;
-            return SUCCESS;
+            uint16_t found_inode = find_directory_entry_n(current_inode, component, length);
+            if (found_inode != 0 && session_config->snapshot != 0) {
+                // Entries of a snapshot's directories name live inodes, the snapshot's version may be a copy
+                int result = snapshot_resolve(session_config->snapshot, found_inode, &found_inode);
+                if (result == ERROR_INVALID_INPUT) {
+                    return result;
+                }
+                if (result != SUCCESS) {
+                    found_inode = 0; // Not part of the snapshot
+                }
+            }
+            out->exists = (found_inode != 0);
+            current_inode = found_inode;
+            out->name = component;
+            out->name_length = length;
         }
+        out->inode_number = current_inode;
+    }
+}
+
+// Helper function: Traverse path and return target inode number
+// Relative paths start at the session's current directory
+// Returns SUCCESS and sets out_inode if found, ERROR_FILE_NOT_FOUND otherwise
+int traverse_path(const char *pathname, uint16_t *out_inode)
+{
+    if (pathname == NULL || out_inode == NULL) {
+        return ERROR_INVALID_INPUT;
     }
     
-    return ERROR_FILE_NOT_FOUND;
+    ResolvedPath resolved;
+    int result = resolve_path(pathname, session_config->current_dir_inode, &resolved);
+    if (result != SUCCESS) {
+        return result;
+    }
+    if (!resolved.exists) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    *out_inode = resolved.inode_number;
+    return SUCCESS;
 }
 
 // Helper function: Allocate a file descriptor in the File Descriptor Table
 // Returns file descriptor index (>= 0) on success, negative error code on failure
 int allocate_file_descriptor(uint16_t inode_number, uint16_t flags)
 {
-    // FileDescriptor is 64 bytes, each block is 2048 bytes
-    // So 32 file descriptors per block (2048 / 64 = 32)
-    // Total blocks: KERNEL_MEMORY_END - KERNEL_MEMORY_START + 1 = 17 blocks
-    // Total capacity: 17 * 32 = 544 file descriptors
+    // FileDescriptor is 64 bytes, so BLOCK_SIZE_BYTES / 64 file descriptors per block
+    // The KERNEL_MEMORY blocks hold at least MAX_FILE_DESCRIPTORS (544) of them
     
-    uint16_t fd_per_block = BLOCK_SIZE_BYTES / sizeof(FileDescriptor); // 32
-    uint16_t total_blocks = KERNEL_MEMORY_END - KERNEL_MEMORY_START + 1; // 17
+    uint16_t fd_per_block = BLOCK_SIZE_BYTES / sizeof(FileDescriptor); // 32 with 2 KiB blocks
+    uint16_t total_blocks = KERNEL_MEMORY_END - KERNEL_MEMORY_START + 1; // 17 with 2 KiB blocks
     
     // Search for a free file descriptor slot
     for (uint16_t block = 0; block < total_blocks; block++) {
-        uint8_t *fd_block = HARD_DISK[KERNEL_MEMORY_START + block];
+        uint8_t *fd_block = bcache_pin(KERNEL_MEMORY_START + block); // The table is never evicted
         
         for (uint16_t i = 0; i < fd_per_block; i++) {
             FileDescriptor *fd = (FileDescriptor *)(fd_block + i * sizeof(FileDescriptor));
             
-            // Check if slot is free (inode_number == 0 means free)
-            if (fd->inode_number == 0) {
-                // Allocate this slot
-                fd->inode_number = inode_number;
+            // Claim the slot if it is free (inode_number == 0 means free); the compare-and-swap
+            // makes concurrent opens take different slots without a table lock
+            // (inode 0 is the root directory, which is never opened as a file)
+            uint16_t expected = 0;
+            if (__atomic_load_n(&fd->inode_number, __ATOMIC_RELAXED) == 0 &&
+                __atomic_compare_exchange_n(&fd->inode_number, &expected, inode_number, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
                 fd->offset = 0;
                 fd->flags = flags;
                 fd->referenceCount = 1;
@@ -257,9 +341,9 @@ int allocate_file_descriptor(uint16_t inode_number, uint16_t flags)
 // Returns pointer to FileDescriptor or NULL if invalid
 FileDescriptor* get_file_descriptor(uint16_t fd)
 {
-    uint16_t fd_per_block = BLOCK_SIZE_BYTES / sizeof(FileDescriptor); // 32
-    uint16_t total_blocks = KERNEL_MEMORY_END - KERNEL_MEMORY_START + 1; // 17
-    uint16_t max_fd = total_blocks * fd_per_block; // 544
+    uint16_t fd_per_block = BLOCK_SIZE_BYTES / sizeof(FileDescriptor);
+    uint16_t total_blocks = KERNEL_MEMORY_END - KERNEL_MEMORY_START + 1;
+    uint16_t max_fd = total_blocks * fd_per_block; // 544 with 2 KiB blocks
     
     if (fd >= max_fd) {
         return NULL; // Invalid file descriptor
@@ -268,76 +352,101 @@ FileDescriptor* get_file_descriptor(uint16_t fd)
     uint16_t block = fd / fd_per_block;
     uint16_t index = fd % fd_per_block;
     
-    uint8_t *fd_block = HARD_DISK[KERNEL_MEMORY_START + block];
+    uint8_t *fd_block = bcache_pin(KERNEL_MEMORY_START + block);
     FileDescriptor *fd_ptr = (FileDescriptor *)(fd_block + index * sizeof(FileDescriptor));
     
     // Check if it's actually allocated
-    if (fd_ptr->inode_number == 0) {
+    if (__atomic_load_n(&fd_ptr->inode_number, __ATOMIC_ACQUIRE) == 0) {
         return NULL; // Not allocated
     }
     
     return fd_ptr;
 }
 
-// assuming /foo/bar is pathname and op is O_RDONLY
-int fs_open(const char *pathname, uint16_t operation)
+// Returns true if a file descriptor is open on an inode whose bit is set in inodes (a bitmap
+// indexed by inode number), e.g. a file of a snapshot about to be deleted
+bool file_open_among(uint8_t *inodes)
 {
-    if (pathname == NULL) {
-        return ERROR_INVALID_INPUT;
+    uint16_t fd_per_block = BLOCK_SIZE_BYTES / sizeof(FileDescriptor);
+    uint16_t total_blocks = KERNEL_MEMORY_END - KERNEL_MEMORY_START + 1;
+    for (uint16_t block = 0; block < total_blocks; block++) {
+        uint8_t *fd_block = bcache_pin(KERNEL_MEMORY_START + block);
+        for (uint16_t i = 0; i < fd_per_block; i++) {
+            FileDescriptor *fd = (FileDescriptor *)(fd_block + i * sizeof(FileDescriptor));
+            uint16_t inode_number = __atomic_load_n(&fd->inode_number, __ATOMIC_ACQUIRE);
+            if (inode_number != 0 && is_bit_set(inodes, inode_number)) {
+                return true;
+            }
+        }
     }
-    
-    // Traverse path to find the target file/directory
-    uint16_t target_inode;
-    int result = traverse_path(pathname, &target_inode);
+    return false;
+}
+
+static int truncate_file(uint16_t inode_number, uint32_t size);
+
+// fs_open() body, called with the tree lock held shared
+static int open_locked(const char *pathname, uint16_t operation)
+{
+    // Resolve the path once: gives the target, or its parent directory if it does not exist
+    ResolvedPath resolved;
+    int result = resolve_path(pathname, session_config->current_dir_inode, &resolved);
     if (result != SUCCESS) {
-        // If file doesn't exist and O_CREAT is set, create it
-        if (result == ERROR_FILE_NOT_FOUND && (operation & O_CREAT)) {
-            // Extract filename from path
-            char path_copy[MAX_PATH_LENGTH];
-            strncpy(path_copy, pathname, MAX_PATH_LENGTH - 1);
-            path_copy[MAX_PATH_LENGTH - 1] = '\0';
-            
-            char *filename = strrchr(path_copy, '/');
-            if (filename == NULL) {
-                filename = path_copy;
-            } else {
-                filename++; // Skip the '/'
-            }
-            
-            // Create the file
-            uint16_t created_inode = create_file(filename);
-            if (created_inode == 0) {
-                return ERROR_INVALID_INPUT; // Failed to create file
-            }
-            
-            // Traverse again to get the newly created file's inode
-            result = traverse_path(pathname, &target_inode);
-            if (result != SUCCESS) {
-                return result;
-            }
-        } else {
-            return result;
+        return result;
+    }
+    
+    // Snapshots are read only from the live tree too
+    bool changes = (operation & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC)) != 0;
+    uint16_t target_inode = resolved.inode_number;
+    if (changes && !snapshot_allows_change(resolved.exists ? target_inode : resolved.parent_inode)) {
+        return ERROR_PERMISSION_DENIED;
+    }
+    if (!resolved.exists) {
+        // If file doesn't exist and O_CREAT is set, create it in the resolved parent directory
+        if ((operation & O_CREAT) == 0) {
+            return ERROR_FILE_NOT_FOUND;
+        }
+        target_inode = create_file_in(resolved.parent_inode, resolved.name, resolved.name_length);
+        if (target_inode == 0) {
+            // Another thread may have created the same name since it was resolved
+            target_inode = find_directory_entry_n(resolved.parent_inode, resolved.name, resolved.name_length);
+        }
+        if (target_inode == 0) {
+            return ERROR_INVALID_INPUT; // Failed to create file
         }
     }
     
     // Check if target is a file (not a directory)
-    uint16_t inode_block = INODE_START + (target_inode / 32);
-    uint16_t inode_offset = (target_inode % 32) * sizeof(Inode);
-    Inode *inode = (Inode *)(HARD_DISK[inode_block] + inode_offset);
+    uint32_t inode_block = INODE_START + (target_inode / INODES_PER_BLOCK);
+    uint16_t inode_offset = (target_inode % INODES_PER_BLOCK) * sizeof(Inode);
+    Inode *inode = (Inode *)(bcache_get(inode_block) + inode_offset);
     
     if ((inode->flags & 2) != 0) {
+        bcache_put(inode_block, false);
         return ERROR_INVALID_INPUT; // Cannot open directory as file
     }
+    if ((inode->flags & SNAPSHOT_RECORD_FLAG) != 0) {
+        bcache_put(inode_block, false);
+        return ERROR_PERMISSION_DENIED; // Snapshot records are only read by snapshot.c
+    }
     
     // Check permissions
     result = check_permissions(target_inode, operation);
     if (result != SUCCESS) {
+        bcache_put(inode_block, false);
         return result;
     }
     
-    // Update last accessed time
-    inode->time = time(NULL);
-    memcpy(HARD_DISK[inode_block] + inode_offset, inode, sizeof(Inode));
+    // Update last accessed time (not journaled, like the other access time updates)
+    __atomic_store_n(&inode->time, time(NULL), __ATOMIC_RELAXED);
+    bcache_put(inode_block, false);
+    
+    // O_TRUNC empties an existing file
+    if ((operation & O_TRUNC) != 0) {
+        result = truncate_file(target_inode, 0);
+        if (result != SUCCESS) {
+            return result;
+        }
+    }
     
     // Allocate file descriptor
     int fd = allocate_file_descriptor(target_inode, operation);
@@ -348,6 +457,23 @@ int fs_open(const char *pathname, uint16_t operation)
     return fd; // Return file descriptor index
 }
 
+// assuming /foo/bar is pathname and op is O_RDONLY
+int fs_open(const char *pathname, uint16_t operation)
+{
+    if (pathname == NULL) {
+        return ERROR_INVALID_INPUT;
+    }
+    if (session_config->read_only && (operation & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC))) {
+        return ERROR_PERMISSION_DENIED; // Mounted snapshots are read only
+    }
+    
+    // A snapshot cannot be deleted between the lookup and the new descriptor
+    tree_lock_shared();
+    int fd = open_locked(pathname, operation);
+    tree_unlock_shared();
+    return fd;
+}
+
 int fs_close(uint16_t file_descriptor)
 {
     // Get the file descriptor
@@ -357,115 +483,42 @@ int fs_close(uint16_t file_descriptor)
     }
     
     // Decrement reference count
-    if (fd->referenceCount > 0) {
-        fd->referenceCount--;
+    uint16_t references = __atomic_load_n(&fd->referenceCount, __ATOMIC_ACQUIRE);
+    while (references > 0 &&
+           !__atomic_compare_exchange_n(&fd->referenceCount, &references, references - 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
     }
     
     // If reference count reaches 0, free the file descriptor
-    if (fd->referenceCount == 0) {
-        // Clear the file descriptor (mark as free)
-        fd->inode_number = 0;
+    if (references <= 1) {
+        // Clear the file descriptor, then mark it free last so a concurrent open
+        // cannot claim the slot before it is reset
         fd->offset = 0;
         fd->flags = 0;
-        fd->referenceCount = 0;
+        __atomic_store_n(&fd->inode_number, 0, __ATOMIC_RELEASE);
     }
     
     return SUCCESS;
 }
 
-// Helper function: Recursively search directory for files matching pattern
-// This is a helper for search_files_by_name
-static int search_directory_recursive(uint16_t dir_inode, const char *pattern, 
-                                      char results[][MAX_PATH_LENGTH], int *result_count, 
-                                      int max_results, char current_path[MAX_PATH_LENGTH])
+// search_files_by_name() results, filled by collect_search_result()
+typedef struct {
+    char (*paths)[MAX_PATH_LENGTH];
+    int count;
+} SearchResults;
+
+static bool collect_search_result(const char *path, uint16_t inode_number, void *context)
 {
-    if (*result_count >= max_results) {
-        return SUCCESS; // Reached max results
-    }
-    
-    // Get the directory's inode
-    uint16_t inode_block = INODE_START + (dir_inode / 32);
-    uint16_t inode_offset = (dir_inode % 32) * sizeof(Inode);
-    Inode *dir_inode_ptr = (Inode *)(HARD_DISK[inode_block] + inode_offset);
-    
-    // Check if it's actually a directory
-    if ((dir_inode_ptr->flags & 2) == 0) {
-        return ERROR_INVALID_INPUT; // Not a directory
-    }
-    
-    // Get the directory's first data block
-    uint16_t dir_data_block = dir_inode_ptr->directBlocks[0];
-    if (dir_data_block == 0) {
-        return SUCCESS; // Empty directory
-    }
-    
-    uint8_t *dir_data = HARD_DISK[dir_data_block];
-    uint16_t dir_size = dir_inode_ptr->file_size;
-    uint16_t offset = 0;
-    
-    // Iterate through directory entries
-    while (offset < dir_size && *result_count < max_results) {
-        DirectoryEntry *entry = get_directory_entry_at_offset(dir_data, offset);
-        
-        // Skip . and .. entries
-        if (entry->name_length > 0 && 
-            !(entry->name_length == 1 && entry->name[0] == '.') &&
-            !(entry->name_length == 2 && entry->name[0] == '.' && entry->name[1] == '.')) {
-            
-            // Build full path for this entry
-            char entry_path[MAX_PATH_LENGTH];
-            char entry_name[MAX_FILENAME + 1];
-            strncpy(entry_name, entry->name, entry->name_length);
-            entry_name[entry->name_length] = '\0';
-            
-            if (strcmp(current_path, "/") == 0) {
-                // Root directory - just add name
-                snprintf(entry_path, MAX_PATH_LENGTH, "/%s", entry_name);
-            } else {
-                // Normal directory - add slash and name
-                snprintf(entry_path, MAX_PATH_LENGTH, "%s/%s", current_path, entry_name);
-            }
-            
-            // Check if name matches pattern (simple substring match)
-            // For more advanced matching, could use fnmatch or regex
-            if (strstr(entry->name, pattern) != NULL) {
-                // Get the entry's inode to check if it's a file
-                uint16_t entry_inode = entry->inode_number;
-                uint16_t entry_inode_block = INODE_START + (entry_inode / 32);
-                uint16_t entry_inode_offset = (entry_inode % 32) * sizeof(Inode);
-                Inode *entry_inode_ptr = (Inode *)(HARD_DISK[entry_inode_block] + entry_inode_offset);
-                
-                // Only add files (not directories) to results
-                if ((entry_inode_ptr->flags & 2) == 0) {
-                    // It's a file, add to results
-                    strncpy(results[*result_count], entry_path, MAX_PATH_LENGTH - 1);
-                    results[*result_count][MAX_PATH_LENGTH - 1] = '\0';
-                    (*result_count)++;
-                }
-            }
-            
-            // If it's a directory, recursively search it
-            uint16_t entry_inode = entry->inode_number;
-            uint16_t entry_inode_block = INODE_START + (entry_inode / 32);
-            uint16_t entry_inode_offset = (entry_inode % 32) * sizeof(Inode);
-            Inode *entry_inode_ptr = (Inode *)(HARD_DISK[entry_inode_block] + entry_inode_offset);
-            
-            if ((entry_inode_ptr->flags & 2) != 0) {
-                // It's a directory, recursively search it
-                search_directory_recursive(entry_inode, pattern, results, result_count, 
-                                          max_results, entry_path);
-            }
-        }
-        
-        // Move to next entry
-        offset = get_next_directory_entry_offset(dir_data, offset, dir_size);
-    }
-    
-    return SUCCESS;
+    (void)inode_number;
+    SearchResults *results = context;
+    strncpy(results->paths[results->count], path, MAX_PATH_LENGTH - 1);
+    results->paths[results->count][MAX_PATH_LENGTH - 1] = '\0';
+    results->count++;
+    return true;
 }
 
-// Search for files by name/path pattern
-// Returns number of matches found, or negative error code
+// Search for files by name/path pattern (substring of the name), see fs_search()
+// Returns number of matches found (at most max_results), or negative error code
 int search_files_by_name(const char *search_path, const char *pattern, 
                          char results[][MAX_PATH_LENGTH], int max_results)
 {
@@ -473,59 +526,88 @@ int search_files_by_name(const char *search_path, const char *pattern,
         return ERROR_INVALID_INPUT;
     }
     
-    // Find the starting directory inode
-    uint16_t start_inode;
-    int result = traverse_path(search_path, &start_inode);
-    if (result != SUCCESS) {
-        return result;
-    }
-    
-    // Verify it's a directory
-    uint16_t inode_block = INODE_START + (start_inode / 32);
-    uint16_t inode_offset = (start_inode % 32) * sizeof(Inode);
-    Inode *inode = (Inode *)(HARD_DISK[inode_block] + inode_offset);
-    
-    if ((inode->flags & 2) == 0) {
-        return ERROR_INVALID_INPUT; // Not a directory
-    }
-    
-    // Initialize results
-    int result_count = 0;
-    char current_path[MAX_PATH_LENGTH];
-    strncpy(current_path, search_path, MAX_PATH_LENGTH - 1);
-    current_path[MAX_PATH_LENGTH - 1] = '\0';
-    
-    // Normalize path - remove trailing slash unless it's root
-    size_t len = strlen(current_path);
-    if (len > 1 && current_path[len - 1] == '/') {
-        current_path[len - 1] = '\0';
+    SearchOptions options = {
+        .mode = SEARCH_SUBSTRING,
+        .pattern = pattern,
+        .max_results = (uint32_t)max_results,
+        .threads = 0,
+    };
+    SearchResults collected = { results, 0 };
+    return fs_search(search_path, &options, collect_search_result, &collected);
+}
+
+// What a block never written reads as: files are sparse, blocks are allocated by the first write
+static const uint8_t zero_block[MAX_BLOCK_SIZE];
+
+// Position in a caller's iovec array, advanced as bytes are copied to or from it
+typedef struct {
+    const struct iovec *iov;
+    int index;
+    size_t offset; // bytes of iov[index] already used
+} IovCursor;
+
+// Copies length bytes from a block to the iovecs at the cursor and advances it
+static void iov_copy_out(IovCursor *cursor, const uint8_t *source, size_t length)
+{
+    while (length > 0) {
+        const struct iovec *segment = &cursor->iov[cursor->index];
+        size_t piece = segment->iov_len - cursor->offset;
+        if (piece > length) {
+            piece = length;
+        }
+        memcpy((uint8_t *)segment->iov_base + cursor->offset, source, piece);
+        source += piece;
+        length -= piece;
+        cursor->offset += piece;
+        if (cursor->offset == segment->iov_len) {
+            cursor->index++; // Also skips empty segments
+            cursor->offset = 0;
+        }
     }
-    
-    // Recursively search
-    result = search_directory_recursive(start_inode, pattern, results, &result_count, 
-                                       max_results, current_path);
-    
-    if (result != SUCCESS) {
-        return result;
+}
+
+// Copies length bytes from the iovecs at the cursor to a block and advances it
+static void iov_copy_in(IovCursor *cursor, uint8_t *destination, size_t length)
+{
+    while (length > 0) {
+        const struct iovec *segment = &cursor->iov[cursor->index];
+        size_t piece = segment->iov_len - cursor->offset;
+        if (piece > length) {
+            piece = length;
+        }
+        memcpy(destination, (const uint8_t *)segment->iov_base + cursor->offset, piece);
+        destination += piece;
+        length -= piece;
+        cursor->offset += piece;
+        if (cursor->offset == segment->iov_len) {
+            cursor->index++;
+            cursor->offset = 0;
+        }
     }
-    
-    return result_count; // Return number of matches found
 }
 
-// Read data from a file
-// Returns number of bytes read, or negative error code
-int fs_read(uint16_t file_descriptor, void *buffer, size_t count)
+// Checks an iovec array from the caller and sums its lengths into *total
+// Returns SUCCESS, or ERROR_INVALID_INPUT for a bad array or a total that does not fit a size_t
+static int iov_total(const struct iovec *iov, int iovcnt, size_t *total)
 {
-    if (buffer == NULL) {
+    if (iov == NULL || iovcnt <= 0 || iovcnt > FS_IOV_MAX) {
         return ERROR_INVALID_INPUT;
     }
-    
-    // Get the file descriptor
-    FileDescriptor *fd = get_file_descriptor(file_descriptor);
-    if (fd == NULL) {
-        return ERROR_INVALID_INPUT; // Invalid file descriptor
+    *total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if ((iov[i].iov_base == NULL && iov[i].iov_len > 0) || iov[i].iov_len > SIZE_MAX - *total) {
+            return ERROR_INVALID_INPUT;
+        }
+        *total += iov[i].iov_len;
     }
-    
+    return SUCCESS;
+}
+
+// Reads count bytes from the file behind fd starting at position into the iovecs, without
+// touching fd->offset; the inode is looked up and its access time set once for the whole range
+// Shared by fs_read(), fs_pread() and fs_readv(); returns number of bytes read, or negative error code
+static int read_at(FileDescriptor *fd, const struct iovec *iov, size_t count, uint32_t position)
+{
     // Check if read is allowed
     if ((fd->flags & O_RDONLY) == 0 && (fd->flags & O_RDWR) == 0) {
         return ERROR_PERMISSION_DENIED;
@@ -533,39 +615,47 @@ int fs_read(uint16_t file_descriptor, void *buffer, size_t count)
     
     // Get the file's inode
     uint16_t inode_number = fd->inode_number;
-    uint16_t inode_block = INODE_START + (inode_number / 32);
-    uint16_t inode_offset = (inode_number % 32) * sizeof(Inode);
-    Inode *inode = (Inode *)(HARD_DISK[inode_block] + inode_offset);
+    uint32_t inode_block = INODE_START + (inode_number / INODES_PER_BLOCK);
+    uint16_t inode_offset = (inode_number % INODES_PER_BLOCK) * sizeof(Inode);
+    Inode *inode = (Inode *)(bcache_get(inode_block) + inode_offset);
     
     // Check if it's a file (not a directory)
     if ((inode->flags & 2) != 0) {
+        bcache_put(inode_block, false);
         return ERROR_INVALID_INPUT; // Cannot read directory
     }
     
+    // Readers of the same file run in parallel, a writer excludes them
+    inode_read_lock(inode_number);
+    
     // Calculate how much we can read
     uint32_t file_size = inode->file_size;
-    uint16_t current_offset = fd->offset;
+    uint32_t current_offset = position;
     
     if (current_offset >= file_size) {
+        inode_unlock(inode_number);
+        bcache_put(inode_block, false);
         return 0; // Already at end of file
     }
     
-    // Calculate how many bytes to read
-    size_t bytes_to_read = count;
-    if (current_offset + bytes_to_read > file_size) {
+    // Calculate how many bytes to read (the count is returned as an int)
+    size_t bytes_to_read = (count > INT32_MAX) ? INT32_MAX : count;
+    if (bytes_to_read > file_size - current_offset) {
         bytes_to_read = file_size - current_offset;
     }
     
-    // Read from direct blocks
+    // Read through the block map, straight into the caller's buffers
+    IovCursor cursor = { .iov = iov, .index = 0, .offset = 0 };
     size_t bytes_read = 0;
-    uint16_t block_index = current_offset / BLOCK_SIZE_BYTES;
+    if ((inode->flags & INLINE_DATA_FLAG) != 0) {
+        iov_copy_out(&cursor, inode->inline_data + current_offset, bytes_to_read);
+        bytes_read = bytes_to_read; // Served from the inode, no data block touched
+    }
+    uint32_t block_index = current_offset / BLOCK_SIZE_BYTES;
     uint16_t offset_in_block = current_offset % BLOCK_SIZE_BYTES;
     
-    while (bytes_read < bytes_to_read && block_index < 6) {
-        uint16_t data_block = inode->directBlocks[block_index];
-        if (data_block == 0) {
-            break; // No more blocks
-        }
+    while (bytes_read < bytes_to_read) {
+        uint32_t data_block = inode_bmap(inode, block_index, false);
         
         // Calculate how much to read from this block
         size_t bytes_from_block = BLOCK_SIZE_BYTES - offset_in_block;
@@ -573,29 +663,30 @@ int fs_read(uint16_t file_descriptor, void *buffer, size_t count)
             bytes_from_block = bytes_to_read - bytes_read;
         }
         
-        // Copy data from block to buffer
-        memcpy((uint8_t *)buffer + bytes_read, 
-               HARD_DISK[data_block] + offset_in_block, 
-               bytes_from_block);
+        // Copy data from block to buffer, a hole reads as zeros
+        if (data_block == 0) {
+            iov_copy_out(&cursor, zero_block, bytes_from_block);
+        } else {
+            iov_copy_out(&cursor, bcache_get(data_block) + offset_in_block, bytes_from_block);
+            bcache_put(data_block, false);
+        }
         
         bytes_read += bytes_from_block;
         block_index++;
         offset_in_block = 0; // Next block starts at beginning
     }
     
-    // Update file descriptor offset
-    fd->offset += bytes_read;
-    
-    // Update last accessed time in inode
-    inode->time = time(NULL);
-    memcpy(HARD_DISK[inode_block] + inode_offset, inode, sizeof(Inode));
+    // Update last accessed time in inode (other readers may hold the lock too; not journaled)
+    __atomic_store_n(&inode->time, time(NULL), __ATOMIC_RELAXED);
+    inode_unlock(inode_number);
+    bcache_put(inode_block, false);
     
     return (int)bytes_read;
 }
 
-// Write data to a file
-// Returns number of bytes written, or negative error code
-int fs_write(uint16_t file_descriptor, const void *buffer, size_t count)
+// Read data from a file at the file descriptor's offset and advance it
+// Returns number of bytes read, or negative error code
+int fs_read(uint16_t file_descriptor, void *buffer, size_t count)
 {
     if (buffer == NULL) {
         return ERROR_INVALID_INPUT;
@@ -607,6 +698,272 @@ int fs_write(uint16_t file_descriptor, const void *buffer, size_t count)
         return ERROR_INVALID_INPUT; // Invalid file descriptor
     }
     
+    struct iovec iov = { .iov_base = buffer, .iov_len = count };
+    pthread_mutex_t *fd_lock = get_fd_lock(file_descriptor);
+    pthread_mutex_lock(fd_lock);
+    int bytes_read = read_at(fd, &iov, count, fd->offset);
+    if (bytes_read > 0) {
+        fd->offset += bytes_read; // Update file descriptor offset
+    }
+    pthread_mutex_unlock(fd_lock);
+    return bytes_read;
+}
+
+// Read data from a file at an explicit position, the file descriptor's offset is not used or changed
+// Returns number of bytes read, or negative error code
+int fs_pread(uint16_t file_descriptor, void *buffer, size_t count, uint32_t offset)
+{
+    if (buffer == NULL) {
+        return ERROR_INVALID_INPUT;
+    }
+    
+    FileDescriptor *fd = get_file_descriptor(file_descriptor);
+    if (fd == NULL) {
+        return ERROR_INVALID_INPUT; // Invalid file descriptor
+    }
+    
+    struct iovec iov = { .iov_base = buffer, .iov_len = count };
+    return read_at(fd, &iov, count, offset);
+}
+
+// Read data from a file at the file descriptor's offset into iovcnt buffers, filled in order,
+// and advance the offset; one call covers what would otherwise take one fs_read() per buffer
+// Returns number of bytes read, or negative error code
+int fs_readv(uint16_t file_descriptor, const struct iovec *iov, int iovcnt)
+{
+    size_t count;
+    if (iov_total(iov, iovcnt, &count) != SUCCESS) {
+        return ERROR_INVALID_INPUT;
+    }
+    
+    FileDescriptor *fd = get_file_descriptor(file_descriptor);
+    if (fd == NULL) {
+        return ERROR_INVALID_INPUT; // Invalid file descriptor
+    }
+    
+    pthread_mutex_t *fd_lock = get_fd_lock(file_descriptor);
+    pthread_mutex_lock(fd_lock);
+    int bytes_read = read_at(fd, iov, count, fd->offset);
+    if (bytes_read > 0) {
+        fd->offset += bytes_read;
+    }
+    pthread_mutex_unlock(fd_lock);
+    return bytes_read;
+}
+
+// Zero-copy read: returns read-only views of the blocks holding count bytes of the file from
+// offset, in file order, one view per block; the file descriptor's offset is not used or changed
+// The blocks stay pinned in the block cache until fs_release_view(), so the views can be parsed
+// or checksummed in place; a write to the range made while they are held shows through them
+// A file small enough to live in its inode is returned as one view of a private copy instead,
+// and a range never written is a view of zeros
+// At most FS_VIEW_MAX_BLOCKS blocks are viewed per call, so longer ranges take several calls;
+// all unreleased views together pin at most FS_VIEW_MAX_PINNED blocks (and a bounded share of
+// the block cache), past that the range is cut short, or ERROR_INVALID_INPUT if nothing is left
+// A block freed while viewed (truncate, unlink) is not reused until its view is released
+// Sets *views (NULL when nothing is read) and *nviews; returns number of bytes covered,
+// or negative error code
+int fs_read_view(uint16_t file_descriptor, uint32_t offset, size_t count, FileView **views, int *nviews)
+{
+    if (views == NULL || nviews == NULL) {
+        return ERROR_INVALID_INPUT;
+    }
+    *views = NULL;
+    *nviews = 0;
+    
+    FileDescriptor *fd = get_file_descriptor(file_descriptor);
+    if (fd == NULL) {
+        return ERROR_INVALID_INPUT; // Invalid file descriptor
+    }
+    if ((fd->flags & O_RDONLY) == 0 && (fd->flags & O_RDWR) == 0) {
+        return ERROR_PERMISSION_DENIED;
+    }
+    
+    // Get the file's inode
+    uint16_t inode_number = fd->inode_number;
+    uint32_t inode_block = INODE_START + (inode_number / INODES_PER_BLOCK);
+    uint16_t inode_offset = (inode_number % INODES_PER_BLOCK) * sizeof(Inode);
+    Inode *inode = (Inode *)(bcache_get(inode_block) + inode_offset);
+    if ((inode->flags & 2) != 0) {
+        bcache_put(inode_block, false);
+        return ERROR_INVALID_INPUT; // Cannot read directory
+    }
+    
+    inode_read_lock(inode_number);
+    uint32_t file_size = inode->file_size;
+    size_t bytes_to_read = (count > INT32_MAX) ? INT32_MAX : count;
+    if (offset >= file_size) {
+        bytes_to_read = 0;
+    } else if (bytes_to_read > file_size - offset) {
+        bytes_to_read = file_size - offset;
+    }
+    
+    // One view per block the range touches, and only as many blocks as may be pinned at once
+    size_t max_bytes = (size_t)FS_VIEW_MAX_BLOCKS * BLOCK_SIZE_BYTES - offset % BLOCK_SIZE_BYTES;
+    if (bytes_to_read > max_bytes) {
+        bytes_to_read = max_bytes;
+    }
+    size_t max_views = (offset % BLOCK_SIZE_BYTES + bytes_to_read + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    bool is_inline = (inode->flags & INLINE_DATA_FLAG) != 0;
+    FileView *list = NULL;
+    if (max_views > 0) {
+        // Inline data has no block to pin: its one view is a copy kept behind the array
+        list = malloc(max_views * sizeof(FileView) + (is_inline ? bytes_to_read : 0));
+        if (list == NULL) {
+            inode_unlock(inode_number);
+            bcache_put(inode_block, false);
+            return ERROR_INVALID_INPUT;
+        }
+    }
+    
+    size_t bytes_read = 0;
+    int count_views = 0;
+    uint32_t block_index = offset / BLOCK_SIZE_BYTES;
+    uint16_t offset_in_block = offset % BLOCK_SIZE_BYTES;
+    if (is_inline && bytes_to_read > 0) {
+        uint8_t *copy = (uint8_t *)(list + 1);
+        memcpy(copy, inode->inline_data + offset, bytes_to_read);
+        list[0].data = copy;
+        list[0].length = (uint32_t)bytes_to_read;
+        list[0].block = 0;
+        count_views = 1;
+        bytes_read = bytes_to_read;
+    }
+    while (bytes_read < bytes_to_read) {
+        uint32_t data_block = inode_bmap(inode, block_index, false);
+        size_t bytes_from_block = BLOCK_SIZE_BYTES - offset_in_block;
+        if (bytes_read + bytes_from_block > bytes_to_read) {
+            bytes_from_block = bytes_to_read - bytes_read;
+        }
+        if (data_block == 0) {
+            list[count_views].data = zero_block; // A hole, nothing to pin
+        } else {
+            // Released by fs_release_view(); stop short when no more blocks may be pinned
+            if (!view_block_hold(data_block)) {
+                break;
+            }
+            uint8_t *data = bcache_get_view(data_block);
+            if (data == NULL) {
+                view_block_release(data_block);
+                break;
+            }
+            list[count_views].data = data + offset_in_block;
+        }
+        list[count_views].length = (uint32_t)bytes_from_block;
+        list[count_views].block = data_block;
+        count_views++;
+        bytes_read += bytes_from_block;
+        block_index++;
+        offset_in_block = 0;
+    }
+    
+    // Update last accessed time in inode (not journaled)
+    __atomic_store_n(&inode->time, time(NULL), __ATOMIC_RELAXED);
+    inode_unlock(inode_number);
+    bcache_put(inode_block, false);
+    
+    if (count_views == 0) {
+        free(list);
+        list = NULL;
+        if (bytes_to_read > 0) {
+            return ERROR_INVALID_INPUT; // Too many blocks pinned by unreleased views
+        }
+    }
+    *views = list;
+    *nviews = count_views;
+    return (int)bytes_read;
+}
+
+// Releases views returned by fs_read_view(): unpins their blocks and frees the array (with
+// the copy of an inline file)
+void fs_release_view(FileView *views, int nviews)
+{
+    if (views == NULL) {
+        return;
+    }
+    for (int i = 0; i < nviews; i++) {
+        if (views[i].block != 0) {
+            bcache_put_view(views[i].block);
+            view_block_release(views[i].block);
+        }
+    }
+    free(views);
+}
+
+// Switches an inline file to a block map before a write that no longer fits in the inode; the
+// bytes it holds move to a data block of its own, which becomes logical block 0 (an empty file
+// gets no block, the write allocates what it needs); the caller holds the write lock
+// Returns false if no block is free (the file stays inline)
+static bool convert_inline_data(Inode *inode)
+{
+    uint32_t data_block = 0;
+    if (inode->file_size > 0) {
+        data_block = find_free_data_block();
+        if (data_block == 0) {
+            return false;
+        }
+        uint8_t *data = bcache_get(data_block);
+        memset(data, 0, BLOCK_SIZE_BYTES);
+        memcpy(data, inode->inline_data, inode->file_size);
+        journal_dirty_data(data_block);
+        bcache_put(data_block, true);
+    }
+    
+    memset(inode->inline_data, 0, INLINE_DATA_SIZE); // Empty block map
+    inode->directBlocks[0] = data_block;
+    inode->flags &= ~INLINE_DATA_FLAG;
+    return true;
+}
+
+// Blocks reserved by allocate_extent() for a write but not yet assigned to the inode
+typedef struct {
+    uint32_t next;
+    uint32_t left;
+} ExtentReservation;
+
+// Returns the data block at logical block block_index of the inode, ready to be written in place
+// (a block shared with a clone is copied first), allocating it if needed
+// A missing block comes from the reservation, which is refilled with one contiguous run of the
+// blocks the remaining bytes of the write need; returns 0 if the disk is full
+static uint32_t get_block_for_write(Inode *inode, uint32_t block_index, size_t remaining, ExtentReservation *extent)
+{
+    uint32_t data_block;
+    if (inode_bmap_writable(inode, block_index, &data_block) != SUCCESS) {
+        return 0; // No free block for a copy
+    }
+    if (data_block != 0) {
+        return data_block;
+    }
+    if (extent->left == 0) {
+        size_t want = (remaining + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+        if (want > MAX_FILE_BLOCKS - block_index) {
+            want = MAX_FILE_BLOCKS - block_index;
+        }
+        extent->next = allocate_extent((uint32_t)want, &extent->left);
+        if (extent->next == 0) {
+            return 0; // No free blocks available
+        }
+    }
+    if (inode_bmap_assign(inode, block_index, extent->next) != SUCCESS) {
+        return 0; // No free block for an indirect pointer block
+    }
+    extent->left--;
+    return extent->next++;
+}
+
+// Gives back reserved blocks the write did not use (later blocks were already allocated)
+static void release_extent(ExtentReservation *extent)
+{
+    free_unused_extent(extent->next, extent->left);
+    extent->left = 0;
+}
+
+// Writes count bytes from the iovecs to the file behind fd starting at position, without touching
+// fd->offset; the inode is updated and journaled once for the whole range, or once per journal
+// operation for a write too long for one (see restart_long_operation())
+// Shared by fs_write(), fs_pwrite() and fs_writev(); returns number of bytes written, or negative error code
+static int write_at(FileDescriptor *fd, const struct iovec *iov, size_t count, uint32_t position)
+{
     // Check if write is allowed
     if ((fd->flags & O_WRONLY) == 0 && (fd->flags & O_RDWR) == 0) {
         return ERROR_PERMISSION_DENIED;
@@ -614,31 +971,60 @@ int fs_write(uint16_t file_descriptor, const void *buffer, size_t count)
     
     // Get the file's inode
     uint16_t inode_number = fd->inode_number;
-    uint16_t inode_block = INODE_START + (inode_number / 32);
-    uint16_t inode_offset = (inode_number % 32) * sizeof(Inode);
-    Inode *inode = (Inode *)(HARD_DISK[inode_block] + inode_offset);
+    uint32_t inode_block = INODE_START + (inode_number / INODES_PER_BLOCK);
+    uint16_t inode_offset = (inode_number % INODES_PER_BLOCK) * sizeof(Inode);
+    Inode *inode = (Inode *)(bcache_get(inode_block) + inode_offset);
     
     // Check if it's a file (not a directory)
     if ((inode->flags & 2) != 0) {
+        bcache_put(inode_block, false);
         return ERROR_INVALID_INPUT; // Cannot write to directory
     }
     
-    // Write to direct blocks
+    // Writers of the same file are serialized and exclude readers
+    tree_lock_shared();
+    journal_begin_operation();
+    inode_write_lock(inode_number);
+    // Snapshots that still share the file keep a copy of it as it is (see snapshot.c)
+    if (snapshot_preserve(inode_number) != SUCCESS) {
+        inode_unlock(inode_number);
+        bcache_put(inode_block, false);
+        journal_end_operation();
+        tree_unlock_shared();
+        return ERROR_INVALID_INPUT; // No room for the copy
+    }
+    
+    // The byte count is returned as an int and the end position must fit the 32-bit file size
+    if (count > INT32_MAX) {
+        count = INT32_MAX;
+    }
+    if (count > UINT32_MAX - position) {
+        count = UINT32_MAX - position;
+    }
+    
+    // Write through the block map, straight from the caller's buffers; a file still small enough
+    // is written in the inode, a larger one gets its blocks first
+    IovCursor cursor = { .iov = iov, .index = 0, .offset = 0 };
     size_t bytes_written = 0;
-    uint16_t current_offset = fd->offset;
-    uint16_t block_index = current_offset / BLOCK_SIZE_BYTES;
+    uint32_t current_offset = position;
+    if ((inode->flags & INLINE_DATA_FLAG) != 0) {
+        if ((uint64_t)position + count <= INLINE_DATA_SIZE) {
+            iov_copy_in(&cursor, inode->inline_data + position, count);
+            bytes_written = count;
+        } else if (count > 0 && !convert_inline_data(inode)) {
+            count = 0; // Disk full
+        }
+    }
+    uint32_t block_index = current_offset / BLOCK_SIZE_BYTES;
     uint16_t offset_in_block = current_offset % BLOCK_SIZE_BYTES;
     
-    while (bytes_written < count && block_index < 6) {
+    ExtentReservation extent = { 0, 0 };
+    
+    while (bytes_written < count && block_index < MAX_FILE_BLOCKS) {
         // Get or allocate data block
-        uint16_t data_block = inode->directBlocks[block_index];
+        uint32_t data_block = get_block_for_write(inode, block_index, offset_in_block + (count - bytes_written), &extent);
         if (data_block == 0) {
-            // Need to allocate a new block
-            data_block = find_free_data_block();
-            if (data_block == 0) {
-                break; // No free blocks available
-            }
-            inode->directBlocks[block_index] = data_block;
+            break; // Disk full
         }
         
         // Calculate how much to write to this block
@@ -648,37 +1034,647 @@ int fs_write(uint16_t file_descriptor, const void *buffer, size_t count)
         }
         
         // Copy data from buffer to block
-        memcpy(HARD_DISK[data_block] + offset_in_block,
-               (const uint8_t *)buffer + bytes_written,
-               bytes_to_block);
+        iov_copy_in(&cursor, bcache_get(data_block) + offset_in_block, bytes_to_block);
+        journal_dirty_data(data_block);
+        bcache_put(data_block, true);
         
         bytes_written += bytes_to_block;
         block_index++;
         offset_in_block = 0; // Next block starts at beginning
+        
+        // A long write continues in a new journal operation once this one used its share of
+        // the transaction; the size covers what is written so far
+        if (bytes_written < count && journal_operation_full()) {
+            release_extent(&extent);
+            if (current_offset + bytes_written > inode->file_size) {
+                inode->file_size = current_offset + bytes_written;
+            }
+            journal_dirty_metadata(inode_block);
+            restart_long_operation(inode_number, 0);
+        }
     }
     
+    release_extent(&extent);
+    
     // Update file size if we wrote past the end
     uint32_t new_size = current_offset + bytes_written;
     if (new_size > inode->file_size) {
         inode->file_size = new_size;
     }
     
-    // Update file descriptor offset
-    fd->offset += bytes_written;
+    // Update modification and access times (the access time is also set by readers and opens
+    // that do not hold the write lock)
+    inode->mtime = time(NULL);
+    __atomic_store_n(&inode->time, time(NULL), __ATOMIC_RELAXED);
+    journal_dirty_metadata(inode_block);
+    inode_unlock(inode_number);
+    bcache_put(inode_block, true);
+    journal_end_operation();
+    tree_unlock_shared();
+    
+    return (int)bytes_written;
+}
+
+// Write data to a file at the file descriptor's offset and advance it
+// Returns number of bytes written, or negative error code
+int fs_write(uint16_t file_descriptor, const void *buffer, size_t count)
+{
+    if (buffer == NULL) {
+        return ERROR_INVALID_INPUT;
+    }
     
-    // Update modification and access times
+    // Get the file descriptor
+    FileDescriptor *fd = get_file_descriptor(file_descriptor);
+    if (fd == NULL) {
+        return ERROR_INVALID_INPUT; // Invalid file descriptor
+    }
+    
+    struct iovec iov = { .iov_base = (void *)buffer, .iov_len = count };
+    pthread_mutex_t *fd_lock = get_fd_lock(file_descriptor);
+    pthread_mutex_lock(fd_lock);
+    int bytes_written = write_at(fd, &iov, count, fd->offset);
+    if (bytes_written > 0) {
+        fd->offset += bytes_written; // Update file descriptor offset
+    }
+    pthread_mutex_unlock(fd_lock);
+    return bytes_written;
+}
+
+// Write data to a file at an explicit position, the file descriptor's offset is not used or changed
+// Returns number of bytes written, or negative error code
+int fs_pwrite(uint16_t file_descriptor, const void *buffer, size_t count, uint32_t offset)
+{
+    if (buffer == NULL) {
+        return ERROR_INVALID_INPUT;
+    }
+    
+    FileDescriptor *fd = get_file_descriptor(file_descriptor);
+    if (fd == NULL) {
+        return ERROR_INVALID_INPUT; // Invalid file descriptor
+    }
+    
+    struct iovec iov = { .iov_base = (void *)buffer, .iov_len = count };
+    return write_at(fd, &iov, count, offset);
+}
+
+// Write iovcnt buffers, in order, to a file at the file descriptor's offset and advance it
+// The buffers land in the file back to back as one write (e.g. a record header and its payload)
+// Returns number of bytes written, or negative error code
+int fs_writev(uint16_t file_descriptor, const struct iovec *iov, int iovcnt)
+{
+    size_t count;
+    if (iov_total(iov, iovcnt, &count) != SUCCESS) {
+        return ERROR_INVALID_INPUT;
+    }
+    
+    FileDescriptor *fd = get_file_descriptor(file_descriptor);
+    if (fd == NULL) {
+        return ERROR_INVALID_INPUT; // Invalid file descriptor
+    }
+    
+    pthread_mutex_t *fd_lock = get_fd_lock(file_descriptor);
+    pthread_mutex_lock(fd_lock);
+    int bytes_written = write_at(fd, iov, count, fd->offset);
+    if (bytes_written > 0) {
+        fd->offset += bytes_written;
+    }
+    pthread_mutex_unlock(fd_lock);
+    return bytes_written;
+}
+
+// Copies count bytes of the file behind src_fd from src_offset to the file behind dst_fd at
+// dst_offset, block to block inside the file system, without a caller buffer; neither file
+// descriptor's offset is used or changed. The copy stops at the end of the source file
+// Overlapping ranges of the same file are rejected
+// Returns number of bytes copied, or negative error code
+int fs_copy_range(uint16_t src_fd, uint32_t src_offset, uint16_t dst_fd, uint32_t dst_offset, size_t count)
+{
+    FileDescriptor *src = get_file_descriptor(src_fd);
+    FileDescriptor *dst = get_file_descriptor(dst_fd);
+    if (src == NULL || dst == NULL) {
+        return ERROR_INVALID_INPUT; // Invalid file descriptor
+    }
+    if (((src->flags & O_RDONLY) == 0 && (src->flags & O_RDWR) == 0) ||
+        ((dst->flags & O_WRONLY) == 0 && (dst->flags & O_RDWR) == 0)) {
+        return ERROR_PERMISSION_DENIED;
+    }
+    
+    // The byte count is returned as an int and the end position must fit the 32-bit file size
+    if (count > INT32_MAX) {
+        count = INT32_MAX;
+    }
+    if (count > UINT32_MAX - dst_offset) {
+        count = UINT32_MAX - dst_offset;
+    }
+    
+    uint16_t src_inode_number = src->inode_number;
+    uint16_t dst_inode_number = dst->inode_number;
+    bool same_file = (src_inode_number == dst_inode_number);
+    if (same_file && src_offset < dst_offset + count && dst_offset < src_offset + (uint64_t)count) {
+        return ERROR_INVALID_INPUT; // Overlapping ranges
+    }
+    
+    uint32_t src_inode_block = INODE_START + (src_inode_number / INODES_PER_BLOCK);
+    uint32_t dst_inode_block = INODE_START + (dst_inode_number / INODES_PER_BLOCK);
+    Inode *src_inode = (Inode *)(bcache_get(src_inode_block) + (src_inode_number % INODES_PER_BLOCK) * sizeof(Inode));
+    Inode *dst_inode = (Inode *)(bcache_get(dst_inode_block) + (dst_inode_number % INODES_PER_BLOCK) * sizeof(Inode));
+    if ((src_inode->flags & 2) != 0 || (dst_inode->flags & 2) != 0) {
+        bcache_put(dst_inode_block, false);
+        bcache_put(src_inode_block, false);
+        return ERROR_INVALID_INPUT; // Cannot copy from or to a directory
+    }
+    
+    // The source is read locked and the destination write locked, in inode number order so two
+    // copies in opposite directions cannot deadlock
+    tree_lock_shared();
+    journal_begin_operation();
+    if (same_file) {
+        inode_write_lock(dst_inode_number);
+    } else if (src_inode_number < dst_inode_number) {
+        inode_read_lock(src_inode_number);
+        inode_write_lock(dst_inode_number);
+    } else {
+        inode_write_lock(dst_inode_number);
+        inode_read_lock(src_inode_number);
+    }
+    if (snapshot_preserve(dst_inode_number) != SUCCESS) {
+        if (!same_file) {
+            inode_unlock(src_inode_number);
+        }
+        inode_unlock(dst_inode_number);
+        bcache_put(dst_inode_block, false);
+        bcache_put(src_inode_block, false);
+        journal_end_operation();
+        tree_unlock_shared();
+        return ERROR_INVALID_INPUT; // No room for the snapshots' copy of the destination
+    }
+    
+    uint32_t src_size = src_inode->file_size;
+    if (src_offset >= src_size) {
+        count = 0;
+    } else if (count > src_size - src_offset) {
+        count = src_size - src_offset;
+    }
+    
+    // A destination still small enough stays inline, a larger one gets its blocks first
+    if ((dst_inode->flags & INLINE_DATA_FLAG) != 0 && (uint64_t)dst_offset + count > INLINE_DATA_SIZE &&
+        count > 0 && !convert_inline_data(dst_inode)) {
+        count = 0; // Disk full
+    }
+    
+    // Copy the largest piece that stays inside one source block and one destination block; the
+    // bytes of an inline file are copied from or to its inode, and a source hole copies as zeros
+    ExtentReservation extent = { 0, 0 };
+    size_t bytes_copied = 0;
+    while (bytes_copied < count) {
+        uint32_t src_position = src_offset + bytes_copied;
+        uint32_t dst_position = dst_offset + bytes_copied;
+        uint16_t src_in_block = src_position % BLOCK_SIZE_BYTES;
+        uint16_t dst_in_block = dst_position % BLOCK_SIZE_BYTES;
+        size_t piece = BLOCK_SIZE_BYTES - (src_in_block > dst_in_block ? src_in_block : dst_in_block);
+        if (piece > count - bytes_copied) {
+            piece = count - bytes_copied;
+        }
+        bool src_inline = (src_inode->flags & INLINE_DATA_FLAG) != 0;
+        uint32_t src_block = src_inline ? 0 : inode_bmap(src_inode, src_position / BLOCK_SIZE_BYTES, false);
+        uint32_t dst_block = 0;
+        if ((dst_inode->flags & INLINE_DATA_FLAG) == 0) {
+            uint32_t dst_block_index = dst_position / BLOCK_SIZE_BYTES;
+            if (dst_block_index >= MAX_FILE_BLOCKS) {
+                break; // Destination file is full
+            }
+            if (!src_inline && src_block == 0 && inode_bmap(dst_inode, dst_block_index, false) == 0) {
+                bytes_copied += piece; // Hole onto hole, the destination stays sparse
+                continue;
+            }
+            dst_block = get_block_for_write(dst_inode, dst_block_index, dst_in_block + (count - bytes_copied), &extent);
+            if (dst_block == 0) {
+                break; // Disk full
+            }
+        }
+        
+        const uint8_t *source = src_inline ? src_inode->inline_data + src_position : zero_block;
+        if (src_block != 0) {
+            source = bcache_get(src_block) + src_in_block;
+        }
+        uint8_t *destination = dst_block ? bcache_get(dst_block) + dst_in_block : dst_inode->inline_data + dst_position;
+        memcpy(destination, source, piece);
+        if (src_block != 0) {
+            bcache_put(src_block, false);
+        }
+        if (dst_block != 0) {
+            journal_dirty_data(dst_block);
+            bcache_put(dst_block, true);
+        }
+        bytes_copied += piece;
+        
+        // A long copy continues in a new journal operation once this one used its share
+        if (bytes_copied < count && journal_operation_full()) {
+            release_extent(&extent);
+            if (dst_offset + bytes_copied > dst_inode->file_size) {
+                dst_inode->file_size = dst_offset + bytes_copied;
+            }
+            journal_dirty_metadata(dst_inode_block);
+            restart_long_operation(dst_inode_number, same_file ? 0 : src_inode_number);
+        }
+    }
+    release_extent(&extent);
+    
+    // Update file size if we wrote past the end, and the times of both files
+    uint32_t new_size = dst_offset + bytes_copied;
+    if (bytes_copied > 0 && new_size > dst_inode->file_size) {
+        dst_inode->file_size = new_size;
+    }
+    time_t now = time(NULL);
+    dst_inode->mtime = now;
+    __atomic_store_n(&dst_inode->time, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&src_inode->time, now, __ATOMIC_RELAXED);
+    journal_dirty_metadata(dst_inode_block);
+    if (!same_file) {
+        inode_unlock(src_inode_number);
+    }
+    inode_unlock(dst_inode_number);
+    bcache_put(dst_inode_block, true);
+    bcache_put(src_inode_block, false);
+    journal_end_operation();
+    tree_unlock_shared();
+    
+    return (int)bytes_copied;
+}
+
+// Sets the size of file inode_number. Blocks past the new end are released, including ones
+// reserved by fs_fallocate(), and the rest of the last block is zeroed, so the file reads zeros
+// there if it grows again; growing only sets the size (the new range is a hole)
+// Shared by fs_ftruncate() and fs_open() with O_TRUNC; returns SUCCESS, or ERROR_INVALID_INPUT for
+// a directory or if a block shared with a clone could not be copied (disk full)
+static int truncate_file(uint16_t inode_number, uint32_t size)
+{
+    uint32_t inode_block = INODE_START + (inode_number / INODES_PER_BLOCK);
+    uint16_t inode_offset = (inode_number % INODES_PER_BLOCK) * sizeof(Inode);
+    Inode *inode = (Inode *)(bcache_get(inode_block) + inode_offset);
+    if ((inode->flags & 2) != 0) {
+        bcache_put(inode_block, false);
+        return ERROR_INVALID_INPUT; // Cannot truncate directory
+    }
+    
+    tree_lock_shared();
+    journal_begin_operation();
+    inode_write_lock(inode_number);
+    // Snapshots that still share the file keep a copy of it as it is (see snapshot.c)
+    if (snapshot_preserve(inode_number) != SUCCESS) {
+        inode_unlock(inode_number);
+        bcache_put(inode_block, false);
+        journal_end_operation();
+        tree_unlock_shared();
+        return ERROR_INVALID_INPUT; // No room for the copy
+    }
+    int result = SUCCESS;
+    uint32_t old_size = inode->file_size;
+    if ((inode->flags & INLINE_DATA_FLAG) != 0) {
+        if (size < old_size) {
+            memset(inode->inline_data + size, 0, old_size - size); // Zero past file_size
+        } else if (size > INLINE_DATA_SIZE && !convert_inline_data(inode)) {
+            result = ERROR_INVALID_INPUT; // Disk full
+        }
+        if (result == SUCCESS) {
+            inode->file_size = size;
+        }
+    } else {
+        uint32_t data_block = 0;
+        if (size < old_size && size % BLOCK_SIZE_BYTES != 0) {
+            result = inode_bmap_writable(inode, size / BLOCK_SIZE_BYTES, &data_block);
+        }
+        if (data_block != 0) {
+            uint16_t offset_in_block = size % BLOCK_SIZE_BYTES;
+            memset(bcache_get(data_block) + offset_in_block, 0, BLOCK_SIZE_BYTES - offset_in_block);
+            journal_dirty_data(data_block);
+            bcache_put(data_block, true);
+        }
+        if (result == SUCCESS) {
+            // The new size is set first: while a long truncate is split into several journal
+            // operations, the blocks it has yet to release are past the end of the file
+            uint32_t first_block = (uint32_t)(((uint64_t)size + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES);
+            uint32_t end_block = (uint32_t)(((uint64_t)old_size + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES);
+            inode->file_size = size;
+            result = inode_truncate_blocks_stepwise(inode_number, inode, first_block,
+                                                    (end_block > first_block) ? end_block : first_block);
+            if (result != SUCCESS && inode->file_size == size) {
+                inode->file_size = old_size;
+            }
+        }
+    }
     inode->mtime = time(NULL);
-    inode->time = time(NULL);
+    journal_dirty_metadata(inode_block);
+    inode_unlock(inode_number);
+    bcache_put(inode_block, true);
+    journal_end_operation();
+    tree_unlock_shared();
+    return result;
+}
+
+// Sets the size of the file behind fd to size bytes (see truncate_file()); the file descriptor's
+// offset is not changed
+// Returns SUCCESS or negative error code
+int fs_ftruncate(uint16_t file_descriptor, uint32_t size)
+{
+    FileDescriptor *fd = get_file_descriptor(file_descriptor);
+    if (fd == NULL) {
+        return ERROR_INVALID_INPUT; // Invalid file descriptor
+    }
+    if ((fd->flags & O_WRONLY) == 0 && (fd->flags & O_RDWR) == 0) {
+        return ERROR_PERMISSION_DENIED;
+    }
+    return truncate_file(fd->inode_number, size);
+}
+
+// Reserves the data blocks for length bytes of the file behind fd from offset ahead of the
+// writes that fill them, in as few contiguous runs as the free space allows, so a streaming
+// writer allocates nothing on its way and the file stays contiguous. Blocks the range already
+// has are kept; new ones read as zeros. The file size is not changed, fs_ftruncate() gives the
+// blocks past the end back
+// Returns SUCCESS, or negative error code (ERROR_INVALID_INPUT also when the disk fills up, the
+// blocks reserved until then are kept)
+int fs_fallocate(uint16_t file_descriptor, uint32_t offset, uint32_t length)
+{
+    FileDescriptor *fd = get_file_descriptor(file_descriptor);
+    if (fd == NULL || length == 0) {
+        return ERROR_INVALID_INPUT;
+    }
+    if ((fd->flags & O_WRONLY) == 0 && (fd->flags & O_RDWR) == 0) {
+        return ERROR_PERMISSION_DENIED;
+    }
+    uint64_t end = (uint64_t)offset + length;
+    if (end > (uint64_t)UINT32_MAX + 1 || (end - 1) / BLOCK_SIZE_BYTES >= MAX_FILE_BLOCKS) {
+        return ERROR_INVALID_INPUT; // Past the largest file
+    }
     
-    // Write back updated inode
-    memcpy(HARD_DISK[inode_block] + inode_offset, inode, sizeof(Inode));
+    uint16_t inode_number = fd->inode_number;
+    uint32_t inode_block = INODE_START + (inode_number / INODES_PER_BLOCK);
+    uint16_t inode_offset = (inode_number % INODES_PER_BLOCK) * sizeof(Inode);
+    Inode *inode = (Inode *)(bcache_get(inode_block) + inode_offset);
+    if ((inode->flags & 2) != 0) {
+        bcache_put(inode_block, false);
+        return ERROR_INVALID_INPUT; // Cannot allocate for a directory
+    }
     
-    return (int)bytes_written;
+    tree_lock_shared();
+    journal_begin_operation();
+    inode_write_lock(inode_number);
+    // Snapshots that still share the file keep a copy of it as it is (see snapshot.c)
+    if (snapshot_preserve(inode_number) != SUCCESS) {
+        inode_unlock(inode_number);
+        bcache_put(inode_block, false);
+        journal_end_operation();
+        tree_unlock_shared();
+        return ERROR_INVALID_INPUT; // No room for the copy
+    }
+    int result = SUCCESS;
+    if ((inode->flags & INLINE_DATA_FLAG) != 0 && end > INLINE_DATA_SIZE && !convert_inline_data(inode)) {
+        result = ERROR_INVALID_INPUT; // Disk full
+    }
+    
+    // Missing blocks come from runs of free blocks as long as the rest of the range
+    ExtentReservation extent = { 0, 0 };
+    uint32_t last_block = (uint32_t)((end - 1) / BLOCK_SIZE_BYTES);
+    for (uint32_t block_index = offset / BLOCK_SIZE_BYTES;
+         block_index <= last_block && result == SUCCESS && (inode->flags & INLINE_DATA_FLAG) == 0; block_index++) {
+        if (inode_bmap(inode, block_index, false) != 0) {
+            continue;
+        }
+        if (extent.left == 0) {
+            extent.next = allocate_extent(last_block - block_index + 1, &extent.left);
+            if (extent.next == 0) {
+                result = ERROR_INVALID_INPUT; // Disk full
+                break;
+            }
+        }
+        if (inode_bmap_assign(inode, block_index, extent.next) != SUCCESS) {
+            result = ERROR_INVALID_INPUT; // No free block for an indirect pointer block
+            break;
+        }
+        extent.next++;
+        extent.left--;
+        
+        if (block_index < last_block && journal_operation_full()) {
+            release_extent(&extent);
+            journal_dirty_metadata(inode_block);
+            restart_long_operation(inode_number, 0);
+        }
+    }
+    release_extent(&extent);
+    
+    journal_dirty_metadata(inode_block);
+    inode_unlock(inode_number);
+    bcache_put(inode_block, true);
+    journal_end_operation();
+    tree_unlock_shared();
+    return result;
+}
+
+// Drops the clone's references to every block of its block map (undoes the sharing in fs_clone())
+static void release_block_map(Inode *inode)
+{
+    if ((inode->flags & INLINE_DATA_FLAG) != 0) {
+        return; // No blocks
+    }
+    for (int i = 0; i < DIRECT_BLOCKS; i++) {
+        release_block(inode->directBlocks[i], 0);
+    }
+    release_block(inode->indirect, 1);
+    release_block(inode->second_level_indirect, 2);
+}
+
+// Creates a copy-on-write clone of file src_inode_number, named by the first name_len bytes of
+// name, in directory parent_inode: the new inode points at the same data and pointer blocks, which
+// gain a reference each, so a clone costs the same for any file size and takes no data blocks.
+// The files stop sharing a block when either one writes to it
+// Returns inode number of the clone, or 0 on error (source is a directory or a snapshot record,
+// name exists, no free inode, the session has a snapshot mounted or parent_inode is part of a snapshot)
+uint16_t clone_file_in(uint16_t parent_inode, const char *name, size_t name_len, uint16_t src_inode_number)
+{
+    if (name == NULL || name_len == 0 || name_len > MAX_FILENAME || session_config->read_only ||
+        !snapshot_allows_change(parent_inode)) {
+        return 0;
+    }
+    if (find_directory_entry_n(parent_inode, name, name_len) != 0) {
+        return 0; // Name already exists
+    }
+    
+    // Inode, share counts and directory entry are committed together
+    tree_lock_shared();
+    journal_begin_operation();
+    uint16_t clone_inode_number = find_free_inode();
+    if (clone_inode_number == 0) {
+        journal_end_operation();
+        tree_unlock_shared();
+        return 0; // No free inodes
+    }
+    
+    // Copy the source inode and share its block map; the read lock keeps writers of the source
+    // from changing the blocks while they are being shared
+    uint32_t src_inode_block = INODE_START + (src_inode_number / INODES_PER_BLOCK);
+    Inode *src_inode = (Inode *)(bcache_get(src_inode_block) + (src_inode_number % INODES_PER_BLOCK) * sizeof(Inode));
+    Inode clone;
+    inode_read_lock(src_inode_number);
+    memcpy(&clone, src_inode, sizeof(Inode));
+    bool is_file = (clone.flags & (2 | SNAPSHOT_RECORD_FLAG)) == 0; // Not a directory or a snapshot record
+    if (is_file && (clone.flags & INLINE_DATA_FLAG) == 0) { // Inline data was copied with the inode
+        for (int i = 0; i < DIRECT_BLOCKS; i++) {
+            share_data_block(clone.directBlocks[i]);
+        }
+        share_data_block(clone.indirect);
+        share_data_block(clone.second_level_indirect);
+    }
+    inode_unlock(src_inode_number);
+    bcache_put(src_inode_block, false);
+    if (!is_file) {
+        free_inode(clone_inode_number);
+        journal_end_operation();
+        tree_unlock_shared();
+        return 0; // Only files can be cloned
+    }
+    
+    clone.ownerID = session_config->uid;
+    clone.flags &= ~SNAPSHOT_FLAG; // A clone of a snapshot file is an ordinary file
+    clone.time = time(NULL);
+    clone.ctime = clone.time;
+    clone.mtime = clone.time;
+    clone.dtime = 0;
+    uint32_t clone_inode_block = INODE_START + (clone_inode_number / INODES_PER_BLOCK);
+    memcpy(bcache_get(clone_inode_block) + (clone_inode_number % INODES_PER_BLOCK) * sizeof(Inode), &clone, sizeof(Inode));
+    journal_dirty_metadata(clone_inode_block);
+    bcache_put(clone_inode_block, true);
+    
+    if (add_directory_entry_n(parent_inode, name, name_len, clone_inode_number) != SUCCESS) {
+        // Name taken meanwhile or directory full: give the references back
+        release_block_map(&clone);
+        free_inode(clone_inode_number);
+        clone_inode_number = 0;
+    } else {
+        name_index_add(clone_inode_number, parent_inode, name, name_len);
+    }
+    journal_end_operation();
+    tree_unlock_shared();
+    return clone_inode_number;
+}
+
+// fs_clone() body, called with the tree lock held shared
+static int clone_locked(const char *src_path, const char *dst_path)
+{
+    uint16_t src_inode_number;
+    int result = traverse_path(src_path, &src_inode_number);
+    if (result != SUCCESS) {
+        return result;
+    }
+    result = check_permissions(src_inode_number, O_RDONLY);
+    if (result != SUCCESS) {
+        return result;
+    }
+    ResolvedPath dst;
+    result = resolve_path(dst_path, session_config->current_dir_inode, &dst);
+    if (result != SUCCESS) {
+        return result;
+    }
+    if (dst.exists || dst.name_length == 0) {
+        return ERROR_INVALID_INPUT; // Destination exists, or names no file
+    }
+    if (!snapshot_allows_change(dst.parent_inode)) {
+        return ERROR_PERMISSION_DENIED;
+    }
+    if (clone_file_in(dst.parent_inode, dst.name, dst.name_length, src_inode_number) == 0) {
+        return ERROR_INVALID_INPUT;
+    }
+    return SUCCESS;
 }
 
-// reset_HARD_DISK fills hard disk with 0s
+// Creates dst_path as a copy-on-write clone of the file src_path (see clone_file_in())
+// Returns SUCCESS, ERROR_FILE_NOT_FOUND if the source is missing, ERROR_PERMISSION_DENIED if it
+// cannot be read, a snapshot is mounted or the destination is inside a snapshot, or
+// ERROR_INVALID_INPUT (source is a directory, destination exists, no free inode)
+int fs_clone(const char *src_path, const char *dst_path)
+{
+    if (src_path == NULL || dst_path == NULL) {
+        return ERROR_INVALID_INPUT;
+    }
+    if (session_config->read_only) {
+        return ERROR_PERMISSION_DENIED;
+    }
+    
+    // The source cannot be deleted with its snapshot while its blocks are being shared
+    tree_lock_shared();
+    int result = clone_locked(src_path, dst_path);
+    tree_unlock_shared();
+    return result;
+}
+
+// Move the file descriptor's offset: whence is SEEK_SET (from the start), SEEK_CUR (from the
+// current offset) or SEEK_END (from the end of the file); seeking past the end is allowed
+// Returns the new offset, or negative error code
+int fs_lseek(uint16_t file_descriptor, int32_t offset, int whence)
+{
+    FileDescriptor *fd = get_file_descriptor(file_descriptor);
+    if (fd == NULL) {
+        return ERROR_INVALID_INPUT; // Invalid file descriptor
+    }
+    
+    if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END) {
+        return ERROR_INVALID_INPUT;
+    }
+    
+    pthread_mutex_t *fd_lock = get_fd_lock(file_descriptor);
+    pthread_mutex_lock(fd_lock);
+    int64_t base;
+    if (whence == SEEK_SET) {
+        base = 0;
+    } else if (whence == SEEK_CUR) {
+        base = fd->offset;
+    } else {
+        uint16_t inode_number = fd->inode_number;
+        uint32_t inode_block = INODE_START + (inode_number / INODES_PER_BLOCK);
+        uint16_t inode_offset = (inode_number % INODES_PER_BLOCK) * sizeof(Inode);
+        Inode *inode = (Inode *)(bcache_get(inode_block) + inode_offset);
+        inode_read_lock(inode_number);
+        base = inode->file_size;
+        inode_unlock(inode_number);
+        bcache_put(inode_block, false);
+    }
+    
+    // The new offset is returned as an int, so it has to stay in [0, INT32_MAX]
+    int64_t new_offset = base + offset;
+    if (new_offset < 0 || new_offset > INT32_MAX) {
+        pthread_mutex_unlock(fd_lock);
+        return ERROR_INVALID_INPUT;
+    }
+    
+    fd->offset = (uint32_t)new_offset;
+    pthread_mutex_unlock(fd_lock);
+    return (int)new_offset;
+}
+
+// reset_HARD_DISK fills hard disk with 0s (the in-memory disk lazily, see clear_disk_image())
 void reset_hard_disk()
 {
-    memset(HARD_DISK, 0, sizeof(HARD_DISK));
+    clear_disk_image(); // Also empties the journal of a mounted image
+    dcache_invalidate_all(); // Cached names refer to the old contents
+}
+
+// Formats the disk: a new superblock and bitmaps and an empty root directory
+// Only the metadata is written, so this takes the same time whatever was on the disk before
+// geometry sets the block size, block count and inode count of the new file system (0 fields take
+// the defaults); NULL keeps the current geometry. Returns SUCCESS or a negative error code
+int format_disk(const DiskGeometry *geometry)
+{
+    if (geometry != NULL) {
+        int result = set_disk_geometry(geometry);
+        if (result != SUCCESS) {
+            return result;
+        }
+    }
+    reset_hard_disk();
+    init_superblock();
+    create_root_directory();
+    // Write the superblock home right away: a mount reads it before the journal is replayed,
+    // since the geometry it records tells where the journal is
+    return journal_checkpoint();
 }
 
@@ -0,0 +1,673 @@
+// Throughput and latency benchmark for the file system core
+// Runs each workload on T threads against a freshly formatted disk and prints one JSON object
+// per workload on stdout, so runs of different releases can be compared by a script
+//
+// Usage: ./fs_bench [-t threads] [-n files] [-s file_size] [-b chunk] [-d depth] [-r rounds]
+//                   [-p search_threads] [-x] [-w workload,...] [-i image_file] [-c cache_blocks]
+//                   [-g block_size[,blocks[,inodes]]]
+// Workloads (all by default, always run in this order):
+//   create  create n files in one directory (n / T per thread)
+//   write   each thread writes its own file of file_size bytes in chunk sized fs_write calls
+//   writev  the same as chunk sized records, a 16 byte header and its payload per fs_writev call
+//   read    each thread reads its file back in chunk sized fs_read calls
+//   view    the same with fs_read_view, summing the bytes in place instead of copying them
+//   copy    each thread copies its file to a new one in chunk sized fs_copy_range calls
+//   pread   n random 4 KiB fs_pread calls on the threads' files
+//   open    n fs_open/fs_close pairs on a path depth directories deep
+//   list    rounds fs_readdir_plus listings per thread of the directory filled by create
+//   search  rounds fs_search calls per thread over the whole tree, each on search_threads
+//           worker threads (default 1; 0 for one per CPU); with -x the name index answers them
+//   startup rounds formats of the disk by one thread, each timed up to its first file created
+//           (runs last: it wipes what the other workloads wrote)
+// With -i the block cache counters of the run are printed on stderr at the end
+// -g formats with another geometry than the default (2 KiB blocks, 16384 blocks, 16384 inodes)
+#include "headers/common.h"
+#include "headers/utils.h"
+#include "headers/file_operations.h"
+#include "headers/directory_operations.h"
+#include "headers/disk_image.h"
+#include "headers/locks.h"
+#include "headers/bcache.h"
+#include "headers/search.h"
+#include "headers/name_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+extern _Thread_local SessionConfig *session_config;
+
+#define PREAD_SIZE 4096
+#define RECORD_HEADER_SIZE 16
+
+typedef struct {
+    int threads;
+    uint32_t files;     // files for create, operations for pread and open
+    uint32_t file_size; // bytes per thread for write/read
+    uint32_t chunk;     // bytes per fs_write/fs_read call
+    int depth;          // directories above the file opened by the open workload
+    uint32_t rounds;    // operations per thread for list and search
+    int search_threads; // worker threads per fs_search call
+    bool name_index;    // enable the name index after formatting
+    const char *workloads;
+    const char *image_path;
+    uint32_t cache_blocks; // block cache size for -i, 0 for the default
+    DiskGeometry geometry; // geometry of the formatted disk, 0 fields for the defaults
+} BenchConfig;
+
+static BenchConfig config = {
+    .threads = 4,
+    .files = 2000,
+    .file_size = 1024 * 1024,
+    .chunk = 4096,
+    .depth = 16,
+    .rounds = 20,
+    .search_threads = 1,
+    .name_index = false,
+    .workloads = "create,write,writev,read,view,copy,pread,open,list,search,startup",
+    .image_path = NULL,
+    .cache_blocks = 0,
+    .geometry = { 0, 0, 0 },
+};
+
+// Per-thread state: latencies of the timed operations, in nanoseconds
+typedef struct {
+    int id;
+    uint32_t ops;         // operations this thread runs
+    uint64_t *latencies;  // ops entries
+    uint32_t count;       // latencies recorded
+    uint32_t errors;
+    uint64_t bytes;       // bytes moved by read/write workloads
+    uint64_t started;     // when the timed loop started and ended
+    uint64_t finished;
+    pthread_barrier_t *start;
+} BenchThread;
+
+typedef void (*WorkloadFn)(BenchThread *thread);
+
+// Inodes prepared before the timed workloads run
+static uint16_t create_dir_inode;
+static char deep_path[MAX_PATH_LENGTH];
+static bool seq_files_written;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void record(BenchThread *thread, uint64_t start, bool ok)
+{
+    thread->latencies[thread->count++] = now_ns() - start;
+    if (!ok) {
+        thread->errors++;
+    }
+}
+
+static void seq_file_path(char *path, int id)
+{
+    snprintf(path, MAX_PATH_LENGTH, "/seq_%d", id);
+}
+
+// Workloads: untimed per-thread setup, then wait for every thread, then the timed loop
+
+static void run_create(BenchThread *thread)
+{
+    char name[MAX_FILENAME + 1];
+    pthread_barrier_wait(thread->start);
+    thread->started = now_ns();
+    for (uint32_t i = 0; i < thread->ops; i++) {
+        snprintf(name, sizeof(name), "f_%d_%u", thread->id, i);
+        uint64_t start = now_ns();
+        uint16_t inode = create_file_in(create_dir_inode, name, strlen(name));
+        record(thread, start, inode != 0);
+    }
+}
+
+static void run_write(BenchThread *thread)
+{
+    char path[MAX_PATH_LENGTH];
+    seq_file_path(path, thread->id);
+    uint8_t *buffer = malloc(config.chunk);
+    memset(buffer, 'a' + thread->id % 26, config.chunk);
+    int fd = fs_open(path, O_CREAT | O_RDWR);
+    pthread_barrier_wait(thread->start);
+    thread->started = now_ns();
+    for (uint32_t i = 0; i < thread->ops; i++) {
+        uint64_t start = now_ns();
+        int written = fs_write(fd, buffer, config.chunk);
+        record(thread, start, written == (int)config.chunk);
+        if (written > 0) {
+            thread->bytes += written;
+        }
+    }
+    fs_close(fd);
+    free(buffer);
+}
+
+static void run_writev(BenchThread *thread)
+{
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, MAX_PATH_LENGTH, "/records_%d", thread->id);
+    uint8_t header[RECORD_HEADER_SIZE];
+    uint8_t *payload = malloc(config.chunk - RECORD_HEADER_SIZE);
+    memset(payload, 'a' + thread->id % 26, config.chunk - RECORD_HEADER_SIZE);
+    struct iovec record_iov[2] = {
+        { .iov_base = header, .iov_len = RECORD_HEADER_SIZE },
+        { .iov_base = payload, .iov_len = config.chunk - RECORD_HEADER_SIZE },
+    };
+    int fd = fs_open(path, O_CREAT | O_RDWR);
+    pthread_barrier_wait(thread->start);
+    thread->started = now_ns();
+    for (uint32_t i = 0; i < thread->ops; i++) {
+        memset(header, 0, sizeof(header));
+        memcpy(header, &i, sizeof(i)); // Record number
+        uint64_t start = now_ns();
+        int written = fs_writev(fd, record_iov, 2);
+        record(thread, start, written == (int)config.chunk);
+        if (written > 0) {
+            thread->bytes += written;
+        }
+    }
+    fs_close(fd);
+    free(payload);
+}
+
+static void run_read(BenchThread *thread)
+{
+    char path[MAX_PATH_LENGTH];
+    seq_file_path(path, thread->id);
+    uint8_t *buffer = malloc(config.chunk);
+    int fd = fs_open(path, O_RDONLY);
+    pthread_barrier_wait(thread->start);
+    thread->started = now_ns();
+    for (uint32_t i = 0; i < thread->ops; i++) {
+        uint64_t start = now_ns();
+        int bytes_read = fs_read(fd, buffer, config.chunk);
+        record(thread, start, bytes_read == (int)config.chunk);
+        if (bytes_read > 0) {
+            thread->bytes += bytes_read;
+        }
+    }
+    fs_close(fd);
+    free(buffer);
+}
+
+static void run_view(BenchThread *thread)
+{
+    char path[MAX_PATH_LENGTH];
+    seq_file_path(path, thread->id);
+    uint64_t sum = 0;
+    int fd = fs_open(path, O_RDONLY);
+    pthread_barrier_wait(thread->start);
+    thread->started = now_ns();
+    for (uint32_t i = 0; i < thread->ops; i++) {
+        uint64_t start = now_ns();
+        FileView *views;
+        int nviews;
+        int bytes_read = fs_read_view(fd, i * config.chunk, config.chunk, &views, &nviews);
+        for (int v = 0; v < nviews; v++) {
+            for (uint32_t b = 0; b < views[v].length; b++) {
+                sum += views[v].data[b];
+            }
+        }
+        fs_release_view(views, nviews);
+        record(thread, start, bytes_read == (int)config.chunk);
+        if (bytes_read > 0) {
+            thread->bytes += bytes_read;
+        }
+    }
+    fs_close(fd);
+    if (sum == 0) {
+        thread->errors++; // The file is filled with letters
+    }
+}
+
+static void run_copy(BenchThread *thread)
+{
+    char path[MAX_PATH_LENGTH];
+    char copy_path[MAX_PATH_LENGTH];
+    seq_file_path(path, thread->id);
+    snprintf(copy_path, MAX_PATH_LENGTH, "/copy_%d", thread->id);
+    int src_fd = fs_open(path, O_RDONLY);
+    int dst_fd = fs_open(copy_path, O_CREAT | O_RDWR);
+    pthread_barrier_wait(thread->start);
+    thread->started = now_ns();
+    for (uint32_t i = 0; i < thread->ops; i++) {
+        uint64_t start = now_ns();
+        int copied = fs_copy_range(src_fd, i * config.chunk, dst_fd, i * config.chunk, config.chunk);
+        record(thread, start, copied == (int)config.chunk);
+        if (copied > 0) {
+            thread->bytes += copied;
+        }
+    }
+    fs_close(dst_fd);
+    fs_close(src_fd);
+}
+
+static void run_pread(BenchThread *thread)
+{
+    char path[MAX_PATH_LENGTH];
+    seq_file_path(path, thread->id);
+    uint8_t buffer[PREAD_SIZE];
+    unsigned int seed = 12345u + thread->id;
+    uint32_t positions = config.file_size / PREAD_SIZE;
+    int fd = fs_open(path, O_RDONLY);
+    pthread_barrier_wait(thread->start);
+    thread->started = now_ns();
+    for (uint32_t i = 0; i < thread->ops; i++) {
+        uint32_t offset = (uint32_t)(rand_r(&seed) % positions) * PREAD_SIZE;
+        uint64_t start = now_ns();
+        int bytes_read = fs_pread(fd, buffer, PREAD_SIZE, offset);
+        record(thread, start, bytes_read == PREAD_SIZE);
+        if (bytes_read > 0) {
+            thread->bytes += bytes_read;
+        }
+    }
+    fs_close(fd);
+}
+
+static void run_open(BenchThread *thread)
+{
+    pthread_barrier_wait(thread->start);
+    thread->started = now_ns();
+    for (uint32_t i = 0; i < thread->ops; i++) {
+        uint64_t start = now_ns();
+        int fd = fs_open(deep_path, O_RDONLY);
+        if (fd >= 0) {
+            fs_close(fd);
+        }
+        record(thread, start, fd >= 0);
+    }
+}
+
+// Lists every entry of a directory with its inode attributes the way "ls -l" does, in 16 KiB
+// fs_readdir_plus() batches; returns the number of entries
+static uint32_t list_entries(uint16_t dir_inode)
+{
+    static _Thread_local _Alignas(DirectoryRecord) uint8_t records[16384];
+    uint32_t cookie = 0;
+    uint32_t count = 0;
+    int filled;
+
+    while ((filled = fs_readdir_plus(dir_inode, &cookie, records, sizeof(records))) > 0) {
+        for (int offset = 0; offset < filled; offset += ((DirectoryRecord *)(records + offset))->record_length) {
+            count++;
+        }
+    }
+    return filled < 0 ? 0 : count;
+}
+
+static void run_list(BenchThread *thread)
+{
+    pthread_barrier_wait(thread->start);
+    thread->started = now_ns();
+    for (uint32_t i = 0; i < thread->ops; i++) {
+        uint64_t start = now_ns();
+        uint32_t count = list_entries(create_dir_inode);
+        record(thread, start, count > 0);
+    }
+}
+
+static bool count_search_result(const char *path, uint16_t inode_number, void *context)
+{
+    (void)path;
+    (void)inode_number;
+    (*(uint32_t *)context)++;
+    return true;
+}
+
+static void run_search(BenchThread *thread)
+{
+    // Matches only the sequential files, so the whole tree is walked (unless it is indexed)
+    SearchOptions options = { .mode = SEARCH_SUBSTRING, .pattern = "seq_", .max_results = 0,
+                              .threads = config.search_threads };
+    pthread_barrier_wait(thread->start);
+    thread->started = now_ns();
+    for (uint32_t i = 0; i < thread->ops; i++) {
+        uint64_t start = now_ns();
+        uint32_t found = 0;
+        int result = fs_search("/", &options, count_search_result, &found);
+        record(thread, start, result >= 0);
+    }
+}
+
+// Time to first operation: a format of the disk (of whatever the earlier workloads left on it)
+// followed by the first file create
+static void run_startup(BenchThread *thread)
+{
+    pthread_barrier_wait(thread->start);
+    thread->started = now_ns();
+    for (uint32_t i = 0; i < thread->ops; i++) {
+        uint64_t start = now_ns();
+        format_disk(NULL);
+        uint16_t inode = create_file_in(0, "first", strlen("first"));
+        record(thread, start, inode != 0);
+    }
+}
+
+// Untimed preparation shared by several workloads
+
+static void prepare_seq_files(void)
+{
+    if (seq_files_written) {
+        return;
+    }
+    char path[MAX_PATH_LENGTH];
+    uint8_t *buffer = calloc(1, config.file_size);
+    for (int id = 0; id < config.threads; id++) {
+        seq_file_path(path, id);
+        int fd = fs_open(path, O_CREAT | O_RDWR);
+        fs_pwrite(fd, buffer, config.file_size, 0);
+        fs_close(fd);
+    }
+    free(buffer);
+    seq_files_written = true;
+}
+
+static void prepare_deep_path(void)
+{
+    uint16_t saved_dir = session_config->current_dir_inode;
+    session_config->current_dir_inode = 0;
+    strcpy(deep_path, "");
+    char name[MAX_FILENAME + 1];
+    for (int level = 0; level < config.depth; level++) {
+        snprintf(name, sizeof(name), "deep%d", level);
+        uint16_t dir = create_directory(name);
+        if (dir == 0) {
+            break;
+        }
+        session_config->current_dir_inode = dir;
+        strncat(deep_path, "/", sizeof(deep_path) - strlen(deep_path) - 1);
+        strncat(deep_path, name, sizeof(deep_path) - strlen(deep_path) - 1);
+    }
+    strncat(deep_path, "/target", sizeof(deep_path) - strlen(deep_path) - 1);
+    session_config->current_dir_inode = saved_dir;
+    int fd = fs_open(deep_path, O_CREAT | O_RDWR);
+    if (fd >= 0) {
+        fs_close(fd);
+    }
+}
+
+typedef struct {
+    const char *name;
+    WorkloadFn run;
+    void (*prepare)(void);
+} Workload;
+
+static const Workload workloads[] = {
+    { "create", run_create, NULL },
+    { "write",  run_write,  NULL },
+    { "writev", run_writev, NULL },
+    { "read",   run_read,   prepare_seq_files },
+    { "view",   run_view,   prepare_seq_files },
+    { "copy",   run_copy,   prepare_seq_files },
+    { "pread",  run_pread,  prepare_seq_files },
+    { "open",   run_open,   prepare_deep_path },
+    { "list",   run_list,   NULL },
+    { "search", run_search, NULL },
+    { "startup", run_startup, NULL },
+};
+
+// Operations for one thread of a workload
+static uint32_t ops_for_thread(const char *name, int id)
+{
+    uint32_t total;
+    if (strcmp(name, "write") == 0 || strcmp(name, "writev") == 0 || strcmp(name, "read") == 0 ||
+        strcmp(name, "view") == 0 || strcmp(name, "copy") == 0) {
+        return config.file_size / config.chunk;
+    } else if (strcmp(name, "list") == 0 || strcmp(name, "search") == 0) {
+        return config.rounds;
+    } else if (strcmp(name, "startup") == 0) {
+        return (id == 0) ? config.rounds : 0;
+    }
+    total = config.files;
+    // Spread the remainder over the first threads
+    return total / config.threads + ((uint32_t)id < total % config.threads ? 1 : 0);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, size_t count, double p)
+{
+    if (count == 0) {
+        return 0.0;
+    }
+    size_t index = (size_t)(p * count);
+    if (index >= count) {
+        index = count - 1;
+    }
+    return sorted[index] / 1000.0;
+}
+
+typedef struct {
+    BenchThread *thread;
+    WorkloadFn run;
+} ThreadStart;
+
+static void *thread_start(void *arg)
+{
+    ThreadStart *start = arg;
+    SessionConfig session;
+    init_session(&session, 0);
+    start->run(start->thread);
+    start->thread->finished = now_ns();
+    return NULL;
+}
+
+static void run_workload(const Workload *workload)
+{
+    if (workload->prepare != NULL) {
+        workload->prepare();
+    }
+
+    int threads = config.threads;
+    BenchThread *state = calloc(threads, sizeof(BenchThread));
+    ThreadStart *starts = calloc(threads, sizeof(ThreadStart));
+    pthread_t *handles = calloc(threads, sizeof(pthread_t));
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+
+    size_t total_ops = 0;
+    for (int i = 0; i < threads; i++) {
+        state[i].id = i;
+        state[i].ops = ops_for_thread(workload->name, i);
+        state[i].latencies = malloc((state[i].ops + 1) * sizeof(uint64_t));
+        state[i].start = &barrier;
+        starts[i].thread = &state[i];
+        starts[i].run = workload->run;
+        total_ops += state[i].ops;
+        pthread_create(&handles[i], NULL, thread_start, &starts[i]);
+    }
+
+    // Every thread has done its setup once the barrier opens; the run lasts from the
+    // first thread starting its timed loop to the last one finishing
+    pthread_barrier_wait(&barrier);
+    uint64_t first_start = UINT64_MAX;
+    uint64_t last_finish = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(handles[i], NULL);
+        if (state[i].started < first_start) {
+            first_start = state[i].started;
+        }
+        if (state[i].finished > last_finish) {
+            last_finish = state[i].finished;
+        }
+    }
+    double seconds = (last_finish - first_start) / 1e9;
+
+    // Merge the per-thread latencies for the percentiles
+    uint64_t *all = malloc((total_ops + 1) * sizeof(uint64_t));
+    size_t count = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(all + count, state[i].latencies, state[i].count * sizeof(uint64_t));
+        count += state[i].count;
+        errors += state[i].errors;
+        bytes += state[i].bytes;
+        free(state[i].latencies);
+    }
+    qsort(all, count, sizeof(uint64_t), compare_u64);
+
+    printf("{\"workload\":\"%s\",\"threads\":%d,\"ops\":%zu,\"errors\":%llu,\"seconds\":%.6f,"
+           "\"ops_per_sec\":%.1f,\"bytes\":%llu,\"mb_per_sec\":%.1f,"
+           "\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f}\n",
+           workload->name, threads, count, (unsigned long long)errors, seconds,
+           seconds > 0 ? count / seconds : 0.0, (unsigned long long)bytes,
+           seconds > 0 ? bytes / seconds / (1024.0 * 1024.0) : 0.0,
+           percentile_us(all, count, 0.50), percentile_us(all, count, 0.99),
+           percentile_us(all, count, 0.999));
+    fflush(stdout);
+
+    if (strcmp(workload->name, "write") == 0) {
+        seq_files_written = true;
+    }
+
+    free(all);
+    pthread_barrier_destroy(&barrier);
+    free(handles);
+    free(starts);
+    free(state);
+}
+
+// True if name is in the comma separated list
+static bool workload_selected(const char *list, const char *name)
+{
+    size_t length = strlen(name);
+    const char *p = list;
+    while (*p != '\0') {
+        const char *end = strchr(p, ',');
+        size_t item_length = (end != NULL) ? (size_t)(end - p) : strlen(p);
+        if (item_length == length && strncmp(p, name, length) == 0) {
+            return true;
+        }
+        if (end == NULL) {
+            break;
+        }
+        p = end + 1;
+    }
+    return false;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-n files] [-s file_size] [-b chunk] [-d depth] [-r rounds]\n"
+            "          [-p search_threads] [-x] [-w workload,...] [-i image_file] [-c cache_blocks]\n"
+            "          [-g block_size[,blocks[,inodes]]]\n"
+            "Workloads: create, write, writev, read, view, copy, pread, open, list, search, startup\n"
+            "With -x searches use the name index\n"
+            "With -i the image file is formatted and the benchmark runs on it through a block cache\n"
+            "of cache_blocks blocks (at least %d, default %d)\n"
+            "With -g the disk is formatted with block_size byte blocks (%d to %d, default %d),\n"
+            "blocks blocks (default %d) and inodes inodes (default %d)\n",
+            program, BCACHE_MIN_BLOCKS, BCACHE_DEFAULT_BLOCKS, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE,
+            DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_NUM, DEFAULT_INODE_COUNT);
+}
+
+int main(int argc, char *argv[])
+{
+    int option;
+    while ((option = getopt(argc, argv, "t:n:s:b:d:r:p:xw:i:c:g:h")) != -1) {
+        switch (option) {
+        case 't': config.threads = atoi(optarg); break;
+        case 'n': config.files = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 's': config.file_size = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'b': config.chunk = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'd': config.depth = atoi(optarg); break;
+        case 'r': config.rounds = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'p': config.search_threads = atoi(optarg); break;
+        case 'x': config.name_index = true; break;
+        case 'w': config.workloads = optarg; break;
+        case 'i': config.image_path = optarg; break;
+        case 'c': config.cache_blocks = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'g':
+            if (!parse_disk_geometry(optarg, &config.geometry)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    DiskLayout layout;
+    if (compute_disk_layout(&config.geometry, &layout) != SUCCESS) {
+        fprintf(stderr, "Unsupported disk geometry\n");
+        usage(argv[0]);
+        return 1;
+    }
+
+    // The threads' files, the created files and the deep path all have to fit on the disk
+    uint64_t data_bytes = (uint64_t)config.threads * config.file_size;
+    uint64_t file_sets = 1;
+    if (workload_selected(config.workloads, "writev")) {
+        file_sets++; // Record files next to the write workload's files
+    }
+    if (workload_selected(config.workloads, "copy")) {
+        file_sets++; // Copies of the write workload's files
+    }
+    data_bytes *= file_sets;
+    if (config.threads < 1 || config.chunk <= RECORD_HEADER_SIZE || config.file_size < PREAD_SIZE ||
+        config.file_size % config.chunk != 0 || config.depth < 1 ||
+        config.search_threads < 0 || config.search_threads > SEARCH_MAX_THREADS ||
+        (workload_selected(config.workloads, "view") && config.chunk > FS_VIEW_MAX_BLOCKS * layout.block_size) ||
+        (config.cache_blocks != 0 && config.cache_blocks < BCACHE_MIN_BLOCKS) ||
+        config.files + config.depth + config.threads + 2 >= layout.inode_count ||
+        data_bytes + (uint64_t)(config.files + config.depth) * layout.block_size >
+            (uint64_t)(layout.block_num - layout.data_start) * layout.block_size * 9 / 10) {
+        fprintf(stderr, "Invalid or too large configuration for a %u block disk\n", layout.block_num);
+        usage(argv[0]);
+        return 1;
+    }
+
+    SessionConfig session;
+    init_session(&session, 0);
+    if (config.image_path != NULL) {
+        if (config.cache_blocks != 0) {
+            bcache_set_capacity(config.cache_blocks);
+        }
+        int result = mount_disk_image(config.image_path);
+        if (result != SUCCESS && result != ERROR_NO_FILESYSTEM) {
+            fprintf(stderr, "Cannot mount disk image '%s' (error: %d)\n", config.image_path, result);
+            return 1;
+        }
+    }
+    if (format_disk(&config.geometry) != SUCCESS) {
+        fprintf(stderr, "Cannot format the disk\n");
+        return 1;
+    }
+    if (config.name_index) {
+        fs_name_index_enable();
+    }
+    create_dir_inode = create_directory("create");
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (workload_selected(config.workloads, workloads[i].name)) {
+            run_workload(&workloads[i]);
+        }
+    }
+
+    if (config.image_path != NULL) {
+        BlockCacheStats stats;
+        bcache_get_stats(&stats);
+        fprintf(stderr, "block cache: %u blocks, %llu hits, %llu misses, %llu evictions, %llu blocks written\n",
+                stats.capacity, (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                (unsigned long long)stats.evictions, (unsigned long long)stats.writes);
+    }
+    unmount_disk_image();
+    return 0;
+}
@@ -0,0 +1,39 @@
+// this is where we declare the block cache between the file system and its backing device
+#ifndef BCACHE_H
+#define BCACHE_H
+#include "common.h"
+
+#define BCACHE_DEFAULT_BLOCKS 4096 // cached blocks (8 MiB of 2 KiB blocks) unless bcache_set_capacity() says otherwise
+#define BCACHE_MIN_BLOCKS 1024     // enough for a full journal transaction plus the operations in flight
+
+// Block access: bcache_get() returns the block's BLOCK_SIZE_BYTES bytes, valid until the matching
+// bcache_put(); dirty says the block was changed. Metadata changes are also reported to the journal
+// (journal_dirty_metadata()) before the block is put
+uint8_t* bcache_get(uint32_t block);
+void bcache_put(uint32_t block, bool dirty);
+uint8_t* bcache_pin(uint32_t block); // like bcache_get(), but stays valid until the device is closed
+uint8_t* bcache_get_view(uint32_t block); // like bcache_get() for long-held pins, NULL if none can be spared
+void bcache_put_view(uint32_t block);
+bool bcache_block_of(const void *address, uint32_t *block); // block holding an address returned above
+
+// Journal hooks: a held block is never written to its home location by the cache
+void bcache_hold(uint32_t block, uint32_t transaction);
+void bcache_release(uint32_t block, uint32_t transaction);
+int bcache_write_back(const uint32_t *blocks, uint32_t count);
+
+// Backing device: the in-memory disk (HARD_DISK) until bcache_open() attaches an image file
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writes; // blocks written to the device by write back and eviction
+    uint32_t capacity;
+} BlockCacheStats;
+
+void bcache_set_capacity(uint32_t blocks);
+int bcache_open(int image_fd);
+int bcache_flush(void);
+void bcache_invalidate(void);
+int bcache_close(void);
+void bcache_get_stats(BlockCacheStats *stats);
+#endif
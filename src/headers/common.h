@@ -20,12 +20,17 @@
 #define MAX_PATH_LENGTH 1024
 #define MAX_FILENAME 256
 #define BUFFER_SIZE 4096
+#define FS_IOV_MAX 1024 // most buffers in one fs_readv/fs_writev call
+#define FS_VIEW_MAX_BLOCKS 64 // most blocks one fs_read_view call pins (128 KiB), longer reads are short
+#define FS_VIEW_MAX_PINNED 1024 // most blocks all unreleased views together pin, past that fs_read_view fails
 
 // Error codes
 #define SUCCESS 0
 #define ERROR_FILE_NOT_FOUND -1
 #define ERROR_PERMISSION_DENIED -2
 #define ERROR_INVALID_INPUT -3
+#define ERROR_NO_FILESYSTEM -4 // disk image has no valid superblock (needs formatting)
+#define ERROR_IO -5            // backing image could not be opened, mapped or synced
 
 // File operation flags (similar to POSIX)
 #define O_RDONLY 0x0001  // Read only
@@ -34,49 +39,159 @@
 #define O_CREAT  0x0008  // Create if not exists
 #define O_TRUNC  0x0010  // Truncate file
 
+// Each thread using the file system has its own session (see session_config in file_operations.c)
 typedef struct
 {
     uint16_t uid; // current user id
     char current_working_dir[MAX_PATH_LENGTH];
     uint16_t current_dir_inode; // inode number of current working directory (0 for root)
+    uint16_t root_inode;        // directory that / resolves to: 0, or a mounted snapshot's copy of the root (see snapshot.c)
+    uint16_t snapshot;          // record of the mounted snapshot, 0 for the live tree
+    bool read_only;             // set while a snapshot is mounted, nothing can be created or written
     bool show_hidden_files;
     bool verbose_mode;
 } SessionConfig;
 
 // HARD DISK
-#define BLOCK_NUM 16384
-#define BLOCK_SIZE_BYTES 2048
+// The geometry (block size, block count, inode count) is chosen when the disk is formatted
+// (format_disk()) and read back from the superblock when an image is mounted; every region below
+// is computed from it (compute_disk_layout() in disk_image.c)
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 32768   // directory record lengths are 16 bits
+#define DEFAULT_BLOCK_SIZE 2048
+#define DEFAULT_BLOCK_NUM 16384 // 32 MiB with the default block size
+#define DEFAULT_INODE_COUNT 16384
+#define MAX_INODE_COUNT 65536   // inode numbers are 16 bits
+#define MAX_FILE_DESCRIPTORS 544 // at least this many open files, the table fills whole blocks
+
+// Format parameters, a field left 0 takes its default
+typedef struct {
+    uint32_t block_size;  // bytes per block, a power of two in [MIN_BLOCK_SIZE, MAX_BLOCK_SIZE]
+    uint32_t block_num;   // blocks on the disk (block numbers are 32 bits)
+    uint32_t inode_count; // rounded up to fill whole inode table and bitmap words
+} DiskGeometry;
+
+// Where each region of the disk starts, in disk order (a region ends where the next one starts)
+typedef struct {
+    uint32_t block_size;
+    uint32_t block_num;
+    uint32_t inode_count;
+    uint32_t inode_bitmap_start;
+    uint32_t data_bitmap_start;
+    uint32_t refcount_start;
+    uint32_t inode_start;
+    uint32_t root_directory;
+    uint32_t kernel_memory_start;
+    uint32_t journal_start;
+    uint32_t name_index_start;
+    uint32_t data_start;
+} DiskLayout;
+extern DiskLayout disk_layout; // layout of the disk in use, defined in disk_image.c
+
+#define BLOCK_NUM (disk_layout.block_num)
+#define BLOCK_SIZE_BYTES (disk_layout.block_size)
 
 // Reserved Block Numbers
 #define SUPERBLOCK 0
-#define FREE_INODE_BITMAP 1
-#define FREE_DATA_BITMAP 2
-#define INODE_START 3 // 512 Inode blocks for each block, each Inode block has 32 Inodes, in total 2^14 inodes, one for each block
-#define INODE_END 514
-#define ROOT_DIRECTORY 515
-#define KERNEL_MEMORY_START 516 //stores FileDescriptors
-#define KERNEL_MEMORY_END 532 //there are at most 4096 FileDescriptors so 12 < 16 bits
-#define DATA_START 533 // start of data
-#define DATA_END 16384 // last block
-
-// 64 bytes
+#define FREE_INODE_BITMAP (disk_layout.inode_bitmap_start) // one bit per inode
+#define FREE_DATA_BITMAP (disk_layout.data_bitmap_start)   // one bit per data block
+#define REFCOUNT_START (disk_layout.refcount_start) // data block share counts, one uint32_t per data bitmap index (see utils.c)
+#define REFCOUNT_END (INODE_START - 1)
+#define INODE_START (disk_layout.inode_start) // inode table, INODES_PER_BLOCK inodes in each block
+#define INODE_END (ROOT_DIRECTORY - 1)
+#define ROOT_DIRECTORY (disk_layout.root_directory)
+#define KERNEL_MEMORY_START (disk_layout.kernel_memory_start) //stores FileDescriptors
+#define KERNEL_MEMORY_END (JOURNAL_START - 1)
+#define JOURNAL_START (disk_layout.journal_start) // write-ahead metadata journal (see journal.c), block 0 of it is the journal header
+#define JOURNAL_END (JOURNAL_START + JOURNAL_BLOCKS - 1)
+#define NAME_INDEX_START (disk_layout.name_index_start) // file name index (see name_index.c): name table, then trigram bitmaps
+#define NAME_INDEX_END (DATA_START - 1)
+#define NAME_INDEX_SLOT_SIZE 32 // name table bytes per inode
+#define NAME_INDEX_BUCKETS 512  // trigram bitmaps, each over all inodes
+#define DATA_START (disk_layout.data_start) // start of data
+#define DATA_END (disk_layout.block_num) // one past the last block
+
+// Superblock identification, stored at the start of block SUPERBLOCK
+#define FS_MAGIC 0x39344353 // "CS49" in little endian byte order
+#define FS_VERSION 8
+#define MAX_SNAPSHOTS 256 // snapshots kept at once
+
+typedef struct
+{ // The Superblock describes the on-disk layout so an image can be validated at mount time
+  // magic, version, block_num and block_size come first: mount reads them before it knows the block size
+
+    uint32_t magic;       // FS_MAGIC
+    uint32_t version;     // FS_VERSION
+    uint32_t block_num;   // total number of blocks in the image
+    uint32_t block_size;  // bytes per block
+    uint32_t inode_start; // first inode table block
+    uint32_t inode_end;   // last inode table block
+    uint32_t data_start;  // first data block
+    uint32_t data_end;    // one past the last data block
+    uint32_t free_inodes;      // number of clear bits in the inode bitmap (inode 0 excluded)
+    uint32_t free_data_blocks; // number of clear bits in the data bitmap
+    uint32_t inode_hint;       // next-fit hint: inode bitmap index where the next search starts
+    uint32_t data_hint;        // next-fit hint: data bitmap index where the next search starts
+    time_t ctime;         // format time
+    time_t mtime;         // last mount time
+    uint32_t journal_start; // first journal block
+    uint32_t journal_end;   // last journal block
+    uint32_t refcount_start; // first block share count table block
+    uint32_t refcount_end;   // last block share count table block
+    uint32_t name_index_start;   // first name index block
+    uint32_t name_index_end;     // last name index block
+    uint32_t name_index_enabled; // 1 once fs_name_index_enable() built the index, which is then kept up to date
+    uint32_t inode_count;        // number of inodes
+    uint32_t inode_bitmap_start; // first inode bitmap block
+    uint32_t data_bitmap_start;  // first data bitmap block
+    uint32_t root_directory;     // first block of the root directory
+    uint32_t kernel_memory_start; // first file descriptor table block
+    uint32_t snapshot_count;      // snapshots in snapshot_records
+    uint16_t snapshot_records[MAX_SNAPSHOTS]; // record inode of each snapshot, oldest first (see snapshot.c)
+
+} Superblock;
+static_assert(sizeof(Superblock) <= MIN_BLOCK_SIZE, "Superblock must fit in the smallest block");
+
+#define DIRECT_BLOCKS 6 // block pointers stored in the inode itself
+#define INLINE_DATA_SIZE 84 // bytes of a small file stored in place of the block map (rest of the inode)
+#define INLINE_DATA_FLAG 32 // Inode.flags bit: a regular file whose data is in inline_data, no blocks
+#define SNAPSHOT_FLAG 64 // Inode.flags bit: part of a snapshot (or the snapshot directory), never changed
+#define SNAPSHOT_RECORD_FLAG 128 // Inode.flags bit: with SNAPSHOT_FLAG, the record of a snapshot in /.snapshots
+
+// 128 bytes
 typedef struct
 { // The Inode stores metadata about a file or directory
 
     uint16_t ownerID;
     uint16_t permissions;           // 0000000rwxrwxrwx, owner, group, other/world
     uint32_t file_size;             // in bytes
-    uint16_t directBlocks[6];       // this can be reduced for more metadata options
-    uint16_t indirect;              // 0 means uninitialized
-    uint16_t second_level_indirect; // 0 means uninitialized
     time_t time;    // last accessed
     time_t ctime;   // creation time
     time_t mtime;   // last modified
     time_t dtime;   // file deletion time
-    uint32_t flags; // 1 regular file, 2 directory, 4 indirect block, 8 second_level_indirect block, etc.
+    uint32_t flags; // 1 regular file, 2 directory, 4 indirect block, 8 second_level_indirect block, 16 hashed directory, 32 inline data, etc.
+    union {
+        struct {
+            uint32_t directBlocks[DIRECT_BLOCKS]; // this can be reduced for more metadata options
+            uint32_t indirect;              // 0 means uninitialized
+            uint32_t second_level_indirect; // 0 means uninitialized
+        };
+        uint8_t inline_data[INLINE_DATA_SIZE]; // with INLINE_DATA_FLAG: the file's bytes, zero past file_size
+    };
 
 } Inode;
-static_assert(sizeof(Inode) == 64, "Inode must be 64 bytes in size");
+static_assert(sizeof(Inode) == 128, "Inode must be 128 bytes in size");
+
+#define INODES_PER_BLOCK (BLOCK_SIZE_BYTES / sizeof(Inode)) // 16 with 2 KiB blocks
+#define MAX_INODES (disk_layout.inode_count)
+#define MAX_DATA_BLOCKS (DATA_END - DATA_START) // DATA_END is one past the last block
+#define SHARES_PER_BLOCK (BLOCK_SIZE_BYTES / sizeof(uint32_t)) // share counts per REFCOUNT block
+
+// Block map: directBlocks, then one indirect block and one second level indirect block
+// of uint32_t block pointers (0 means unallocated, for pointers and data blocks alike)
+#define POINTERS_PER_BLOCK (BLOCK_SIZE_BYTES / sizeof(uint32_t)) // 512 with 2 KiB blocks
+#define MAX_FILE_BLOCKS (DIRECT_BLOCKS + POINTERS_PER_BLOCK + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
+#define TRUNCATE_STEP_POINTER_BLOCKS 8 // second level pointer blocks a long truncate releases per step (see inode_truncate_blocks_stepwise())
 // DirectoryEntry structure - represents a single entry in a directory
 // On disk: directories are just sequences of DirectoryEntry structures
 // In memory: directories are arrays/lists of DirectoryEntry - no Directory wrapper needed
@@ -89,6 +204,72 @@ struct DirectoryEntry {
 };
 typedef struct DirectoryEntry DirectoryEntry;
 
+// Directory listing record filled in by fs_readdir_plus(): an entry with its inode's attributes
+// Records are packed one after the other, each 8 byte aligned
+#define RECORD_TYPE_FILE 1      // same values as the Inode.flags type bits
+#define RECORD_TYPE_DIRECTORY 2
+typedef struct {
+    uint16_t inode_number;
+    uint16_t record_length; // bytes from this record to the next one
+    uint32_t file_size;     // in bytes
+    time_t mtime;           // last modified
+    uint16_t permissions;
+    uint8_t type;           // RECORD_TYPE_FILE or RECORD_TYPE_DIRECTORY
+    uint8_t name_length;    // length of the name (not including null terminator)
+    char name[];            // null-terminated
+} DirectoryRecord;
+
+// Hashed directory index (htree style), used once a directory outgrows its first block
+// Block 0 keeps . and .., the .. record spans the rest of the block and hides the index root
+// Index nodes are blocks starting with one empty entry (inode 0, name_length 0) spanning the block
+// Leaf blocks are ordinary entry blocks holding the names whose hash falls in their range
+// Entries of indexed directory blocks always cover the whole block (the last one absorbs the slack)
+#define DIR_INDEX_FLAG 16       // Inode.flags bit: directory has a hashed index
+#define DIR_INDEX_ROOT_OFFSET 24 // index root header offset in block 0, after . and ..
+#define DIR_INDEX_NODE_OFFSET 8  // index header offset in an index node, after the empty entry
+
+typedef struct {
+    uint16_t count;  // index entries in use
+    uint16_t limit;  // index entries that fit in the block
+    uint8_t levels;  // root only: 0 = entries point at leaves, 1 = entries point at index nodes
+    uint8_t reserved[3];
+} DirIndexHeader; // followed by DirIndexEntry[limit], sorted by hash
+
+typedef struct {
+    uint32_t hash;  // smallest name hash stored below this entry (0 for the first entry)
+    uint32_t block; // logical directory block of the leaf or index node
+} DirIndexEntry;
+
+// Write-ahead journal (journal.c)
+// Journal block 0 is the JournalHeader. Transactions follow it back to back from block 1:
+// one or more descriptor blocks, each followed by copies of the blocks it lists, then a commit block
+// A transaction is replayed at mount only if its commit block is present and its checksum matches
+#define JOURNAL_BLOCKS 1024 // whatever the block size
+#define JOURNAL_MAGIC 0x4C4E524A // "JRNL" in little endian byte order
+#define JOURNAL_HEADER_BLOCK 1
+#define JOURNAL_DESCRIPTOR_BLOCK 2
+#define JOURNAL_COMMIT_BLOCK 3
+
+typedef struct {
+    uint32_t magic;    // JOURNAL_MAGIC
+    uint32_t type;     // JOURNAL_HEADER_BLOCK, JOURNAL_DESCRIPTOR_BLOCK or JOURNAL_COMMIT_BLOCK
+    uint32_t sequence; // header: first transaction to replay; descriptor/commit: their transaction
+    uint32_t count;    // header: journal block where that transaction starts (1 when empty)
+                       // descriptor: blocks listed; commit: blocks in the transaction before it
+} JournalBlockHeader;
+
+#define JOURNAL_TAGS_PER_DESCRIPTOR ((BLOCK_SIZE_BYTES - sizeof(JournalBlockHeader)) / sizeof(uint32_t)) // 508 with 2 KiB blocks
+
+typedef struct {
+    JournalBlockHeader header;
+    uint32_t blocks[]; // JOURNAL_TAGS_PER_DESCRIPTOR home block numbers of the copies that follow
+} JournalDescriptor;
+
+typedef struct {
+    JournalBlockHeader header;
+    uint32_t checksum; // CRC-32 of the transaction's descriptor and copied blocks, in journal order
+} JournalCommit;
+
 // File structure for file metadata in memory
 typedef struct {
     uint16_t inode_number;
@@ -98,11 +279,19 @@ typedef struct {
 
 typedef struct {
     uint16_t inode_number;
-    uint16_t offset; //in bytes for block, max should be 2048
     uint16_t flags; //file operation that will be compared with inode permissions
     uint16_t referenceCount; //number of concurrent references, 128 max can be increased if necessary
-    uint8_t padding[56]; // Padding to make struct 64 bytes total (8 + 56 = 64)
+    uint16_t reserved; // keeps offset 4-byte aligned
+    uint32_t offset; //position in bytes from the start of the file, used by fs_read/fs_write/fs_lseek
+    uint8_t padding[52]; // Padding to make struct 64 bytes total (12 + 52 = 64)
 } FileDescriptor;
 static_assert(sizeof(FileDescriptor) == 64, "FileDescriptor must be 64 bytes in size");
 
+// Read-only span of file data inside a cached block, returned by fs_read_view()
+typedef struct {
+    const uint8_t *data;
+    uint32_t length;
+    uint32_t block; // data block kept pinned until fs_release_view(), 0 for inline data or a hole
+} FileView;
+
 #endif
\ No newline at end of file
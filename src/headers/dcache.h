@@ -0,0 +1,22 @@
+// this is where we declare the dentry cache: (parent inode, name) -> inode lookups
+#ifndef DCACHE_H
+#define DCACHE_H
+#include "common.h"
+
+typedef struct {
+    uint64_t hits;          // lookups answered by the cache (positive and negative)
+    uint64_t negative_hits; // hits on names known not to exist
+    uint64_t misses;        // lookups that had to read the directory
+    uint64_t invalidations; // entries dropped because the directory changed
+} DcacheStats;
+
+// Lookup returns true on a hit and sets *out_inode (0 for a cached "does not exist")
+bool dcache_lookup(uint16_t parent_inode, const char *name, size_t name_len, uint16_t *out_inode);
+void dcache_insert(uint16_t parent_inode, const char *name, size_t name_len, uint16_t inode_number);
+
+// Invalidation (directory entry added, removed or renamed; whole file system replaced)
+void dcache_invalidate(uint16_t parent_inode, const char *name, size_t name_len);
+void dcache_invalidate_all(void);
+
+void dcache_get_stats(DcacheStats *stats);
+#endif
@@ -8,7 +8,17 @@
 // Function declarations
 // Note: create_directory returns uint16_t (inode number) or 0 on error
 uint16_t create_directory(const char *dirname);
+uint16_t create_directory_in(uint16_t parent_inode, const char *name, size_t name_len);
 void create_root_directory(void);
 void init_root_inode(void);
 void init_inode(uint16_t inode_number);
+
+// Removes a name from a directory, leaving the inode it names alone (the caller frees it)
+// Returns SUCCESS, ERROR_FILE_NOT_FOUND if the name is not there, or ERROR_INVALID_INPUT
+int remove_directory_entry_n(uint16_t dir_inode, const char *name, size_t name_len);
+
+// Batch listing: fills buffer with DirectoryRecords for the entries of dir_inode other than
+// . and .., starting at *cookie (0 for the first call), and advances *cookie past them
+// Returns the bytes filled, 0 at the end of the directory, or negative error code
+int fs_readdir_plus(uint16_t dir_inode, uint32_t *cookie, void *buffer, size_t buffer_size);
 #endif
\ No newline at end of file
@@ -0,0 +1,20 @@
+// this is where we declare the backing store behind the block cache (in-memory disk or image file)
+#ifndef DISK_IMAGE_H
+#define DISK_IMAGE_H
+#include "common.h"
+
+// Geometry and superblock
+int compute_disk_layout(const DiskGeometry *geometry, DiskLayout *layout);
+bool parse_disk_geometry(const char *text, DiskGeometry *geometry); // "block_size[,blocks[,inodes]]"
+int set_disk_geometry(const DiskGeometry *geometry); // NULL for the default geometry, loses the contents
+void init_superblock(void);
+bool superblock_is_valid(void);
+
+// Disk image backing store
+int mount_disk_image(const char *image_path);
+int sync_disk_image(void);
+int clear_disk_image(void);
+void unmount_disk_image(void);
+void zero_stale_blocks(uint32_t first, uint32_t count); // before first use after a format or a free
+void mark_stale_blocks(uint32_t first, uint32_t count);
+#endif
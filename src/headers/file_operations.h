@@ -2,9 +2,13 @@
 #define FILE_OPERATIONS_H
 
 #include "common.h"
+#include <sys/uio.h>
 
 // Function declarations
+void init_session(SessionConfig *config, uint16_t uid);
 uint16_t create_file(const char *filename);
+uint16_t create_file_in(uint16_t parent_inode, const char *name, size_t name_len);
+uint16_t clone_file_in(uint16_t parent_inode, const char *name, size_t name_len, uint16_t src_inode_number);
 int search_files_by_name(const char *search_path, const char *pattern, char results[][MAX_PATH_LENGTH], int max_results);
 
 // File system operations
@@ -12,9 +16,21 @@ int fs_open(const char *pathname, uint16_t operation);
 int fs_close(uint16_t file_descriptor);
 int fs_read(uint16_t file_descriptor, void *buffer, size_t count);
 int fs_write(uint16_t file_descriptor, const void *buffer, size_t count);
+int fs_pread(uint16_t file_descriptor, void *buffer, size_t count, uint32_t offset);
+int fs_pwrite(uint16_t file_descriptor, const void *buffer, size_t count, uint32_t offset);
+int fs_readv(uint16_t file_descriptor, const struct iovec *iov, int iovcnt);
+int fs_writev(uint16_t file_descriptor, const struct iovec *iov, int iovcnt);
+int fs_read_view(uint16_t file_descriptor, uint32_t offset, size_t count, FileView **views, int *nviews);
+void fs_release_view(FileView *views, int nviews);
+int fs_copy_range(uint16_t src_fd, uint32_t src_offset, uint16_t dst_fd, uint32_t dst_offset, size_t count);
+int fs_ftruncate(uint16_t file_descriptor, uint32_t size);
+int fs_fallocate(uint16_t file_descriptor, uint32_t offset, uint32_t length);
+int fs_clone(const char *src_path, const char *dst_path);
+int fs_lseek(uint16_t file_descriptor, int32_t offset, int whence);
 
 // File system initialization
 void reset_hard_disk(void);
+int format_disk(const DiskGeometry *geometry); // NULL keeps the current geometry
 void create_root_directory(void);
 
 #endif
\ No newline at end of file
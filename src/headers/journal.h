@@ -0,0 +1,29 @@
+// this is where we declare the write-ahead metadata journal of a mounted disk image
+#ifndef JOURNAL_H
+#define JOURNAL_H
+#include "common.h"
+
+// Operations: every call that changes metadata runs between begin and end (calls may nest)
+// Transactions are only committed between operations, so a commit never holds half an operation
+void journal_begin_operation(void);
+void journal_end_operation(void);
+bool journal_operation_full(void); // a long operation should end here and continue in a new one
+
+// Record changed blocks in the running transaction
+// Metadata blocks (bitmaps, inodes, directory and pointer blocks) are journaled; data blocks are
+// written to their home location before the transaction that references them commits
+void journal_dirty_metadata(uint32_t block);
+void journal_dirty_address(const void *address); // metadata block holding address (see bcache_block_of())
+void journal_dirty_data(uint32_t block);
+
+// Group commit of the running transaction, and writing committed blocks to their home location
+int journal_commit(void);
+int journal_checkpoint(void);
+bool journal_read_copy(uint32_t block, void *buffer); // for block cache misses
+
+// Lifetime, driven by disk_image.c
+int journal_recover(int image_fd);
+int journal_open(int image_fd);
+int journal_format(void);
+int journal_close(void);
+#endif
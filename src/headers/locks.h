@@ -0,0 +1,27 @@
+// this is where we declare the per-inode locks that make the file system core thread safe
+#ifndef LOCKS_H
+#define LOCKS_H
+#include "common.h"
+
+// Per-inode reader/writer locks
+// Readers: lookups, directory iteration, reads. Writers: directory inserts, file writes
+// A thread holds at most one inode write lock at a time; read locks are only nested
+// parent before child (recursive search), and fs_copy_range() takes its two files' locks
+// in inode number order, so lock ordering cannot deadlock
+// The name index lock (name_index.c) is only taken before inode locks, never while one is held
+void inode_read_lock(uint16_t inode_number);
+void inode_write_lock(uint16_t inode_number);
+void inode_unlock(uint16_t inode_number);
+
+// Tree lock, taken before any inode lock or journal operation
+// Shared: operations that change files or directories, and opens and listings that could walk
+// into a snapshot being deleted. Exclusive (freeze): fs_snapshot_create(), which so captures the
+// tree as of one moment, and fs_snapshot_delete() while it unlists one. Both nest in the calling thread
+// Helper threads of a shared holder that wait on it (search workers) borrow its hold instead
+void tree_lock_shared(void);
+void tree_unlock_shared(void);
+void tree_freeze(void);
+void tree_thaw(void);
+void tree_lock_borrow(void);
+void tree_lock_return(void);
+#endif
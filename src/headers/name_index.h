@@ -0,0 +1,20 @@
+// this is where we declare the file name index: the parent and name of every inode, and trigram
+// bitmaps that find the names containing a string without walking the tree
+#ifndef NAME_INDEX_H
+#define NAME_INDEX_H
+#include "common.h"
+#include "search.h"
+
+// Maintenance, called by the operations that add and remove directory entries inside
+// their journal operation; no-ops until the index is enabled
+bool name_index_enabled(void);
+void name_index_add(uint16_t inode_number, uint16_t parent_inode, const char *name, size_t name_len);
+void name_index_remove(uint16_t inode_number, const char *name, size_t name_len);
+
+// fs_search() for SEARCH_SUBSTRING once the index is enabled
+int name_index_search(uint16_t start_inode, const char *start_path, const SearchOptions *options,
+                      SearchCallback callback, void *context);
+
+// Builds the index from the tree and keeps it up to date from then on (for good)
+int fs_name_index_enable(void);
+#endif
@@ -0,0 +1,29 @@
+// this is where we declare the file search engine: parallel recursive name matching
+#ifndef SEARCH_H
+#define SEARCH_H
+#include "common.h"
+
+#define SEARCH_MAX_THREADS 16 // upper bound of SearchOptions.threads
+
+typedef enum {
+    SEARCH_SUBSTRING, // the name contains the pattern
+    SEARCH_GLOB,      // fnmatch() pattern for the whole name, e.g. "*.log"
+    SEARCH_REGEX,     // POSIX extended regular expression, matched anywhere in the name
+} SearchMode;
+
+typedef struct {
+    SearchMode mode;
+    const char *pattern;
+    uint32_t max_results; // stop after this many matches, 0 for no limit
+    int threads;          // worker threads including the caller, 0 for one per online CPU
+} SearchOptions;
+
+// Called once per matching file with its full path; calls are serialized, so the callback need
+// not be thread safe. Returning false stops the search
+typedef bool (*SearchCallback)(const char *path, uint16_t inode_number, void *context);
+
+// Searches the files below directory search_path (names of files only, not of directories)
+// SEARCH_SUBSTRING is answered from the name index when it is enabled (see name_index.h)
+// Returns the number of matches passed to the callback, or negative error code
+int fs_search(const char *search_path, const SearchOptions *options, SearchCallback callback, void *context);
+#endif
@@ -0,0 +1,35 @@
+// this is where we declare file system snapshots: read-only views of the whole tree as it was
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include "common.h"
+
+// Snapshots are named by records in this hidden directory of the root, one per snapshot
+#define SNAPSHOT_DIRECTORY ".snapshots"
+
+// Creation (O(1), the tree is shared copy on write), deletion and mounting (the calling
+// session's / becomes the snapshot, read only, until fs_snapshot_unmount())
+int fs_snapshot_create(const char *name);
+int fs_snapshot_delete(const char *name);
+int fs_snapshot_mount(const char *name);
+void fs_snapshot_unmount(void);
+
+// Returns false if inode_number belongs to a snapshot, whose files and directories cannot be
+// written, truncated or created in from any session (only snapshot code itself may change them)
+bool snapshot_allows_change(uint16_t inode_number);
+
+// Called by every change to an existing inode, with its write lock held inside a journal
+// operation and before anything of it changes: snapshots that still see the inode as it is get
+// a copy of it first. Returns SUCCESS, or ERROR_INVALID_INPUT if no inode or block is left for
+// the copy, in which case the change must not be made
+int snapshot_preserve(uint16_t inode_number);
+
+// Snapshot sessions: the inode holding snapshot's version of inode_number (an entry of one of
+// its directories), copied first if it is still shared with the live tree
+// Returns SUCCESS, ERROR_FILE_NOT_FOUND if the inode is not part of the snapshot (/.snapshots),
+// or ERROR_INVALID_INPUT if no inode or block is left for the copy
+int snapshot_resolve(uint16_t snapshot, uint16_t inode_number, uint16_t *version);
+
+// Same without copying, for a caller holding a lock on inode_number: its copy, or inode_number
+// itself while the live inode is still snapshot's version
+uint16_t snapshot_version(uint16_t snapshot, uint16_t inode_number);
+#endif
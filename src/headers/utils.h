@@ -9,33 +9,70 @@
 #include "common.h"
 
 // Bitmap manipulation functions
-int is_bit_set(uint8_t *bitmap, uint16_t index);
-void set_bit(uint8_t *bitmap, uint16_t index);
-void clear_bit(uint8_t *bitmap, uint16_t index);
+int is_bit_set(uint8_t *bitmap, uint32_t index);
+void set_bit(uint8_t *bitmap, uint32_t index);
+void clear_bit(uint8_t *bitmap, uint32_t index);
 
-// Bitmap access functions (bitmap stored in HARD_DISK[FREE_BITMAP])
-uint8_t* get_inode_bitmap();
-uint8_t* get_data_bitmap();
+// Superblock and bitmap access (bitmap and superblock blocks stay pinned in the block cache)
+Superblock* get_superblock();
+bool is_inode_allocated(uint16_t inode_number);
+bool is_data_block_allocated(uint32_t block_number);
 
 // Allocation functions
 uint16_t find_free_inode();
-uint16_t find_free_data_block();
+uint32_t find_free_data_block();
+uint32_t allocate_extent(uint32_t want, uint32_t *got);
+void recount_free_blocks();
 
 // Deallocation functions
 void free_inode(uint16_t inode_number);
-void free_data_block(uint16_t block_number);
+void free_data_block(uint32_t block_number);
+void free_data_extent(uint32_t first, uint32_t count);
+void free_unused_extent(uint32_t first, uint32_t count);
+
+// Data blocks pinned by fs_read_view(): one freed while viewed is only freed when its last view is released
+bool view_block_hold(uint32_t block_number); // false once FS_VIEW_MAX_PINNED views are held
+void view_block_release(uint32_t block_number);
+
+// Block sharing (copy on write): data and pointer blocks referenced from several places
+uint32_t get_block_shares(uint32_t block_number);
+void share_data_block(uint32_t block_number);
+void release_block(uint32_t block_number, int levels);
+
+// Block map functions (logical file block -> data block through direct/indirect blocks)
+uint32_t inode_bmap(Inode *inode, uint32_t logical_block, bool allocate);
+int inode_bmap_assign(Inode *inode, uint32_t logical_block, uint32_t data_block);
+int inode_bmap_writable(Inode *inode, uint32_t logical_block, uint32_t *data_block);
+int inode_truncate_blocks(Inode *inode, uint32_t first_block);
+int inode_truncate_blocks_stepwise(uint16_t inode_number, Inode *inode, uint32_t first_block, uint32_t end_block);
+void restart_long_operation(uint16_t write_inode, uint16_t read_inode);
 
 // Directory entry helper functions
 int add_directory_entry(uint16_t dir_inode, const char *name, uint16_t target_inode);
+int add_directory_entry_n(uint16_t dir_inode, const char *name, size_t name_len, uint16_t target_inode);
 uint16_t find_directory_entry(uint16_t dir_inode, const char *name);
-DirectoryEntry* get_directory_entry_at_offset(uint8_t *dir_data, uint16_t offset);
-uint16_t get_next_directory_entry_offset(uint8_t *dir_data, uint16_t current_offset, uint16_t dir_size);
+uint16_t find_directory_entry_n(uint16_t dir_inode, const char *name, size_t name_len);
+uint16_t get_parent_directory(uint16_t dir_inode);
+DirectoryEntry* get_directory_entry_at_offset(Inode *dir_inode, uint32_t offset, uint32_t *data_block); // release with bcache_put()
+uint32_t get_next_directory_entry_offset(Inode *dir_inode, uint32_t current_offset);
+uint8_t* copy_directory_entries(uint16_t dir_inode, uint32_t *size); // malloc'd, free() it
+
+// Path traversal helper functions
+// Result of resolve_path(): the directory holding the last component and the component itself
+typedef struct {
+    uint16_t parent_inode; // directory the last component was looked up in
+    uint16_t inode_number; // inode of the whole path (valid only if exists)
+    bool exists;           // false if only the last component is missing
+    const char *name;      // last component, points into the caller's path (not null terminated)
+    size_t name_length;    // 0 if the path ends in /, . or .. (nothing that could be created)
+} ResolvedPath;
 
-// Path traversal helper function
+int resolve_path(const char *pathname, uint16_t start_inode, ResolvedPath *out);
 int traverse_path(const char *pathname, uint16_t *out_inode);
 
 // File descriptor helper functions
 int allocate_file_descriptor(uint16_t inode_number, uint16_t flags);
 FileDescriptor* get_file_descriptor(uint16_t fd);
+bool file_open_among(uint8_t *inodes);
 int check_permissions(uint16_t inode_number, uint16_t operation);
 #endif
\ No newline at end of file
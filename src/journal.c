@@ -0,0 +1,775 @@
+#include "headers/common.h"
+#include "headers/journal.h"
+#include "headers/bcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Write-ahead metadata journal of a mounted disk image
+//
+// Operations record the blocks they change in the running transaction. The block cache holds
+// changed metadata blocks until their transaction committed, so they only reach the image
+// through this module.
+// A commit (group commit: every operation since the last one) first writes the transaction's
+// data blocks to their home location (ordered mode), then appends copies of its metadata blocks
+// plus a checksummed commit block to the journal with one sequential write and one flush.
+// Committed metadata reaches its home location later, at checkpoint time (journal full, unmount),
+// written from the committed copies so a checkpoint never leaks a later, uncommitted change.
+// Until then the cache reads a block it dropped back from its committed copy (journal_read_copy()).
+// A block stays journaled until the next checkpoint, even if it is reused for file data, so
+// replay never writes an old metadata copy over newer data.
+// After a crash, journal_recover() replays every complete transaction, so recovery time is
+// bounded by the journal length instead of a scan of the whole disk.
+// Access time updates are not journaled; they reach the image with the next change of their block
+// (or are lost when the cache drops the block first).
+//
+// A transaction must fit in the journal, so its size is bounded: an operation only starts while
+// the running transaction has JOURNAL_OPERATION_BLOCKS left for it and for every operation in
+// flight (else it commits first), and long operations (big writes, copies, truncates) end and
+// continue in a new operation whenever they used their share (journal_operation_full()).
+// A transaction that still does not fit is not committed at all rather than written non-atomically.
+//
+// Without a mounted image (in-memory disk) every function here returns immediately.
+
+#define JOURNAL_BATCH_BLOCKS 256        // commit once this many metadata blocks are dirty
+#define JOURNAL_BATCH_DATA_BLOCKS 4096  // or this many data blocks (8 MiB of 2 KiB blocks) wait for write back
+#define JOURNAL_COMMIT_INTERVAL 5       // or this many seconds passed since the last commit
+#define JOURNAL_OPERATION_BLOCKS 64     // metadata blocks set aside in the running transaction per operation in flight
+#define JOURNAL_STEP_BLOCKS 32          // most metadata blocks one step of a long operation dirties (see journal_operation_full())
+#define JOURNAL_SPARE_BLOCKS 256        // kept free for operations that dirty more than their share (e.g. long names in the name index)
+
+// Set of block numbers: bitmap over the disk for membership, list for iteration (grown as needed)
+// Both are allocated by journal_open() for the geometry of the image
+typedef struct {
+    uint8_t *map;
+    uint32_t *blocks;
+    uint32_t count;
+    uint32_t capacity;
+} BlockSet;
+
+// Committed copy of a metadata block (data is NULL in a free slot)
+typedef struct {
+    uint32_t block;
+    uint8_t *data;
+} CheckpointCopy;
+
+// The copies live in an open addressing hash table with twice as many slots as the journal has
+// blocks: each copy was written to a journal block since the last checkpoint, so there are never
+// more copies than that, and they are only removed all at once
+#define CHECKPOINT_SLOTS (2 * JOURNAL_BLOCKS)
+
+static bool journal_active;
+static int journal_fd = -1;
+static uint32_t journal_sequence; // sequence number of the next transaction
+static uint32_t journal_head;     // journal block where the next transaction goes
+static time_t last_commit;
+static uint32_t running_transaction = 1; // identifies the running transaction to the block cache
+
+// Running transaction
+static BlockSet running_metadata;
+static BlockSet running_data;
+
+// Latest committed copy of every metadata block not yet written to its home location, and the
+// list of those blocks. Protected by copies_lock, which block cache misses take to read a copy
+static CheckpointCopy checkpoint_copies[CHECKPOINT_SLOTS];
+static uint32_t checkpoint_blocks[JOURNAL_BLOCKS];
+static uint32_t checkpoint_count;
+static pthread_rwlock_t copies_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Operations hold operation_lock shared, a commit takes it exclusively to freeze a transaction
+// commit_lock serializes commits and checkpoints, dirty_lock protects the running sets
+static pthread_rwlock_t operation_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local int operation_depth;
+static _Thread_local uint32_t operation_blocks; // metadata blocks the thread's operation added to the transaction
+static uint32_t operations_in_flight; // protected by dirty_lock
+
+// CRC-32 (IEEE 802.3 polynomial), table built on first use
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_table(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+        crc_table[i] = crc;
+    }
+}
+
+// Continues a CRC-32 over length bytes; start with 0 and use the result as the next crc
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length)
+{
+    pthread_once(&crc_table_once, init_crc_table);
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Allocates the membership bitmap of an empty set for the blocks of the disk
+static int block_set_init(BlockSet *set)
+{
+    set->map = calloc((BLOCK_NUM + 7) / 8, 1);
+    set->blocks = NULL;
+    set->count = 0;
+    set->capacity = 0;
+    return (set->map != NULL) ? SUCCESS : ERROR_IO;
+}
+
+static void block_set_free(BlockSet *set)
+{
+    free(set->map);
+    free(set->blocks);
+    memset(set, 0, sizeof(BlockSet));
+}
+
+static bool block_set_contains(const BlockSet *set, uint32_t block)
+{
+    return (set->map[block / 8] & (1 << (block % 8))) != 0;
+}
+
+static bool block_set_add(BlockSet *set, uint32_t block)
+{
+    if (block_set_contains(set, block)) {
+        return false;
+    }
+    if (set->count == set->capacity) {
+        uint32_t capacity = set->capacity ? set->capacity * 2 : 256;
+        uint32_t *blocks = realloc(set->blocks, capacity * sizeof(uint32_t));
+        if (blocks == NULL) {
+            fprintf(stderr, "journal: cannot track %u changed blocks\n", capacity);
+            abort();
+        }
+        set->blocks = blocks;
+        set->capacity = capacity;
+    }
+    set->map[block / 8] |= (1 << (block % 8));
+    set->blocks[set->count] = block;
+    __atomic_store_n(&set->count, set->count + 1, __ATOMIC_RELAXED); // Read by commit_due() without dirty_lock
+    return true;
+}
+
+static void block_set_clear(BlockSet *set)
+{
+    for (uint32_t i = 0; i < set->count; i++) {
+        set->map[set->blocks[i] / 8] &= ~(1 << (set->blocks[i] % 8));
+    }
+    __atomic_store_n(&set->count, 0, __ATOMIC_RELAXED);
+}
+
+static int compare_blocks(const void *a, const void *b)
+{
+    uint32_t block_a = *(const uint32_t *)a;
+    uint32_t block_b = *(const uint32_t *)b;
+    return (block_a > block_b) - (block_a < block_b);
+}
+
+// Slot of the committed copy of block, or the free slot where it would go
+// Called with copies_lock held
+static CheckpointCopy* find_checkpoint_copy(uint32_t block)
+{
+    uint32_t slot = (block * 2654435761u) % CHECKPOINT_SLOTS;
+    while (checkpoint_copies[slot].data != NULL && checkpoint_copies[slot].block != block) {
+        slot = (slot + 1) % CHECKPOINT_SLOTS;
+    }
+    return &checkpoint_copies[slot];
+}
+
+// Frees every committed copy, called with copies_lock held for writing
+static void drop_checkpoint_copies(void)
+{
+    for (uint32_t i = 0; i < checkpoint_count; i++) {
+        CheckpointCopy *copy = find_checkpoint_copy(checkpoint_blocks[i]);
+        free(copy->data);
+    }
+    memset(checkpoint_copies, 0, sizeof(checkpoint_copies));
+    checkpoint_count = 0;
+}
+
+// pwrite/pread of whole blocks at a block number of the image, retrying short transfers
+static int write_image_blocks(int fd, const void *buffer, uint32_t count, uint32_t block)
+{
+    const uint8_t *p = buffer;
+    size_t left = (size_t)count * BLOCK_SIZE_BYTES;
+    off_t position = (off_t)block * BLOCK_SIZE_BYTES;
+    while (left > 0) {
+        ssize_t written = pwrite(fd, p, left, position);
+        if (written <= 0) {
+            return ERROR_IO;
+        }
+        p += written;
+        left -= written;
+        position += written;
+    }
+    return SUCCESS;
+}
+
+static int read_image_block(int fd, void *buffer, uint32_t block)
+{
+    uint8_t *p = buffer;
+    size_t left = BLOCK_SIZE_BYTES;
+    off_t position = (off_t)block * BLOCK_SIZE_BYTES;
+    while (left > 0) {
+        ssize_t bytes_read = pread(fd, p, left, position);
+        if (bytes_read <= 0) {
+            return ERROR_IO;
+        }
+        p += bytes_read;
+        left -= bytes_read;
+        position += bytes_read;
+    }
+    return SUCCESS;
+}
+
+// Writes the journal header: replay starts at transaction sequence, in journal block 1
+static int write_journal_header(int fd, uint32_t sequence)
+{
+    uint8_t block[MAX_BLOCK_SIZE] = {0};
+    JournalBlockHeader *header = (JournalBlockHeader *)block;
+    header->magic = JOURNAL_MAGIC;
+    header->type = JOURNAL_HEADER_BLOCK;
+    header->sequence = sequence;
+    header->count = 1;
+    if (write_image_blocks(fd, block, 1, JOURNAL_START) != SUCCESS || fdatasync(fd) != 0) {
+        return ERROR_IO;
+    }
+    return SUCCESS;
+}
+
+// Writes the committed copies of metadata blocks to their home locations and empties the journal
+// Called with commit_lock held
+static int checkpoint_locked(void)
+{
+    if (checkpoint_count == 0) {
+        return SUCCESS;
+    }
+    qsort(checkpoint_blocks, checkpoint_count, sizeof(uint32_t), compare_blocks);
+    for (uint32_t i = 0; i < checkpoint_count; i++) {
+        uint32_t block = checkpoint_blocks[i];
+        if (write_image_blocks(journal_fd, find_checkpoint_copy(block)->data, 1, block) != SUCCESS) {
+            return ERROR_IO;
+        }
+    }
+    if (fdatasync(journal_fd) != 0) {
+        return ERROR_IO;
+    }
+    // Home locations are durable, the journal can start over
+    if (write_journal_header(journal_fd, journal_sequence) != SUCCESS) {
+        return ERROR_IO;
+    }
+    pthread_rwlock_wrlock(&copies_lock);
+    drop_checkpoint_copies();
+    pthread_rwlock_unlock(&copies_lock);
+    journal_head = 1;
+    return SUCCESS;
+}
+
+// Puts blocks of a transaction that could not be written back into the running transaction
+// (metadata blocks are still held by the cache, under the old transaction)
+static void requeue_blocks(BlockSet *set, const uint32_t *blocks, uint32_t count, bool metadata)
+{
+    pthread_mutex_lock(&dirty_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        block_set_add(set, blocks[i]);
+        if (metadata) {
+            bcache_hold(blocks[i], running_transaction);
+        }
+    }
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+// Writes the data blocks of a transaction to their home locations and flushes them
+static int write_back_data(uint32_t *blocks, uint32_t count)
+{
+    qsort(blocks, count, sizeof(uint32_t), compare_blocks);
+    if (bcache_write_back(blocks, count) != SUCCESS) {
+        return ERROR_IO;
+    }
+    return (fdatasync(journal_fd) == 0) ? SUCCESS : ERROR_IO;
+}
+
+// Most metadata blocks a transaction can hold: its copies, their descriptors and the commit block
+// fill the journal after its header
+static uint32_t transaction_limit(void)
+{
+    uint32_t room = JOURNAL_BLOCKS - 2;
+    return room - (room + JOURNAL_TAGS_PER_DESCRIPTOR) / (JOURNAL_TAGS_PER_DESCRIPTOR + 1);
+}
+
+// Commits the running transaction, called with commit_lock held
+static int commit_locked(void)
+{
+    // Freeze the transaction: wait for operations in flight and copy the metadata blocks out
+    pthread_rwlock_wrlock(&operation_lock);
+    pthread_mutex_lock(&dirty_lock);
+    uint32_t count = running_metadata.count;
+    uint32_t data_count = running_data.count;
+    uint32_t descriptors = (count + JOURNAL_TAGS_PER_DESCRIPTOR - 1) / JOURNAL_TAGS_PER_DESCRIPTOR;
+    uint32_t total = descriptors + count + 1; // descriptors, copies, commit block
+    uint8_t (*transaction)[BLOCK_SIZE_BYTES] = NULL;
+    uint32_t *metadata_blocks = NULL;
+    uint32_t *data_blocks = NULL;
+    if (count > 0) {
+        transaction = calloc(total, BLOCK_SIZE_BYTES);
+        metadata_blocks = malloc(count * sizeof(uint32_t));
+    }
+    if (data_count > 0) {
+        data_blocks = malloc(data_count * sizeof(uint32_t));
+    }
+    if ((count > 0 && (transaction == NULL || metadata_blocks == NULL)) ||
+        (data_count > 0 && data_blocks == NULL)) {
+        pthread_mutex_unlock(&dirty_lock);
+        pthread_rwlock_unlock(&operation_lock);
+        free(transaction);
+        free(metadata_blocks);
+        free(data_blocks);
+        return ERROR_IO;
+    }
+    // Descriptor d lists copies d * TAGS .. (d + 1) * TAGS - 1, which follow it in the journal
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t block = running_metadata.blocks[i];
+        uint32_t descriptor = i / JOURNAL_TAGS_PER_DESCRIPTOR;
+        JournalDescriptor *d = (JournalDescriptor *)transaction[descriptor * (JOURNAL_TAGS_PER_DESCRIPTOR + 1)];
+        d->blocks[d->header.count++] = block;
+        memcpy(transaction[i + descriptor + 1], bcache_get(block), BLOCK_SIZE_BYTES);
+        bcache_put(block, false);
+        metadata_blocks[i] = block;
+    }
+    if (data_count > 0) {
+        memcpy(data_blocks, running_data.blocks, data_count * sizeof(uint32_t));
+    }
+    block_set_clear(&running_metadata);
+    block_set_clear(&running_data);
+    uint32_t transaction_id = running_transaction++;
+    __atomic_store_n(&last_commit, time(NULL), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&dirty_lock);
+    pthread_rwlock_unlock(&operation_lock);
+
+    // Operations continue while the transaction is written out
+    int result = SUCCESS;
+    if (data_count > 0) {
+        // Ordered mode: data is durable before any metadata that points at it
+        result = write_back_data(data_blocks, data_count);
+    }
+    if (result == SUCCESS && count > 0) {
+        if (journal_head + total > JOURNAL_BLOCKS) {
+            result = checkpoint_locked(); // Not enough room left, empty the journal first
+        }
+        if (result == SUCCESS && count > transaction_limit()) {
+            // Larger than the whole journal, which the operation limits should prevent: writing
+            // the blocks home directly would not be atomic, so the commit fails and the image
+            // keeps its last committed state
+            fprintf(stderr, "journal: transaction of %u blocks does not fit in the journal\n", count);
+            result = ERROR_IO;
+        } else if (result == SUCCESS) {
+            uint32_t crc = 0;
+            for (uint32_t d = 0; d < descriptors; d++) {
+                JournalDescriptor *descriptor = (JournalDescriptor *)transaction[d * (JOURNAL_TAGS_PER_DESCRIPTOR + 1)];
+                descriptor->header.magic = JOURNAL_MAGIC;
+                descriptor->header.type = JOURNAL_DESCRIPTOR_BLOCK;
+                descriptor->header.sequence = journal_sequence;
+            }
+            for (uint32_t i = 0; i + 1 < total; i++) {
+                crc = crc32_update(crc, transaction[i], BLOCK_SIZE_BYTES);
+            }
+            JournalCommit *commit = (JournalCommit *)transaction[total - 1];
+            commit->header.magic = JOURNAL_MAGIC;
+            commit->header.type = JOURNAL_COMMIT_BLOCK;
+            commit->header.sequence = journal_sequence;
+            commit->header.count = total - 1;
+            commit->checksum = crc;
+
+            // One sequential write and one flush for the whole batch; the checksum tells a
+            // torn transaction from a complete one at replay
+            result = write_image_blocks(journal_fd, transaction, total, JOURNAL_START + journal_head);
+            if (result == SUCCESS && fdatasync(journal_fd) != 0) {
+                result = ERROR_IO;
+            }
+            if (result == SUCCESS) {
+                // Keep the committed copies for the checkpoint, then let the cache drop the blocks
+                pthread_rwlock_wrlock(&copies_lock);
+                for (uint32_t i = 0; i < count && result == SUCCESS; i++) {
+                    uint32_t block = metadata_blocks[i];
+                    uint32_t descriptor = i / JOURNAL_TAGS_PER_DESCRIPTOR;
+                    CheckpointCopy *copy = find_checkpoint_copy(block);
+                    if (copy->data == NULL) {
+                        copy->data = malloc(BLOCK_SIZE_BYTES);
+                        if (copy->data == NULL) {
+                            result = ERROR_IO; // The blocks stay held and are committed again
+                            break;
+                        }
+                        copy->block = block;
+                        checkpoint_blocks[checkpoint_count++] = block;
+                    }
+                    memcpy(copy->data, transaction[i + descriptor + 1], BLOCK_SIZE_BYTES);
+                }
+                pthread_rwlock_unlock(&copies_lock);
+                journal_head += total;
+                journal_sequence++;
+                for (uint32_t i = 0; i < count && result == SUCCESS; i++) {
+                    bcache_release(metadata_blocks[i], transaction_id);
+                }
+            }
+        }
+    }
+    if (result != SUCCESS) {
+        // Nothing was lost in memory, try again with the next commit
+        if (count > 0) {
+            requeue_blocks(&running_metadata, metadata_blocks, count, true);
+        }
+        if (data_count > 0) {
+            requeue_blocks(&running_data, data_blocks, data_count, false);
+        }
+    }
+    free(transaction);
+    free(metadata_blocks);
+    free(data_blocks);
+    return result;
+}
+
+// Returns true if the running transaction is big or old enough to be committed
+static bool commit_due(void)
+{
+    return __atomic_load_n(&running_metadata.count, __ATOMIC_RELAXED) >= JOURNAL_BATCH_BLOCKS ||
+           __atomic_load_n(&running_data.count, __ATOMIC_RELAXED) >= JOURNAL_BATCH_DATA_BLOCKS ||
+           time(NULL) - __atomic_load_n(&last_commit, __ATOMIC_RELAXED) >= JOURNAL_COMMIT_INTERVAL;
+}
+
+void journal_begin_operation(void)
+{
+    if (!journal_active) {
+        return;
+    }
+    if (operation_depth == 0) {
+        // Keep transactions bounded when many threads keep operations in flight
+        if (__atomic_load_n(&running_metadata.count, __ATOMIC_RELAXED) >= JOURNAL_BATCH_BLOCKS) {
+            journal_commit();
+        }
+        // Wait for room in the transaction: committing waits for the operations in flight
+        uint32_t limit = transaction_limit() - JOURNAL_SPARE_BLOCKS;
+        for (;;) {
+            pthread_mutex_lock(&dirty_lock);
+            bool room = running_metadata.count + (operations_in_flight + 1) * JOURNAL_OPERATION_BLOCKS <= limit;
+            if (room) {
+                operations_in_flight++;
+            }
+            pthread_mutex_unlock(&dirty_lock);
+            if (room) {
+                break;
+            }
+            if (journal_commit() != SUCCESS) {
+                // The journal is failing already, the commit of this transaction will fail too
+                pthread_mutex_lock(&dirty_lock);
+                operations_in_flight++;
+                pthread_mutex_unlock(&dirty_lock);
+                break;
+            }
+        }
+        operation_blocks = 0;
+        pthread_rwlock_rdlock(&operation_lock);
+    }
+    operation_depth++;
+}
+
+void journal_end_operation(void)
+{
+    if (!journal_active || operation_depth == 0) {
+        return;
+    }
+    if (--operation_depth > 0) {
+        return;
+    }
+    pthread_rwlock_unlock(&operation_lock);
+    pthread_mutex_lock(&dirty_lock);
+    operations_in_flight--;
+    pthread_mutex_unlock(&dirty_lock);
+    if (commit_due()) {
+        journal_commit();
+    }
+}
+
+void journal_dirty_metadata(uint32_t block)
+{
+    if (!journal_active || block >= BLOCK_NUM) {
+        return;
+    }
+    pthread_mutex_lock(&dirty_lock);
+    if (block_set_add(&running_metadata, block)) {
+        operation_blocks++;
+    }
+    bcache_hold(block, running_transaction); // Called while the block is still in use
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+// Returns true when the calling thread's operation used its share of the running transaction and
+// a long operation should end it (at a point where the file system is consistent) and continue
+// in a new one; always false inside a nested operation, which cannot be ended there
+bool journal_operation_full(void)
+{
+    if (!journal_active || operation_depth != 1) {
+        return false;
+    }
+    return operation_blocks + JOURNAL_STEP_BLOCKS > JOURNAL_OPERATION_BLOCKS;
+}
+
+void journal_dirty_address(const void *address)
+{
+    if (!journal_active) {
+        return;
+    }
+    uint32_t block;
+    if (bcache_block_of(address, &block)) { // Not a block of the disk: e.g. an inode copy on the stack
+        journal_dirty_metadata(block);
+    }
+}
+
+void journal_dirty_data(uint32_t block)
+{
+    if (!journal_active || block >= BLOCK_NUM) {
+        return;
+    }
+    // A block with a copy in the journal stays journaled until the checkpoint
+    pthread_rwlock_rdlock(&copies_lock);
+    bool journaled = (find_checkpoint_copy(block)->data != NULL);
+    pthread_rwlock_unlock(&copies_lock);
+    pthread_mutex_lock(&dirty_lock);
+    if (journaled || block_set_contains(&running_metadata, block)) {
+        if (block_set_add(&running_metadata, block)) {
+            operation_blocks++;
+        }
+        bcache_hold(block, running_transaction);
+    } else {
+        block_set_add(&running_data, block);
+    }
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+// Copies the committed, not yet checkpointed copy of a block into buffer
+// Returns false if the journal has none (the home location is up to date)
+bool journal_read_copy(uint32_t block, void *buffer)
+{
+    if (!journal_active || block >= BLOCK_NUM) {
+        return false;
+    }
+    pthread_rwlock_rdlock(&copies_lock);
+    CheckpointCopy *copy = find_checkpoint_copy(block);
+    bool found = (copy->data != NULL);
+    if (found) {
+        memcpy(buffer, copy->data, BLOCK_SIZE_BYTES);
+    }
+    pthread_rwlock_unlock(&copies_lock);
+    return found;
+}
+
+// Commits every operation finished so far; returns SUCCESS once they are durable, or ERROR_IO
+int journal_commit(void)
+{
+    if (!journal_active) {
+        return SUCCESS;
+    }
+    if (operation_depth > 0) {
+        return ERROR_INVALID_INPUT; // Would wait for the caller's own operation
+    }
+    pthread_mutex_lock(&commit_lock);
+    int result = commit_locked();
+    pthread_mutex_unlock(&commit_lock);
+    return result;
+}
+
+// Commits, then writes every committed block to its home location and empties the journal
+int journal_checkpoint(void)
+{
+    if (!journal_active) {
+        return SUCCESS;
+    }
+    if (operation_depth > 0) {
+        return ERROR_INVALID_INPUT;
+    }
+    pthread_mutex_lock(&commit_lock);
+    int result = commit_locked();
+    if (result == SUCCESS) {
+        result = checkpoint_locked();
+    }
+    pthread_mutex_unlock(&commit_lock);
+    return result;
+}
+
+// Replays the complete transactions in the journal of an image file before it is mapped
+// Returns the number of transactions replayed (0 if the image has no journal), or ERROR_IO
+int journal_recover(int image_fd)
+{
+    uint8_t block[MAX_BLOCK_SIZE];
+    if (read_image_block(image_fd, block, JOURNAL_START) != SUCCESS) {
+        return ERROR_IO;
+    }
+    JournalBlockHeader header = *(JournalBlockHeader *)block;
+    if (header.magic != JOURNAL_MAGIC || header.type != JOURNAL_HEADER_BLOCK) {
+        return 0; // No journal (new image)
+    }
+
+    uint8_t (*transaction)[BLOCK_SIZE_BYTES] = malloc((size_t)JOURNAL_BLOCKS * BLOCK_SIZE_BYTES);
+    uint32_t *homes = malloc(JOURNAL_BLOCKS * sizeof(uint32_t));
+    uint32_t *slots = malloc(JOURNAL_BLOCKS * sizeof(uint32_t));
+    if (transaction == NULL || homes == NULL || slots == NULL) {
+        free(transaction);
+        free(homes);
+        free(slots);
+        return ERROR_IO;
+    }
+
+    uint32_t sequence = header.sequence;
+    uint32_t position = (header.count >= 1) ? header.count : 1;
+    int replayed = 0;
+    int result = SUCCESS;
+    while (position < JOURNAL_BLOCKS && result == SUCCESS) {
+        // Read one transaction: descriptors and their copies up to a matching commit block
+        uint32_t start = position;
+        uint32_t tags = 0;
+        uint32_t crc = 0;
+        bool complete = false;
+        while (position < JOURNAL_BLOCKS) {
+            uint8_t *current = transaction[position - start];
+            if (read_image_block(image_fd, current, JOURNAL_START + position) != SUCCESS) {
+                result = ERROR_IO;
+                break;
+            }
+            JournalBlockHeader *h = (JournalBlockHeader *)current;
+            if (h->magic != JOURNAL_MAGIC || h->sequence != sequence) {
+                break; // End of the journal, or a stale transaction from before a checkpoint
+            }
+            if (h->type == JOURNAL_COMMIT_BLOCK) {
+                JournalCommit *commit = (JournalCommit *)current;
+                complete = (tags > 0 && commit->header.count == position - start && commit->checksum == crc);
+                position++;
+                break;
+            }
+            if (h->type != JOURNAL_DESCRIPTOR_BLOCK || h->count > JOURNAL_TAGS_PER_DESCRIPTOR ||
+                position + h->count >= JOURNAL_BLOCKS) {
+                break;
+            }
+            JournalDescriptor *descriptor = (JournalDescriptor *)current;
+            uint32_t listed = h->count;
+            crc = crc32_update(crc, current, BLOCK_SIZE_BYTES);
+            position++;
+            for (uint32_t i = 0; i < listed; i++, position++) {
+                uint8_t *copy = transaction[position - start];
+                if (read_image_block(image_fd, copy, JOURNAL_START + position) != SUCCESS) {
+                    result = ERROR_IO;
+                    break;
+                }
+                crc = crc32_update(crc, copy, BLOCK_SIZE_BYTES);
+                homes[tags] = descriptor->blocks[i];
+                slots[tags] = position - start;
+                tags++;
+            }
+            if (result != SUCCESS) {
+                break;
+            }
+        }
+        if (!complete || result != SUCCESS) {
+            break; // Torn or missing transaction: it never committed
+        }
+
+        // Write the copies to their home locations, later transactions overwrite earlier ones
+        for (uint32_t i = 0; i < tags && result == SUCCESS; i++) {
+            if (homes[i] >= BLOCK_NUM || (homes[i] >= JOURNAL_START && homes[i] <= JOURNAL_END)) {
+                continue; // Never a metadata block, ignore
+            }
+            result = write_image_blocks(image_fd, transaction[slots[i]], 1, homes[i]);
+        }
+        replayed++;
+        sequence++;
+    }
+    free(transaction);
+    free(homes);
+    free(slots);
+    if (result != SUCCESS || (replayed > 0 && fdatasync(image_fd) != 0)) {
+        return ERROR_IO;
+    }
+
+    // Replayed blocks are home, start the journal over after them
+    if (write_journal_header(image_fd, sequence) != SUCCESS) {
+        return ERROR_IO;
+    }
+    return replayed;
+}
+
+// Starts journaling changes to the image behind image_fd (after journal_recover())
+int journal_open(int image_fd)
+{
+    uint8_t block[MAX_BLOCK_SIZE];
+    if (read_image_block(image_fd, block, JOURNAL_START) != SUCCESS) {
+        return ERROR_IO;
+    }
+    JournalBlockHeader *header = (JournalBlockHeader *)block;
+    if (block_set_init(&running_metadata) != SUCCESS || block_set_init(&running_data) != SUCCESS) {
+        block_set_free(&running_metadata);
+        block_set_free(&running_data);
+        return ERROR_IO;
+    }
+    journal_fd = image_fd;
+    journal_head = 1;
+    if (header->magic == JOURNAL_MAGIC && header->type == JOURNAL_HEADER_BLOCK) {
+        journal_sequence = header->sequence;
+    } else {
+        // New image: write an empty journal
+        journal_sequence = 1;
+        if (write_journal_header(image_fd, journal_sequence) != SUCCESS) {
+            block_set_free(&running_metadata);
+            block_set_free(&running_data);
+            journal_fd = -1;
+            return ERROR_IO;
+        }
+    }
+    __atomic_store_n(&last_commit, time(NULL), __ATOMIC_RELAXED);
+    journal_active = true;
+    return SUCCESS;
+}
+
+// Empties the journal without writing anything back, for an image that is being reformatted
+int journal_format(void)
+{
+    if (!journal_active) {
+        return SUCCESS;
+    }
+    pthread_mutex_lock(&commit_lock);
+    pthread_mutex_lock(&dirty_lock);
+    block_set_clear(&running_metadata);
+    block_set_clear(&running_data);
+    pthread_mutex_unlock(&dirty_lock);
+    pthread_rwlock_wrlock(&copies_lock);
+    drop_checkpoint_copies();
+    pthread_rwlock_unlock(&copies_lock);
+    journal_head = 1;
+    journal_sequence++; // Stays above every sequence number already in the journal
+    int result = write_journal_header(journal_fd, journal_sequence);
+    pthread_mutex_unlock(&commit_lock);
+    return result;
+}
+
+// Commits and checkpoints everything, then stops journaling (before the image is unmapped)
+int journal_close(void)
+{
+    if (!journal_active) {
+        return SUCCESS;
+    }
+    int result = journal_checkpoint();
+    journal_active = false;
+    journal_fd = -1;
+    pthread_rwlock_wrlock(&copies_lock);
+    drop_checkpoint_copies(); // Left over only if the checkpoint failed
+    pthread_rwlock_unlock(&copies_lock);
+    block_set_free(&running_metadata);
+    block_set_free(&running_data);
+    return result;
+}
@@ -0,0 +1,99 @@
+#include "headers/common.h"
+#include "headers/locks.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// One reader/writer lock per possible inode number (the inode count is only known per format),
+// created on first use
+static pthread_rwlock_t *inode_locks;
+static pthread_once_t inode_locks_once = PTHREAD_ONCE_INIT;
+
+static void init_inode_locks()
+{
+    inode_locks = malloc(MAX_INODE_COUNT * sizeof(pthread_rwlock_t));
+    if (inode_locks == NULL) {
+        fprintf(stderr, "Cannot allocate inode locks\n");
+        abort();
+    }
+    for (uint32_t i = 0; i < MAX_INODE_COUNT; i++) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+}
+
+static pthread_rwlock_t* get_inode_lock(uint16_t inode_number)
+{
+    pthread_once(&inode_locks_once, init_inode_locks);
+    return &inode_locks[inode_number];
+}
+
+void inode_read_lock(uint16_t inode_number)
+{
+    pthread_rwlock_rdlock(get_inode_lock(inode_number));
+}
+
+void inode_write_lock(uint16_t inode_number)
+{
+    pthread_rwlock_wrlock(get_inode_lock(inode_number));
+}
+
+void inode_unlock(uint16_t inode_number)
+{
+    pthread_rwlock_unlock(get_inode_lock(inode_number));
+}
+
+// Tree lock: held shared by operations that change the tree or walk into it, exclusively by
+// snapshot creation and deletion. tree_depth counts the calling thread's holds (a frozen thread
+// counts as one), so nested operations do not lock again. A pending freeze closes freeze_gate,
+// which new holders pass through first: a steady stream of operations cannot starve it
+static pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t freeze_gate = PTHREAD_MUTEX_INITIALIZER;
+static bool freeze_pending;
+static _Thread_local int tree_depth;
+
+void tree_lock_shared(void)
+{
+    if (tree_depth++ > 0) {
+        return;
+    }
+    if (__atomic_load_n(&freeze_pending, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&freeze_gate); // Wait for the freeze to end
+        pthread_mutex_unlock(&freeze_gate);
+    }
+    pthread_rwlock_rdlock(&tree_lock);
+}
+
+void tree_unlock_shared(void)
+{
+    if (--tree_depth == 0) {
+        pthread_rwlock_unlock(&tree_lock);
+    }
+}
+
+void tree_freeze(void)
+{
+    pthread_mutex_lock(&freeze_gate);
+    __atomic_store_n(&freeze_pending, true, __ATOMIC_RELEASE);
+    pthread_rwlock_wrlock(&tree_lock);
+    tree_depth++;
+}
+
+void tree_thaw(void)
+{
+    tree_depth--;
+    pthread_rwlock_unlock(&tree_lock);
+    __atomic_store_n(&freeze_pending, false, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&freeze_gate);
+}
+
+void tree_lock_borrow(void)
+{
+    tree_depth++;
+}
+
+void tree_lock_return(void)
+{
+    tree_depth--;
+}
@@ -2,68 +2,55 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include "headers/common.h"
 #include "headers/file_operations.h"
 #include "headers/directory_operations.h"
 #include "headers/utils.h"
+#include "headers/disk_image.h"
+#include "headers/dcache.h"
+#include "headers/locks.h"
+#include "headers/bcache.h"
+#include "headers/snapshot.h"
+#include "headers/search.h"
+#include "headers/name_index.h"
 
 // External references to globals defined in file_operations.c
-extern SessionConfig *session_config;
-extern uint8_t HARD_DISK[BLOCK_NUM][BLOCK_SIZE_BYTES];
+extern _Thread_local SessionConfig *session_config;
+
+// Prints a search match as it is found; context counts the matches
+static bool print_search_result(const char *path, uint16_t inode_number, void *context)
+{
+    (void)inode_number;
+    int *count = context;
+    printf("  %d. %s\n", ++*count, path);
+    return true;
+}
 
 // Helper function: List directory contents
 void list_directory(uint16_t dir_inode)
 {
-    // Get the directory's inode
-    uint16_t inode_block = INODE_START + (dir_inode / 32);
-    uint16_t inode_offset = (dir_inode % 32) * sizeof(Inode);
-    Inode *dir_inode_ptr = (Inode *)(HARD_DISK[inode_block] + inode_offset);
-    
-    // Check if it's actually a directory
-    if ((dir_inode_ptr->flags & 2) == 0) {
-        printf("Error: Not a directory\n");
-        return;
-    }
-    
-    // Get the directory's first data block
-    uint16_t dir_data_block = dir_inode_ptr->directBlocks[0];
-    if (dir_data_block == 0) {
-        printf("(empty directory)\n");
-        return;
-    }
-    
-    uint8_t *dir_data = HARD_DISK[dir_data_block];
-    uint16_t dir_size = dir_inode_ptr->file_size;
-    uint16_t offset = 0;
+    _Alignas(DirectoryRecord) uint8_t records[BUFFER_SIZE];
+    uint32_t cookie = 0;
     int count = 0;
+    int filled;
     
-    // Iterate through directory entries
-    while (offset < dir_size) {
-        DirectoryEntry *entry = get_directory_entry_at_offset(dir_data, offset);
-        
-        // Skip . and .. entries
-        if (entry->name_length > 0 && 
-            !(entry->name_length == 1 && entry->name[0] == '.') &&
-            !(entry->name_length == 2 && entry->name[0] == '.' && entry->name[1] == '.')) {
-            
-            // Get entry's inode to check type
-            uint16_t entry_inode = entry->inode_number;
-            uint16_t entry_inode_block = INODE_START + (entry_inode / 32);
-            uint16_t entry_inode_offset = (entry_inode % 32) * sizeof(Inode);
-            Inode *entry_inode_ptr = (Inode *)(HARD_DISK[entry_inode_block] + entry_inode_offset);
-            
-            // Print entry info
-            if ((entry_inode_ptr->flags & 2) != 0) {
-                printf("  [DIR]  %.*s (inode: %d)\n", entry->name_length, entry->name, entry_inode);
+    // A few entries per call, each with the type and size of its inode
+    while ((filled = fs_readdir_plus(dir_inode, &cookie, records, sizeof(records))) > 0) {
+        for (int offset = 0; offset < filled; offset += ((DirectoryRecord *)(records + offset))->record_length) {
+            DirectoryRecord *record = (DirectoryRecord *)(records + offset);
+            if (record->type == RECORD_TYPE_DIRECTORY) {
+                printf("  [DIR]  %s (inode: %d)\n", record->name, record->inode_number);
             } else {
-                printf("  [FILE] %.*s (inode: %d, size: %u bytes)\n", 
-                       entry->name_length, entry->name, entry_inode, entry_inode_ptr->file_size);
+                printf("  [FILE] %s (inode: %d, size: %u bytes)\n",
+                       record->name, record->inode_number, record->file_size);
             }
             count++;
         }
-        
-        // Move to next entry
-        offset = get_next_directory_entry_offset(dir_data, offset, dir_size);
+    }
+    if (filled < 0) {
+        printf("Error: Not a directory\n");
+        return;
     }
     
     if (count == 0) {
@@ -120,8 +107,22 @@ int interactive_shell()
             printf("  close <fd>            - Close a file descriptor\n");
             printf("  read <fd> [bytes]      - Read from file (default: 1024 bytes)\n");
             printf("  write <fd> <text>      - Write text to file\n");
-            printf("  search <pattern> [dir] - Search for files by name pattern\n");
+            printf("  seek <fd> <off> [from] - Move file offset (from: set, cur, end; default: set)\n");
+            printf("  truncate <fd> <size>   - Set the file size, releasing the blocks past the end\n");
+            printf("  fallocate <fd> <off> <len> - Reserve contiguous blocks for a range of the file\n");
+            printf("  cp <src> <dst>         - Copy a file inside the file system\n");
+            printf("  clone <src> <dst>      - Clone a file, sharing its blocks until either copy changes\n");
+            printf("  search <pattern> [dir] - Search for files by name (glob if it has * ? or [, else substring)\n");
+            printf("  rsearch <regex> [dir]  - Search for files whose name matches an extended regex\n");
+            printf("  index [on]             - Show or turn on the name index used by substring searches\n");
             printf("  stat <file>            - Show file information\n");
+            printf("  snapshot <name>        - Take a snapshot of the whole tree (kept in /.snapshots)\n");
+            printf("  rmsnapshot <name>      - Delete a snapshot that is not mounted or open\n");
+            printf("  mount <name>           - Browse a snapshot, read only, as /\n");
+            printf("  umount                 - Return from a snapshot to the live tree\n");
+            printf("  sync                   - Flush the disk image to its file\n");
+            printf("  dcache                 - Show dentry cache statistics\n");
+            printf("  bcache                 - Show block cache statistics (image files only)\n");
             printf("  help                   - Show this help message\n");
             printf("  exit/quit              - Exit the shell\n\n");
             
@@ -182,11 +183,13 @@ int interactive_shell()
             result = traverse_path(arg1, &target_inode);
             if (result == SUCCESS) {
                 // Check if it's a directory
-                uint16_t inode_block = INODE_START + (target_inode / 32);
-                uint16_t inode_offset = (target_inode % 32) * sizeof(Inode);
-                Inode *inode = (Inode *)(HARD_DISK[inode_block] + inode_offset);
+                uint32_t inode_block = INODE_START + (target_inode / INODES_PER_BLOCK);
+                uint16_t inode_offset = (target_inode % INODES_PER_BLOCK) * sizeof(Inode);
+                Inode *inode = (Inode *)(bcache_get(inode_block) + inode_offset);
+                bool is_directory = (inode->flags & 2) != 0;
+                bcache_put(inode_block, false);
                 
-                if ((inode->flags & 2) != 0) {
+                if (is_directory) {
                     session_config->current_dir_inode = target_inode;
                     // Update current working directory path
                     if (arg1[0] == '/') {
@@ -302,23 +305,129 @@ int interactive_shell()
                 printf("Failed to write to fd %d (error: %d)\n", fd, result);
             }
             
-        } else if (strcmp(command, "search") == 0) {
+        } else if (strcmp(command, "cp") == 0) {
+            if (parsed < 3) {
+                printf("Usage: cp <source_file> <destination_file>\n");
+                continue;
+            }
+            int src_fd = fs_open(arg1, O_RDONLY);
+            if (src_fd < 0) {
+                printf("Failed to open '%s' (error: %d)\n", arg1, src_fd);
+                continue;
+            }
+            int dst_fd = fs_open(arg2, O_WRONLY | O_CREAT | O_TRUNC);
+            if (dst_fd < 0) {
+                printf("Failed to open '%s' (error: %d)\n", arg2, dst_fd);
+                fs_close(src_fd);
+                continue;
+            }
+            // Block to block inside the file system, no buffer needed here
+            uint32_t copied = 0;
+            do {
+                result = fs_copy_range(src_fd, copied, dst_fd, copied, INT32_MAX);
+                if (result > 0) {
+                    copied += result;
+                }
+            } while (result > 0);
+            if (result == 0) {
+                printf("Copied %u bytes from '%s' to '%s'\n", copied, arg1, arg2);
+            } else {
+                printf("Copy failed after %u bytes (error: %d)\n", copied, result);
+            }
+            fs_close(dst_fd);
+            fs_close(src_fd);
+            
+        } else if (strcmp(command, "clone") == 0) {
+            if (parsed < 3) {
+                printf("Usage: clone <source_file> <destination_file>\n");
+                continue;
+            }
+            result = fs_clone(arg1, arg2);
+            if (result == SUCCESS) {
+                printf("Cloned '%s' to '%s'\n", arg1, arg2);
+            } else {
+                printf("Failed to clone '%s' (error: %d)\n", arg1, result);
+            }
+            
+        } else if (strcmp(command, "seek") == 0) {
+            char whence_arg[16] = "set";
+            int seek_offset = 0;
+            if (sscanf(input, "%*s %d %d %15s", &fd, &seek_offset, whence_arg) < 2) {
+                printf("Usage: seek <file_descriptor> <offset> [set|cur|end]\n");
+                continue;
+            }
+            int whence = SEEK_SET;
+            if (strcmp(whence_arg, "cur") == 0) {
+                whence = SEEK_CUR;
+            } else if (strcmp(whence_arg, "end") == 0) {
+                whence = SEEK_END;
+            }
+            result = fs_lseek(fd, seek_offset, whence);
+            if (result >= 0) {
+                printf("fd %d offset is now %d\n", fd, result);
+            } else {
+                printf("Failed to seek fd %d (error: %d)\n", fd, result);
+            }
+            
+        } else if (strcmp(command, "truncate") == 0) {
+            unsigned int size;
+            if (sscanf(input, "%*s %d %u", &fd, &size) < 2) {
+                printf("Usage: truncate <file_descriptor> <size>\n");
+                continue;
+            }
+            result = fs_ftruncate(fd, size);
+            if (result == SUCCESS) {
+                printf("fd %d size is now %u\n", fd, size);
+            } else {
+                printf("Failed to truncate fd %d (error: %d)\n", fd, result);
+            }
+            
+        } else if (strcmp(command, "fallocate") == 0) {
+            unsigned int alloc_offset, alloc_length;
+            if (sscanf(input, "%*s %d %u %u", &fd, &alloc_offset, &alloc_length) < 3) {
+                printf("Usage: fallocate <file_descriptor> <offset> <length>\n");
+                continue;
+            }
+            result = fs_fallocate(fd, alloc_offset, alloc_length);
+            if (result == SUCCESS) {
+                printf("Reserved blocks for %u bytes at %u of fd %d\n", alloc_length, alloc_offset, fd);
+            } else {
+                printf("Failed to reserve blocks for fd %d (error: %d)\n", fd, result);
+            }
+            
+        } else if (strcmp(command, "search") == 0 || strcmp(command, "rsearch") == 0) {
             if (parsed < 2) {
-                printf("Usage: search <pattern> [directory]\n");
+                printf("Usage: %s <pattern> [directory]\n", command);
                 continue;
             }
             const char *search_dir = (parsed >= 3) ? arg2 : session_config->current_working_dir;
-            char results[100][MAX_PATH_LENGTH];
-            int num_results = search_files_by_name(search_dir, arg1, results, 100);
+            SearchOptions options = { .mode = SEARCH_SUBSTRING, .pattern = arg1, .max_results = 0, .threads = 0 };
+            if (strcmp(command, "rsearch") == 0) {
+                options.mode = SEARCH_REGEX;
+            } else if (strpbrk(arg1, "*?[") != NULL) {
+                options.mode = SEARCH_GLOB;
+            }
+            int count = 0;
+            int num_results = fs_search(search_dir, &options, print_search_result, &count);
             if (num_results >= 0) {
-                printf("Found %d file(s) matching '%s' in '%s':\n", num_results, arg1, search_dir);
-                for (int i = 0; i < num_results; i++) {
-                    printf("  %d. %s\n", i + 1, results[i]);
-                }
+                printf("Found %d file(s) matching '%s' in '%s'\n", num_results, arg1, search_dir);
             } else {
                 printf("Search failed (error: %d)\n", num_results);
             }
             
+        } else if (strcmp(command, "index") == 0) {
+            if (parsed >= 2 && strcmp(arg1, "on") == 0) {
+                result = fs_name_index_enable();
+                if (result != SUCCESS) {
+                    printf("Failed to enable the name index (error: %d)\n", result);
+                    continue;
+                }
+            } else if (parsed >= 2) {
+                printf("Usage: index [on]\n");
+                continue;
+            }
+            printf("Name index: %s\n", name_index_enabled() ? "on" : "off");
+            
         } else if (strcmp(command, "stat") == 0) {
             if (parsed < 2) {
                 printf("Usage: stat <file>\n");
@@ -327,9 +436,12 @@ int interactive_shell()
             uint16_t target_inode;
             result = traverse_path(arg1, &target_inode);
             if (result == SUCCESS) {
-                uint16_t inode_block = INODE_START + (target_inode / 32);
-                uint16_t inode_offset = (target_inode % 32) * sizeof(Inode);
-                Inode *inode = (Inode *)(HARD_DISK[inode_block] + inode_offset);
+                uint32_t inode_block = INODE_START + (target_inode / INODES_PER_BLOCK);
+                uint16_t inode_offset = (target_inode % INODES_PER_BLOCK) * sizeof(Inode);
+                Inode inode_copy;
+                memcpy(&inode_copy, bcache_get(inode_block) + inode_offset, sizeof(Inode));
+                bcache_put(inode_block, false);
+                Inode *inode = &inode_copy;
                 
                 printf("File: %s\n", arg1);
                 printf("  Inode: %d\n", target_inode);
@@ -344,6 +456,68 @@ int interactive_shell()
                 printf("Error: Cannot stat '%s' (error: %d)\n", arg1, result);
             }
             
+        } else if (strcmp(command, "dcache") == 0) {
+            DcacheStats stats;
+            dcache_get_stats(&stats);
+            printf("Dentry cache: %llu hits (%llu negative), %llu misses, %llu invalidations\n",
+                   (unsigned long long)stats.hits, (unsigned long long)stats.negative_hits,
+                   (unsigned long long)stats.misses, (unsigned long long)stats.invalidations);
+            
+        } else if (strcmp(command, "bcache") == 0) {
+            BlockCacheStats stats;
+            bcache_get_stats(&stats);
+            printf("Block cache: %u blocks, %llu hits, %llu misses, %llu evictions, %llu blocks written\n",
+                   stats.capacity, (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                   (unsigned long long)stats.evictions, (unsigned long long)stats.writes);
+            
+        } else if (strcmp(command, "snapshot") == 0) {
+            if (parsed < 2) {
+                printf("Usage: snapshot <name>\n");
+                continue;
+            }
+            result = fs_snapshot_create(arg1);
+            if (result == SUCCESS) {
+                printf("Created snapshot '%s'\n", arg1);
+            } else {
+                printf("Failed to create snapshot '%s' (error: %d)\n", arg1, result);
+            }
+            
+        } else if (strcmp(command, "rmsnapshot") == 0) {
+            if (parsed < 2) {
+                printf("Usage: rmsnapshot <name>\n");
+                continue;
+            }
+            result = fs_snapshot_delete(arg1);
+            if (result == SUCCESS) {
+                printf("Deleted snapshot '%s'\n", arg1);
+            } else {
+                printf("Failed to delete snapshot '%s' (error: %d)\n", arg1, result);
+            }
+            
+        } else if (strcmp(command, "mount") == 0) {
+            if (parsed < 2) {
+                printf("Usage: mount <snapshot_name>\n");
+                continue;
+            }
+            result = fs_snapshot_mount(arg1);
+            if (result == SUCCESS) {
+                printf("Mounted snapshot '%s' read only, 'umount' returns to the live tree\n", arg1);
+            } else {
+                printf("Failed to mount snapshot '%s' (error: %d)\n", arg1, result);
+            }
+            
+        } else if (strcmp(command, "umount") == 0) {
+            fs_snapshot_unmount();
+            printf("Back in the live tree\n");
+            
+        } else if (strcmp(command, "sync") == 0) {
+            result = sync_disk_image();
+            if (result == SUCCESS) {
+                printf("Disk image synced\n");
+            } else {
+                printf("Sync failed (error: %d)\n", result);
+            }
+            
         } else {
             printf("Unknown command: %s\n", command);
             printf("Type 'help' for available commands\n");
@@ -353,33 +527,72 @@ int interactive_shell()
     return 0;
 }
 
-int main()
+// Usage: ./filesystem [-g block_size[,blocks[,inodes]]] [image_file]
+// With an image file the disk persists between runs; its blocks are read and written through the block cache
+// -g sets the geometry of a new file system; an existing image keeps the one it was formatted with
+int main(int argc, char *argv[])
 {
+    DiskGeometry geometry = {0};
+    bool has_geometry = false;
+    int option;
+    while ((option = getopt(argc, argv, "g:")) != -1) {
+        if (option == 'g' && parse_disk_geometry(optarg, &geometry)) {
+            has_geometry = true;
+        } else {
+            fprintf(stderr, "Usage: %s [-g block_size[,blocks[,inodes]]] [image_file]\n", argv[0]);
+            return 1;
+        }
+    }
+    const char *image_path = (optind < argc) ? argv[optind] : NULL;
+
     printf("========================================\n");
     printf("  File System Demo\n");
     printf("========================================\n\n");
     
     // Initialize session
-    session_config = (SessionConfig *)malloc(sizeof(SessionConfig));
-    session_config->uid = 0;
-    strcpy(session_config->current_working_dir, "/");
-    session_config->current_dir_inode = 0;
-    session_config->show_hidden_files = false;
-    session_config->verbose_mode = true;
+    init_session((SessionConfig *)malloc(sizeof(SessionConfig)), 0);
 
-    printf("File System Configuration:\n");
-    printf("  Blocks: %d\n", BLOCK_NUM);
-    printf("  Block Size: %d bytes\n", BLOCK_SIZE_BYTES);
-    printf("  Inode Size: %ld bytes\n", sizeof(Inode));
-    printf("  Total Inodes: %ld\n", (INODE_END - INODE_START + 1) * (BLOCK_SIZE_BYTES / sizeof(Inode)));
-    printf("  Data Blocks: %d\n", DATA_END - DATA_START + 1);
+    // Initialize file system
+    int result;
+    if (image_path != NULL) {
+        result = mount_disk_image(image_path);
+        if (result == SUCCESS) {
+            printf("✓ Mounted disk image '%s'\n", image_path);
+            if (has_geometry) {
+                printf("  (-g ignored: the image keeps the geometry it was formatted with)\n");
+            }
+        } else if (result == ERROR_NO_FILESYSTEM) {
+            // New image file, sized for the current geometry
+            result = format_disk(has_geometry ? &geometry : NULL);
+            if (result == SUCCESS) {
+                printf("✓ Formatted disk image '%s'\n", image_path);
+                printf("✓ Root directory created\n");
+            }
+        }
+        if (result != SUCCESS) {
+            printf("Error: Cannot mount disk image '%s' (error: %d)\n", image_path, result);
+            return 1;
+        }
+    } else {
+        result = format_disk(has_geometry ? &geometry : NULL);
+        if (result != SUCCESS) {
+            printf("Error: Invalid geometry (error: %d)\n", result);
+            return 1;
+        }
+        printf("✓ Root directory created\n");
+    }
     printf("\n");
 
-    // Initialize file system
-    reset_hard_disk();
-    create_root_directory();
-    printf("✓ Root directory created\n\n");
+    printf("File System Configuration:\n");
+    printf("  Blocks: %u\n", BLOCK_NUM);
+    printf("  Block Size: %u bytes\n", BLOCK_SIZE_BYTES);
+    printf("  Inode Size: %zu bytes\n", sizeof(Inode));
+    printf("  Total Inodes: %u\n", MAX_INODES);
+    printf("  Data Blocks: %u\n", DATA_END - DATA_START);
+    printf("\n");
     
     // Start interactive shell
-    return interactive_shell();
+    int status = interactive_shell();
+    unmount_disk_image();
+    return status;
 }
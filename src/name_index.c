@@ -0,0 +1,361 @@
+#include "headers/common.h"
+#include "headers/utils.h"
+#include "headers/name_index.h"
+#include "headers/snapshot.h"
+#include "headers/journal.h"
+#include "headers/bcache.h"
+#include "headers/locks.h"
+#include "headers/disk_image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+
+// File name index: answers substring searches from a table of names instead of the tree
+//
+// The NAME_INDEX blocks hold
+// - the name table: one NameIndexSlot per inode with its parent directory and its name (the
+//   first NAME_SLOT_CHARS bytes; longer names are read from the parent directory when needed)
+// - TRIGRAM_BUCKETS bitmaps over all inodes, BUCKET_BLOCKS blocks each: bit i of bucket b is set
+//   if the name of inode i has a trigram (3 consecutive bytes) hashing to b
+// A query ANDs the buckets of the pattern's trigrams, which leaves the inodes whose names may
+// contain it; each is checked against its name and its path is built from the parent chain, so
+// the cost follows the number of candidates instead of the size of the tree. Patterns shorter
+// than a trigram check every slot of the name table instead
+//
+// The index is off on a new file system: fs_name_index_enable() turns it on and indexes the
+// existing names. From then on every new name is indexed in the journal operation that adds
+// its directory entry, so the index stays consistent with the tree across crashes
+//
+// name_index_lock is taken before inode locks (long names are read from their directory under
+// it) and never while one is held
+
+#define NAME_SLOT_CHARS 29
+#define TRIGRAM_BUCKETS NAME_INDEX_BUCKETS
+
+typedef struct {
+    uint16_t parent_inode;
+    uint8_t name_length;        // length of the whole name, 0 for an unused slot
+    char name[NAME_SLOT_CHARS]; // not null terminated
+} NameIndexSlot;
+static_assert(sizeof(NameIndexSlot) == NAME_INDEX_SLOT_SIZE, "NameIndexSlot must be 32 bytes in size");
+
+// The region is sized by compute_disk_layout() for the inode count of the format
+#define SLOTS_PER_BLOCK (BLOCK_SIZE_BYTES / sizeof(NameIndexSlot))
+#define NAME_TABLE_BLOCKS ((MAX_INODES + SLOTS_PER_BLOCK - 1) / SLOTS_PER_BLOCK)
+#define BUCKET_BYTES (MAX_INODES / 8) // whole 64-bit words, the inode count is a multiple of 64
+#define BUCKET_BLOCKS ((BUCKET_BYTES + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES)
+#define TRIGRAM_START (NAME_INDEX_START + NAME_TABLE_BLOCKS)
+
+// External references to globals defined in file_operations.c
+extern _Thread_local SessionConfig *session_config;
+
+static pthread_rwlock_t name_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t enable_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool name_index_enabled(void)
+{
+    return __atomic_load_n(&get_superblock()->name_index_enabled, __ATOMIC_ACQUIRE) != 0;
+}
+
+// FNV-1a hash of the 3 bytes at trigram, reduced to a bucket
+static uint16_t trigram_bucket(const char *trigram)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 3; i++) {
+        hash ^= (uint8_t)trigram[i];
+        hash *= 16777619u;
+    }
+    return hash % TRIGRAM_BUCKETS;
+}
+
+// Sets or clears the bit of inode_number in the buckets of the name's trigrams
+static void update_trigram_buckets(uint16_t inode_number, const char *name, size_t name_len, bool set)
+{
+    uint8_t seen[TRIGRAM_BUCKETS / 8] = {0}; // Each bucket once per name
+    for (size_t i = 0; i + 3 <= name_len; i++) {
+        uint16_t bucket = trigram_bucket(name + i);
+        if (is_bit_set(seen, bucket)) {
+            continue;
+        }
+        set_bit(seen, bucket);
+        uint32_t bits_per_block = BLOCK_SIZE_BYTES * 8;
+        uint32_t block = TRIGRAM_START + bucket * BUCKET_BLOCKS + inode_number / bits_per_block;
+        uint8_t *bitmap = bcache_get(block);
+        if (set) {
+            set_bit(bitmap, inode_number % bits_per_block);
+        } else {
+            clear_bit(bitmap, inode_number % bits_per_block);
+        }
+        journal_dirty_metadata(block);
+        bcache_put(block, true);
+    }
+}
+
+// Copies the name table slot of an inode
+static void read_slot(uint16_t inode_number, NameIndexSlot *slot)
+{
+    uint32_t block = NAME_INDEX_START + inode_number / SLOTS_PER_BLOCK;
+    memcpy(slot, bcache_get(block) + (inode_number % SLOTS_PER_BLOCK) * sizeof(NameIndexSlot), sizeof(NameIndexSlot));
+    bcache_put(block, false);
+}
+
+static void write_slot(uint16_t inode_number, const NameIndexSlot *slot)
+{
+    uint32_t block = NAME_INDEX_START + inode_number / SLOTS_PER_BLOCK;
+    memcpy(bcache_get(block) + (inode_number % SLOTS_PER_BLOCK) * sizeof(NameIndexSlot), slot, sizeof(NameIndexSlot));
+    journal_dirty_metadata(block);
+    bcache_put(block, true);
+}
+
+// Indexes the name of a new directory entry (inode_number, named name in parent_inode)
+// Called inside the journal operation that added the entry
+void name_index_add(uint16_t inode_number, uint16_t parent_inode, const char *name, size_t name_len)
+{
+    if (!name_index_enabled() || inode_number == 0 || name_len == 0 || name_len > UINT8_MAX) {
+        return;
+    }
+    NameIndexSlot slot = {0};
+    slot.parent_inode = parent_inode;
+    slot.name_length = (uint8_t)name_len;
+    memcpy(slot.name, name, (name_len < NAME_SLOT_CHARS) ? name_len : NAME_SLOT_CHARS);
+    
+    pthread_rwlock_wrlock(&name_index_lock);
+    write_slot(inode_number, &slot);
+    update_trigram_buckets(inode_number, name, name_len, true);
+    pthread_rwlock_unlock(&name_index_lock);
+}
+
+// Drops the name of a removed directory entry (for unlink and rename)
+void name_index_remove(uint16_t inode_number, const char *name, size_t name_len)
+{
+    if (!name_index_enabled() || inode_number == 0 || name_len > UINT8_MAX) {
+        return;
+    }
+    NameIndexSlot slot = {0};
+    pthread_rwlock_wrlock(&name_index_lock);
+    write_slot(inode_number, &slot);
+    update_trigram_buckets(inode_number, name, name_len, false);
+    pthread_rwlock_unlock(&name_index_lock);
+}
+
+// Copies the whole name of an indexed inode to name (MAX_FILENAME + 1 bytes) and sets *parent_inode
+// Returns false if the inode has no name in the index
+static bool get_indexed_name(uint16_t inode_number, uint16_t *parent_inode, char *name)
+{
+    NameIndexSlot slot;
+    read_slot(inode_number, &slot);
+    if (slot.name_length == 0) {
+        return false;
+    }
+    *parent_inode = slot.parent_inode;
+    if (slot.name_length <= NAME_SLOT_CHARS) {
+        memcpy(name, slot.name, slot.name_length);
+        name[slot.name_length] = '\0';
+        return true;
+    }
+    
+    // Long name: look the inode up in its directory
+    uint32_t size;
+    uint8_t *entries = copy_directory_entries(slot.parent_inode, &size);
+    bool found = false;
+    for (uint32_t offset = 0; entries != NULL && offset < size && !found; ) {
+        DirectoryEntry *entry = (DirectoryEntry *)(entries + offset);
+        offset += entry->record_length;
+        if (entry->inode_number == inode_number) {
+            memcpy(name, entry->name, entry->name_length + 1);
+            found = true;
+        }
+    }
+    free(entries);
+    return found;
+}
+
+// Writes start_path followed by the path of inode_number below directory start_inode to path
+// Returns false if the inode is not below start_inode, or is in the snapshot directory while
+// the search started outside of it
+static bool build_indexed_path(uint16_t inode_number, uint16_t start_inode, const char *start_path,
+                               uint16_t snapshots, char *path)
+{
+    // Components are prepended, from the inode up to start_inode
+    char buffer[MAX_PATH_LENGTH];
+    size_t position = MAX_PATH_LENGTH - 1;
+    buffer[position] = '\0';
+    char name[MAX_FILENAME + 1];
+    uint16_t node = inode_number;
+    for (int depth = 0; node != start_inode; depth++) {
+        uint16_t parent;
+        if (node == 0 || node == snapshots || depth >= MAX_PATH_LENGTH / 2 ||
+            !get_indexed_name(node, &parent, name)) {
+            return false;
+        }
+        size_t length = strlen(name);
+        if (length + 1 > position) {
+            return false; // Longer than any path
+        }
+        position -= length;
+        memcpy(buffer + position, name, length);
+        buffer[--position] = '/';
+        node = parent;
+    }
+    snprintf(path, MAX_PATH_LENGTH, "%s%s", start_path, buffer + position);
+    return true;
+}
+
+// Matches found under the index lock, passed to the callback after it is released
+typedef struct {
+    uint16_t *inodes;
+    char (*paths)[MAX_PATH_LENGTH];
+    uint32_t count;
+    uint32_t capacity;
+} IndexMatches;
+
+static bool add_match(IndexMatches *matches, uint16_t inode_number, const char *path)
+{
+    if (matches->count == matches->capacity) {
+        uint32_t capacity = matches->capacity ? matches->capacity * 2 : 64;
+        uint16_t *inodes = realloc(matches->inodes, capacity * sizeof(uint16_t));
+        if (inodes == NULL) {
+            return false;
+        }
+        matches->inodes = inodes;
+        char (*paths)[MAX_PATH_LENGTH] = realloc(matches->paths, capacity * sizeof(*paths));
+        if (paths == NULL) {
+            return false;
+        }
+        matches->paths = paths;
+        matches->capacity = capacity;
+    }
+    matches->inodes[matches->count] = inode_number;
+    strcpy(matches->paths[matches->count], path);
+    matches->count++;
+    return true;
+}
+
+// Looks the files below start_inode whose names contain options->pattern up in the index
+// start_path is the search path without trailing slashes; matches come in inode number order
+// Returns the number of matches passed to the callback, or negative error code
+int name_index_search(uint16_t start_inode, const char *start_path, const SearchOptions *options,
+                      SearchCallback callback, void *context)
+{
+    const char *pattern = options->pattern;
+    size_t pattern_len = strlen(pattern);
+    uint64_t *candidates = malloc(BUCKET_BYTES); // Bitmap over all inodes
+    if (candidates == NULL) {
+        return ERROR_INVALID_INPUT;
+    }
+    uint32_t words = BUCKET_BYTES / sizeof(uint64_t);
+    uint32_t words_per_block = BLOCK_SIZE_BYTES / sizeof(uint64_t);
+    memset(candidates, 0xFF, BUCKET_BYTES); // Short patterns: every inode is a candidate
+    uint16_t snapshots = find_directory_entry(0, SNAPSHOT_DIRECTORY);
+    IndexMatches matches = {0};
+    
+    pthread_rwlock_rdlock(&name_index_lock);
+    for (size_t i = 0; i + 3 <= pattern_len; i++) {
+        uint32_t first_block = TRIGRAM_START + trigram_bucket(pattern + i) * BUCKET_BLOCKS;
+        for (uint32_t b = 0; b < BUCKET_BLOCKS; b++) {
+            const uint8_t *bitmap = bcache_get(first_block + b);
+            for (uint32_t w = b * words_per_block; w < words && w < (b + 1) * words_per_block; w++) {
+                uint64_t word;
+                memcpy(&word, bitmap + (w % words_per_block) * sizeof(uint64_t), sizeof(uint64_t));
+                candidates[w] &= word;
+            }
+            bcache_put(first_block + b, false);
+        }
+    }
+    
+    char name[MAX_FILENAME + 1];
+    char path[MAX_PATH_LENGTH];
+    bool full = false;
+    for (uint32_t w = 0; w < words && !full; w++) {
+        uint64_t word = candidates[w];
+        while (word != 0 && !full) {
+            uint16_t inode_number = (uint16_t)(w * 64 + __builtin_ctzll(word));
+            word &= word - 1;
+            uint16_t parent;
+            if (inode_number == 0 || !get_indexed_name(inode_number, &parent, name) ||
+                strstr(name, pattern) == NULL) {
+                continue; // Unused inode, or a trigram collision
+            }
+            
+            // Only files match
+            uint32_t inode_block = INODE_START + (inode_number / INODES_PER_BLOCK);
+            Inode *inode = (Inode *)(bcache_get(inode_block) + (inode_number % INODES_PER_BLOCK) * sizeof(Inode));
+            bool is_directory = (inode->flags & 2) != 0;
+            bcache_put(inode_block, false);
+            if (is_directory || !build_indexed_path(inode_number, start_inode, start_path, snapshots, path)) {
+                continue;
+            }
+            // Out of memory: report what was found
+            full = !add_match(&matches, inode_number, path) ||
+                   (options->max_results != 0 && matches.count >= options->max_results);
+        }
+    }
+    pthread_rwlock_unlock(&name_index_lock);
+    free(candidates);
+    
+    int reported = 0;
+    for (uint32_t i = 0; i < matches.count; i++) {
+        reported++;
+        if (!callback(matches.paths[i], matches.inodes[i], context)) {
+            break;
+        }
+    }
+    free(matches.inodes);
+    free(matches.paths);
+    return reported;
+}
+
+// Indexes the entries below a directory, each in its own journal operation
+static void index_directory_recursive(uint16_t dir_inode)
+{
+    uint32_t size;
+    uint8_t *entries = copy_directory_entries(dir_inode, &size);
+    if (entries == NULL) {
+        return;
+    }
+    for (uint32_t offset = 0; offset < size; ) {
+        DirectoryEntry *entry = (DirectoryEntry *)(entries + offset);
+        offset += entry->record_length;
+        journal_begin_operation();
+        name_index_add(entry->inode_number, dir_inode, entry->name, entry->name_length);
+        journal_end_operation();
+        
+        uint32_t entry_inode_block = INODE_START + (entry->inode_number / INODES_PER_BLOCK);
+        Inode *entry_inode = (Inode *)(bcache_get(entry_inode_block) + (entry->inode_number % INODES_PER_BLOCK) * sizeof(Inode));
+        bool is_directory = (entry_inode->flags & 2) != 0;
+        bcache_put(entry_inode_block, false);
+        if (is_directory) {
+            index_directory_recursive(entry->inode_number);
+        }
+    }
+    free(entries);
+}
+
+// Turns the name index on and indexes the names already in the tree; names created meanwhile
+// are indexed by their creators (the index is enabled before the walk, and indexing is idempotent)
+// Returns SUCCESS, or ERROR_PERMISSION_DENIED while a snapshot is mounted
+int fs_name_index_enable(void)
+{
+    if (session_config->read_only) {
+        return ERROR_PERMISSION_DENIED;
+    }
+    pthread_mutex_lock(&enable_lock);
+    if (!name_index_enabled()) {
+        // The index has never been used, so the region only needs zero filling if the format
+        // left that to the first use
+        zero_stale_blocks(NAME_INDEX_START, NAME_INDEX_END - NAME_INDEX_START + 1);
+        journal_begin_operation();
+        __atomic_store_n(&get_superblock()->name_index_enabled, 1, __ATOMIC_RELEASE);
+        journal_dirty_metadata(SUPERBLOCK);
+        journal_end_operation();
+        tree_lock_shared(); // Snapshots are not deleted under the walk
+        index_directory_recursive(0);
+        tree_unlock_shared();
+    }
+    pthread_mutex_unlock(&enable_lock);
+    return SUCCESS;
+}
@@ -0,0 +1,367 @@
+#include "headers/common.h"
+#include "headers/utils.h"
+#include "headers/search.h"
+#include "headers/snapshot.h"
+#include "headers/name_index.h"
+#include "headers/bcache.h"
+#include "headers/locks.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <regex.h>
+
+// Parallel search: every directory still to be searched is a task. Each worker has a deque of
+// tasks; it pushes the subdirectories it finds to the back of its own deque and takes work from
+// the back (depth first, so its deque stays small), and an idle worker steals from the front of
+// another worker's deque (the largest subtrees, found first)
+//
+// A directory's entries are copied out under its read lock (copy_directory_entries()), so no
+// locks are held while subdirectories are searched or the callback runs
+// Snapshots (/.snapshots) are not searched; a session with a snapshot mounted searches the
+// snapshot, whose directories name live inodes and are mapped to the snapshot's versions
+// Substring searches use the name index instead (name_index.c) once it is enabled
+
+// External references to globals defined in file_operations.c
+extern _Thread_local SessionConfig *session_config;
+
+typedef struct SearchTask {
+    uint16_t dir_inode;
+    char path[]; // path of the directory, without a trailing / (empty for the root)
+} SearchTask;
+
+typedef struct {
+    pthread_mutex_t lock;
+    SearchTask **tasks; // ring buffer of capacity entries, first at head
+    uint32_t head;
+    uint32_t count;
+    uint32_t capacity;
+} SearchQueue;
+
+typedef struct {
+    uint16_t snapshot; // record of the searching session's mounted snapshot, 0 for the live tree
+    const SearchOptions *options;
+    regex_t regex; // compiled pattern for SEARCH_REGEX
+    SearchCallback callback;
+    void *context;
+    
+    int threads;
+    SearchQueue queues[SEARCH_MAX_THREADS];
+    
+    // pending counts tasks queued or being searched: the search is over when it drops to 0
+    // queued counts only the queued ones; idle workers wait on idle_cond while it is 0
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    uint32_t pending;
+    uint32_t queued;
+    bool stop; // limit reached or callback returned false, remaining tasks are dropped
+    
+    pthread_mutex_t result_lock; // serializes the callback
+    uint32_t results;
+} SearchState;
+
+typedef struct {
+    SearchState *state;
+    int id;
+} SearchWorker;
+
+// Appends a task to the back of a worker's deque; returns false if memory runs out
+static bool queue_push(SearchQueue *queue, SearchTask *task)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity) {
+        uint32_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+        SearchTask **tasks = malloc(capacity * sizeof(SearchTask *));
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&queue->lock);
+            return false;
+        }
+        for (uint32_t i = 0; i < queue->count; i++) {
+            tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+        }
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->head = 0;
+        queue->capacity = capacity;
+    }
+    queue->tasks[(queue->head + queue->count) % queue->capacity] = task;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+// Takes a task from the back (owner) or the front (thief) of a deque, or returns NULL if empty
+static SearchTask* queue_pop(SearchQueue *queue, bool from_front)
+{
+    SearchTask *task = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        if (from_front) {
+            task = queue->tasks[queue->head];
+            queue->head = (queue->head + 1) % queue->capacity;
+        } else {
+            task = queue->tasks[(queue->head + queue->count - 1) % queue->capacity];
+        }
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+// Queues a directory to be searched by worker id (or stolen from it)
+static void add_task(SearchState *state, int id, uint16_t dir_inode, const char *path)
+{
+    size_t path_length = strlen(path);
+    SearchTask *task = malloc(sizeof(SearchTask) + path_length + 1);
+    if (task == NULL) {
+        return; // Out of memory: the subtree is skipped
+    }
+    task->dir_inode = dir_inode;
+    memcpy(task->path, path, path_length + 1);
+    
+    __atomic_add_fetch(&state->pending, 1, __ATOMIC_ACQ_REL);
+    if (!queue_push(&state->queues[id], task)) {
+        free(task);
+        __atomic_sub_fetch(&state->pending, 1, __ATOMIC_ACQ_REL); // The caller's task is still pending
+        return;
+    }
+    pthread_mutex_lock(&state->idle_lock); // Under the lock, so a worker about to wait sees it
+    __atomic_add_fetch(&state->queued, 1, __ATOMIC_ACQ_REL);
+    pthread_cond_signal(&state->idle_cond);
+    pthread_mutex_unlock(&state->idle_lock);
+}
+
+// Returns the next task for worker id: its own newest, else the oldest of another worker
+// Waits while other workers are still searching and may queue more; returns NULL when done
+static SearchTask* next_task(SearchState *state, int id)
+{
+    while (true) {
+        SearchTask *task = queue_pop(&state->queues[id], false);
+        for (int i = 1; task == NULL && i < state->threads; i++) {
+            task = queue_pop(&state->queues[(id + i) % state->threads], true);
+        }
+        if (task != NULL) {
+            __atomic_sub_fetch(&state->queued, 1, __ATOMIC_ACQ_REL);
+            return task;
+        }
+        
+        pthread_mutex_lock(&state->idle_lock);
+        while (__atomic_load_n(&state->queued, __ATOMIC_ACQUIRE) == 0 &&
+               __atomic_load_n(&state->pending, __ATOMIC_ACQUIRE) > 0) {
+            pthread_cond_wait(&state->idle_cond, &state->idle_lock);
+        }
+        bool done = (__atomic_load_n(&state->pending, __ATOMIC_ACQUIRE) == 0);
+        pthread_mutex_unlock(&state->idle_lock);
+        if (done) {
+            return NULL;
+        }
+    }
+}
+
+// Marks a task as finished, waking the idle workers if it was the last one
+static void finish_task(SearchState *state)
+{
+    if (__atomic_sub_fetch(&state->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&state->idle_lock);
+        pthread_cond_broadcast(&state->idle_cond);
+        pthread_mutex_unlock(&state->idle_lock);
+    }
+}
+
+static bool name_matches(SearchState *state, const char *name)
+{
+    switch (state->options->mode) {
+    case SEARCH_GLOB:
+        return fnmatch(state->options->pattern, name, 0) == 0;
+    case SEARCH_REGEX:
+        return regexec(&state->regex, name, 0, NULL, 0) == 0;
+    default:
+        return strstr(name, state->options->pattern) != NULL;
+    }
+}
+
+// Passes a match to the callback unless the search has stopped, and stops it at the limit
+static void report_match(SearchState *state, const char *path, uint16_t inode_number)
+{
+    pthread_mutex_lock(&state->result_lock);
+    if (!__atomic_load_n(&state->stop, __ATOMIC_RELAXED)) {
+        state->results++;
+        bool go_on = state->callback(path, inode_number, state->context);
+        if (!go_on || (state->options->max_results != 0 && state->results >= state->options->max_results)) {
+            __atomic_store_n(&state->stop, true, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&state->result_lock);
+}
+
+// Matches the files of one directory and queues its subdirectories
+static void search_directory(SearchState *state, int id, SearchTask *task)
+{
+    uint32_t size;
+    uint8_t *entries = copy_directory_entries(task->dir_inode, &size);
+    if (entries == NULL) {
+        return;
+    }
+    
+    char entry_path[MAX_PATH_LENGTH];
+    for (uint32_t offset = 0; offset < size && !__atomic_load_n(&state->stop, __ATOMIC_RELAXED); ) {
+        DirectoryEntry *entry = (DirectoryEntry *)(entries + offset);
+        offset += entry->record_length;
+        if (state->snapshot == 0 && task->dir_inode == 0 && strcmp(entry->name, SNAPSHOT_DIRECTORY) == 0) {
+            continue; // Snapshots would repeat every match of the live tree
+        }
+        
+        // Get the entry's inode to check if it's a file or a directory
+        uint16_t entry_inode = entry->inode_number;
+        uint32_t entry_inode_block = INODE_START + (entry_inode / INODES_PER_BLOCK);
+        uint16_t entry_inode_offset = (entry_inode % INODES_PER_BLOCK) * sizeof(Inode);
+        Inode *entry_inode_ptr = (Inode *)(bcache_get(entry_inode_block) + entry_inode_offset);
+        bool is_directory = (entry_inode_ptr->flags & 2) != 0;
+        bcache_put(entry_inode_block, false);
+        
+        snprintf(entry_path, MAX_PATH_LENGTH, "%s/%s", task->path, entry->name);
+        if (is_directory) {
+            if (state->snapshot == 0 || snapshot_resolve(state->snapshot, entry_inode, &entry_inode) == SUCCESS) {
+                add_task(state, id, entry_inode, entry_path); // Else /.snapshots, or no room to copy it
+            }
+        } else if (name_matches(state, entry->name)) {
+            report_match(state, entry_path, entry_inode);
+        }
+    }
+    free(entries);
+}
+
+// Workers run under the tree lock fs_search() holds, which they borrow so that callbacks
+// calling back into the file system do not wait behind a freeze that waits for the search
+static void* search_worker(void *arg)
+{
+    SearchWorker *worker = arg;
+    SearchState *state = worker->state;
+    SearchTask *task;
+    tree_lock_borrow();
+    while ((task = next_task(state, worker->id)) != NULL) {
+        if (!__atomic_load_n(&state->stop, __ATOMIC_RELAXED)) {
+            search_directory(state, worker->id, task);
+        }
+        free(task);
+        finish_task(state);
+    }
+    tree_lock_return();
+    return NULL;
+}
+
+// fs_search() body, called with the tree lock held shared
+static int search_locked(const char *search_path, const SearchOptions *options, SearchCallback callback, void *context)
+{
+    // Find the starting directory inode
+    uint16_t start_inode;
+    int result = traverse_path(search_path, &start_inode);
+    if (result != SUCCESS) {
+        return result;
+    }
+    
+    // Verify it's a directory
+    uint32_t inode_block = INODE_START + (start_inode / INODES_PER_BLOCK);
+    uint16_t inode_offset = (start_inode % INODES_PER_BLOCK) * sizeof(Inode);
+    Inode *inode = (Inode *)(bcache_get(inode_block) + inode_offset);
+    bool is_directory = (inode->flags & 2) != 0;
+    bcache_put(inode_block, false);
+    if (!is_directory) {
+        return ERROR_INVALID_INPUT; // Not a directory
+    }
+    
+    // Paths are built as <directory path>/<name>, so the search path loses its trailing slashes
+    char start_path[MAX_PATH_LENGTH];
+    strncpy(start_path, search_path, MAX_PATH_LENGTH - 1);
+    start_path[MAX_PATH_LENGTH - 1] = '\0';
+    size_t length = strlen(start_path);
+    while (length > 0 && start_path[length - 1] == '/') {
+        start_path[--length] = '\0';
+    }
+    
+    // Substrings are looked up in the name index if there is one, without walking the tree
+    // (the index has the live names only)
+    if (options->mode == SEARCH_SUBSTRING && name_index_enabled() && session_config->snapshot == 0) {
+        return name_index_search(start_inode, start_path, options, callback, context);
+    }
+    
+    SearchState *state = calloc(1, sizeof(SearchState));
+    if (state == NULL) {
+        return ERROR_INVALID_INPUT;
+    }
+    state->snapshot = session_config->snapshot;
+    state->options = options;
+    state->callback = callback;
+    state->context = context;
+    if (options->mode == SEARCH_REGEX && regcomp(&state->regex, options->pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+        free(state);
+        return ERROR_INVALID_INPUT; // Invalid regular expression
+    }
+    
+    state->threads = options->threads;
+    if (state->threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        state->threads = (cpus > 0) ? (int)cpus : 1;
+    }
+    if (state->threads > SEARCH_MAX_THREADS) {
+        state->threads = SEARCH_MAX_THREADS;
+    }
+    for (int i = 0; i < state->threads; i++) {
+        pthread_mutex_init(&state->queues[i].lock, NULL);
+    }
+    pthread_mutex_init(&state->idle_lock, NULL);
+    pthread_cond_init(&state->idle_cond, NULL);
+    pthread_mutex_init(&state->result_lock, NULL);
+    
+    add_task(state, 0, start_inode, start_path);
+    
+    // The caller is worker 0; the others start with nothing and steal
+    pthread_t handles[SEARCH_MAX_THREADS];
+    SearchWorker workers[SEARCH_MAX_THREADS];
+    for (int i = 0; i < state->threads; i++) {
+        workers[i].state = state;
+        workers[i].id = i;
+    }
+    int started = 1;
+    for (int i = 1; i < state->threads; i++) {
+        if (pthread_create(&handles[started], NULL, search_worker, &workers[i]) == 0) {
+            started++; // A worker that did not start never has tasks of its own
+        }
+    }
+    search_worker(&workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    
+    result = (int)state->results;
+    for (int i = 0; i < state->threads; i++) {
+        pthread_mutex_destroy(&state->queues[i].lock);
+        free(state->queues[i].tasks);
+    }
+    pthread_mutex_destroy(&state->idle_lock);
+    pthread_cond_destroy(&state->idle_cond);
+    pthread_mutex_destroy(&state->result_lock);
+    if (options->mode == SEARCH_REGEX) {
+        regfree(&state->regex);
+    }
+    free(state);
+    return result;
+}
+
+int fs_search(const char *search_path, const SearchOptions *options, SearchCallback callback, void *context)
+{
+    if (search_path == NULL || options == NULL || options->pattern == NULL || callback == NULL ||
+        options->threads < 0) {
+        return ERROR_INVALID_INPUT;
+    }
+    
+    // Snapshots are not deleted under a running search
+    tree_lock_shared();
+    int result = search_locked(search_path, options, callback, context);
+    tree_unlock_shared();
+    return result;
+}
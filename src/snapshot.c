@@ -0,0 +1,646 @@
+#include "headers/common.h"
+#include "headers/utils.h"
+#include "headers/snapshot.h"
+#include "headers/file_operations.h"
+#include "headers/directory_operations.h"
+#include "headers/bcache.h"
+#include "headers/journal.h"
+#include "headers/locks.h"
+#include "headers/dcache.h"
+#include "headers/name_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Snapshots: /.snapshots/<name> is the record of a snapshot of the tree as it was when it was
+// taken. Nothing is copied then: the snapshot shares every inode and block with the live tree,
+// and an inode is copied the first time it changes afterwards (copy on write of inodes)
+//
+// A record is an inode flagged SNAPSHOT_FLAG | SNAPSHOT_RECORD_FLAG whose logical blocks hold
+//  - from 0, bitmap_blocks() blocks: the inode bitmap as it was when the snapshot was taken
+//  - from bitmap_blocks(): the inode map, one uint16_t per inode, 0 while the live inode is still
+//    the snapshot's version and otherwise the copy that is; a map block is allocated the first
+//    time one of its entries is set
+// Superblock.snapshot_records lists the records, oldest first
+//
+// Before an inode that existed when a snapshot was taken changes for the first time since, it
+// is copied (snapshot_preserve()): the copy carries SNAPSHOT_FLAG and shares the block map through
+// the block share counts like a clone, and every snapshot still seeing the live inode gets the
+// copy in its map. A directory's blocks are copied on write like a file's (directory_operations.c),
+// so a copied directory keeps its old entries. Entries name live inodes, so a session with a
+// snapshot mounted maps every inode it reaches through the snapshot's map (snapshot_resolve()),
+// copying it first if the live tree still shares it
+//
+// Costs: taking a snapshot freezes the tree (tree_freeze()) only for the operations in flight to
+// finish and for the inode bitmap to be copied, whatever the size of the tree. Afterwards every
+// inode changed, or reached from a mounted snapshot, costs one inode once per run of snapshots
+// taken before the change (the root directory one block more), plus the blocks copied on write
+// and the record's map blocks. Access times are not part of snapshots. When inodes or blocks run
+// out, the change that needed a copy fails
+//
+// Copies, records and /.snapshots itself carry SNAPSHOT_FLAG: file and directory operations check
+// snapshot_allows_change() so no session can change a snapshot through the live tree. Only the
+// thread deleting a snapshot (snapshot_maintenance set) gets past it
+
+// External references to globals defined in file_operations.c
+extern _Thread_local SessionConfig *session_config;
+
+// Set while the calling thread creates or deletes a snapshot, whose inodes carry SNAPSHOT_FLAG
+static _Thread_local bool snapshot_maintenance;
+
+// Sessions that have each snapshot mounted, by record: such a snapshot is not deleted
+// Changed under the tree lock held shared, read by fs_snapshot_delete() with the tree frozen
+static uint32_t mount_counts[MAX_INODE_COUNT];
+
+// Held for writing while map entries and map blocks of records are set (with the write lock of
+// the inode whose entry it is), for reading while they are looked up; taken after inode locks
+static pthread_rwlock_t map_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#define MAP_ENTRIES_PER_BLOCK (BLOCK_SIZE_BYTES / sizeof(uint16_t))
+
+// Blocks of a record's inode bitmap, the first of its inode map
+static uint32_t bitmap_blocks(void)
+{
+    return FREE_DATA_BITMAP - FREE_INODE_BITMAP;
+}
+
+// Returns inode inode_number and sets *inode_block to its block, to be released with bcache_put()
+static Inode* get_inode(uint16_t inode_number, uint32_t *inode_block)
+{
+    *inode_block = INODE_START + (inode_number / INODES_PER_BLOCK);
+    return (Inode *)(bcache_get(*inode_block) + (inode_number % INODES_PER_BLOCK) * sizeof(Inode));
+}
+
+bool snapshot_allows_change(uint16_t inode_number)
+{
+    if (snapshot_maintenance) {
+        return true;
+    }
+    uint32_t inode_block;
+    Inode *inode = get_inode(inode_number, &inode_block);
+    bool is_snapshot = (__atomic_load_n(&inode->flags, __ATOMIC_RELAXED) & SNAPSHOT_FLAG) != 0;
+    bcache_put(inode_block, false);
+    return !is_snapshot;
+}
+
+// Returns true if inode_number existed when the snapshot of record was taken (the root always
+// did), called with map_lock held
+static bool existed_in(Inode *record, uint16_t inode_number)
+{
+    if (inode_number == 0) {
+        return true;
+    }
+    uint32_t bits = BLOCK_SIZE_BYTES * 8;
+    uint32_t block = inode_bmap(record, inode_number / bits, false);
+    bool existed = is_bit_set(bcache_get(block), inode_number % bits);
+    bcache_put(block, false);
+    return existed;
+}
+
+// Returns record's map entry for inode_number, called with map_lock held
+static uint16_t map_entry(Inode *record, uint16_t inode_number)
+{
+    uint32_t block = inode_bmap(record, bitmap_blocks() + inode_number / MAP_ENTRIES_PER_BLOCK, false);
+    if (block == 0) {
+        return 0; // No entry of that block was set yet
+    }
+    uint16_t copy = ((uint16_t *)bcache_get(block))[inode_number % MAP_ENTRIES_PER_BLOCK];
+    bcache_put(block, false);
+    return copy;
+}
+
+// Allocates the map block holding record's entry for inode_number if there is none yet, called
+// with map_lock held for writing. Returns false if the disk is full
+static bool allocate_map_block(Inode *record, uint16_t inode_number)
+{
+    uint32_t logical_block = bitmap_blocks() + inode_number / MAP_ENTRIES_PER_BLOCK;
+    if (inode_bmap(record, logical_block, false) != 0) {
+        return true;
+    }
+    uint32_t block = find_free_data_block();
+    if (block == 0) {
+        return false;
+    }
+    memset(bcache_get(block), 0, BLOCK_SIZE_BYTES);
+    journal_dirty_metadata(block);
+    bcache_put(block, true);
+    if (inode_bmap_assign(record, logical_block, block) != SUCCESS) {
+        free_data_block(block);
+        return false;
+    }
+    return true;
+}
+
+// Sets record's map entry for inode_number, whose map block exists
+static void set_map_entry(Inode *record, uint16_t inode_number, uint16_t copy)
+{
+    uint32_t block = inode_bmap(record, bitmap_blocks() + inode_number / MAP_ENTRIES_PER_BLOCK, false);
+    ((uint16_t *)bcache_get(block))[inode_number % MAP_ENTRIES_PER_BLOCK] = copy;
+    journal_dirty_metadata(block);
+    bcache_put(block, true);
+}
+
+// Copies inode inode_number, write locked by the caller, into a new inode with SNAPSHOT_FLAG that
+// shares its blocks; a block outside the data region (the root directory's first block) has no
+// share count and is copied instead. Returns the copy, or 0 if no inode or block is free
+static uint16_t copy_inode(uint16_t inode_number)
+{
+    uint16_t copy_number = find_free_inode();
+    if (copy_number == 0) {
+        return 0;
+    }
+    uint32_t inode_block;
+    Inode copy;
+    memcpy(&copy, get_inode(inode_number, &inode_block), sizeof(Inode));
+    bcache_put(inode_block, false);
+    copy.flags |= SNAPSHOT_FLAG;
+    if ((copy.flags & INLINE_DATA_FLAG) == 0) { // Inline data was copied with the inode
+        uint32_t private_blocks[DIRECT_BLOCKS] = { 0 };
+        for (int i = 0; i < DIRECT_BLOCKS; i++) {
+            if (copy.directBlocks[i] == 0 || copy.directBlocks[i] >= DATA_START) {
+                continue;
+            }
+            private_blocks[i] = find_free_data_block();
+            if (private_blocks[i] == 0) {
+                for (int j = 0; j < i; j++) {
+                    if (private_blocks[j] != 0) {
+                        free_data_block(private_blocks[j]);
+                    }
+                }
+                free_inode(copy_number);
+                return 0;
+            }
+            memcpy(bcache_get(private_blocks[i]), bcache_get(copy.directBlocks[i]), BLOCK_SIZE_BYTES);
+            bcache_put(copy.directBlocks[i], false);
+            journal_dirty_metadata(private_blocks[i]);
+            bcache_put(private_blocks[i], true);
+        }
+        for (int i = 0; i < DIRECT_BLOCKS; i++) {
+            if (private_blocks[i] != 0) {
+                copy.directBlocks[i] = private_blocks[i];
+            } else {
+                share_data_block(copy.directBlocks[i]);
+            }
+        }
+        share_data_block(copy.indirect);
+        share_data_block(copy.second_level_indirect);
+    }
+    memcpy(get_inode(copy_number, &inode_block), &copy, sizeof(Inode));
+    journal_dirty_metadata(inode_block);
+    bcache_put(inode_block, true);
+    return copy_number;
+}
+
+// Copies inode_number for every snapshot it existed in that still sees the live inode, called
+// with its write lock and map_lock held for writing. Map blocks are allocated before the copy
+// is made, so nothing is left half done when the disk is full
+static int preserve_locked(uint16_t inode_number)
+{
+    Superblock *sb = get_superblock();
+    uint16_t records[MAX_SNAPSHOTS];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < sb->snapshot_count; i++) {
+        uint32_t record_block;
+        Inode *record = get_inode(sb->snapshot_records[i], &record_block);
+        bool needed = existed_in(record, inode_number) && map_entry(record, inode_number) == 0;
+        bool allocated = !needed || allocate_map_block(record, inode_number);
+        bcache_put(record_block, needed);
+        if (!allocated) {
+            return ERROR_INVALID_INPUT;
+        }
+        if (needed) {
+            records[count++] = sb->snapshot_records[i];
+        }
+    }
+    if (count == 0) {
+        return SUCCESS;
+    }
+
+    uint16_t copy = copy_inode(inode_number);
+    if (copy == 0) {
+        return ERROR_INVALID_INPUT;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t record_block;
+        set_map_entry(get_inode(records[i], &record_block), inode_number, copy);
+        bcache_put(record_block, false);
+    }
+    return SUCCESS;
+}
+
+int snapshot_preserve(uint16_t inode_number)
+{
+    Superblock *sb = get_superblock();
+    if (sb->snapshot_count == 0) {
+        return SUCCESS; // Changes only under a frozen tree, which the caller's operation keeps thawed
+    }
+    uint32_t inode_block;
+    Inode *inode = get_inode(inode_number, &inode_block);
+    bool is_snapshot = (inode->flags & SNAPSHOT_FLAG) != 0;
+    bcache_put(inode_block, false);
+    if (is_snapshot) {
+        return SUCCESS; // Not part of any snapshot (only changed while snapshots are created or deleted)
+    }
+
+    // An inode is copied for all the snapshots that need it at once, so if the newest snapshot
+    // has its copy (or the inode did not exist then), the older ones are done too
+    uint32_t record_block;
+    pthread_rwlock_rdlock(&map_lock);
+    Inode *newest = get_inode(sb->snapshot_records[sb->snapshot_count - 1], &record_block);
+    bool preserved = !existed_in(newest, inode_number) || map_entry(newest, inode_number) != 0;
+    bcache_put(record_block, false);
+    pthread_rwlock_unlock(&map_lock);
+    if (preserved) {
+        return SUCCESS;
+    }
+
+    pthread_rwlock_wrlock(&map_lock);
+    int result = preserve_locked(inode_number);
+    pthread_rwlock_unlock(&map_lock);
+    return result;
+}
+
+uint16_t snapshot_version(uint16_t snapshot, uint16_t inode_number)
+{
+    uint32_t record_block;
+    pthread_rwlock_rdlock(&map_lock);
+    uint16_t copy = map_entry(get_inode(snapshot, &record_block), inode_number);
+    bcache_put(record_block, false);
+    pthread_rwlock_unlock(&map_lock);
+    return (copy != 0) ? copy : inode_number;
+}
+
+int snapshot_resolve(uint16_t snapshot, uint16_t inode_number, uint16_t *version)
+{
+    uint32_t inode_block;
+    Inode *inode = get_inode(inode_number, &inode_block);
+    bool is_snapshot = (__atomic_load_n(&inode->flags, __ATOMIC_RELAXED) & SNAPSHOT_FLAG) != 0;
+    bcache_put(inode_block, false);
+    if (is_snapshot) {
+        return ERROR_FILE_NOT_FOUND; // /.snapshots, which snapshots do not show
+    }
+
+    // Usually the copy exists already
+    uint32_t record_block;
+    pthread_rwlock_rdlock(&map_lock);
+    Inode *record = get_inode(snapshot, &record_block);
+    bool existed = existed_in(record, inode_number);
+    *version = map_entry(record, inode_number);
+    bcache_put(record_block, false);
+    pthread_rwlock_unlock(&map_lock);
+    if (!existed) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    if (*version != 0) {
+        return SUCCESS;
+    }
+
+    // The live inode is still the snapshot's version: copy it before the live tree changes it
+    // (its write lock keeps it from changing meanwhile)
+    tree_lock_shared();
+    journal_begin_operation();
+    inode_write_lock(inode_number);
+    pthread_rwlock_wrlock(&map_lock);
+    int result = preserve_locked(inode_number);
+    record = get_inode(snapshot, &record_block);
+    *version = map_entry(record, inode_number);
+    bcache_put(record_block, false);
+    pthread_rwlock_unlock(&map_lock);
+    inode_unlock(inode_number);
+    journal_end_operation();
+    tree_unlock_shared();
+    return (result == SUCCESS && *version != 0) ? SUCCESS : ERROR_INVALID_INPUT;
+}
+
+// Sets SNAPSHOT_FLAG on inode_number, which then refuses every change
+static void mark_snapshot_inode(uint16_t inode_number)
+{
+    journal_begin_operation();
+    uint32_t inode_block;
+    Inode *inode = get_inode(inode_number, &inode_block);
+    inode_write_lock(inode_number);
+    inode->flags |= SNAPSHOT_FLAG;
+    inode_unlock(inode_number);
+    journal_dirty_metadata(inode_block);
+    bcache_put(inode_block, true);
+    journal_end_operation();
+}
+
+// Returns true for a name that can be a snapshot: one path component other than . and ..
+static bool is_valid_snapshot_name(const char *name)
+{
+    if (name == NULL || name[0] == '\0' || strlen(name) > MAX_FILENAME || strchr(name, '/') != NULL) {
+        return false;
+    }
+    return strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+// Returns the inode of /.snapshots, creating it first if create is set, or 0 if there is none
+static uint16_t get_snapshot_directory(bool create)
+{
+    uint16_t directory = find_directory_entry(0, SNAPSHOT_DIRECTORY);
+    if (directory == 0 && create) {
+        directory = create_directory_in(0, SNAPSHOT_DIRECTORY, strlen(SNAPSHOT_DIRECTORY));
+        if (directory != 0) {
+            mark_snapshot_inode(directory);
+        }
+    }
+    return directory;
+}
+
+// Returns the position of record in Superblock.snapshot_records, or -1 if it is not listed
+static int find_record(uint16_t record)
+{
+    Superblock *sb = get_superblock();
+    for (uint32_t i = 0; i < sb->snapshot_count; i++) {
+        if (sb->snapshot_records[i] == record) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Returns the record of the snapshot name, or 0 if there is no such snapshot
+static uint16_t find_snapshot(const char *name)
+{
+    uint16_t snapshots = get_snapshot_directory(false);
+    uint16_t record = (snapshots != 0) ? find_directory_entry(snapshots, name) : 0;
+    return (record != 0 && find_record(record) >= 0) ? record : 0;
+}
+
+// Frees a copy or a record of a snapshot being deleted and its blocks (shared ones lose a reference)
+static void free_snapshot_inode(uint16_t inode_number)
+{
+    journal_begin_operation();
+    uint32_t inode_block;
+    Inode *inode = get_inode(inode_number, &inode_block);
+    inode_write_lock(inode_number);
+    uint32_t end_block = (uint32_t)(((uint64_t)inode->file_size + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES);
+    inode->file_size = 0;
+    inode_truncate_blocks_stepwise(inode_number, inode, 0, end_block); // Copies no pointer block, cannot fail
+    inode->flags = 0;
+    inode_unlock(inode_number);
+    journal_dirty_metadata(inode_block);
+    bcache_put(inode_block, true);
+    free_inode(inode_number);
+    journal_end_operation();
+}
+
+// Turns the new empty file record_number into the record of a snapshot of the tree as it is now
+// Returns SUCCESS, or ERROR_INVALID_INPUT if the disk is full
+static int fill_record(uint16_t record_number)
+{
+    uint32_t record_block;
+    Inode *record = get_inode(record_number, &record_block);
+    inode_write_lock(record_number);
+    record->flags = 1 | SNAPSHOT_FLAG | SNAPSHOT_RECORD_FLAG;
+    memset(record->inline_data, 0, INLINE_DATA_SIZE); // Empty block map
+    uint32_t map_blocks = (MAX_INODES + MAP_ENTRIES_PER_BLOCK - 1) / MAP_ENTRIES_PER_BLOCK;
+    record->file_size = (bitmap_blocks() + map_blocks) * BLOCK_SIZE_BYTES;
+    int result = SUCCESS;
+    for (uint32_t i = 0; i < bitmap_blocks() && result == SUCCESS; i++) {
+        uint32_t block = find_free_data_block();
+        if (block == 0 || inode_bmap_assign(record, i, block) != SUCCESS) {
+            if (block != 0) {
+                free_data_block(block);
+            }
+            result = ERROR_INVALID_INPUT;
+            break;
+        }
+        memcpy(bcache_get(block), bcache_get(FREE_INODE_BITMAP + i), BLOCK_SIZE_BYTES);
+        bcache_put(FREE_INODE_BITMAP + i, false);
+        journal_dirty_metadata(block);
+        bcache_put(block, true);
+    }
+    journal_dirty_metadata(record_block);
+    inode_unlock(record_number);
+    bcache_put(record_block, true);
+    return result;
+}
+
+// fs_snapshot_create() body, called with the tree frozen: O(1) work, no inode is copied
+static int create_snapshot(const char *name)
+{
+    Superblock *sb = get_superblock();
+    if (sb->snapshot_count == MAX_SNAPSHOTS) {
+        return ERROR_INVALID_INPUT;
+    }
+    uint16_t snapshots = get_snapshot_directory(false);
+    if (snapshots != 0 && find_directory_entry(snapshots, name) != 0) {
+        return ERROR_INVALID_INPUT; // Name taken
+    }
+    // /.snapshots and the record take an inode each; the record's bitmap blocks and their
+    // indirect block, and the blocks /.snapshots may need for the new name
+    if (sb->free_inodes < 2 || sb->free_data_blocks < bitmap_blocks() + 4) {
+        return ERROR_INVALID_INPUT;
+    }
+
+    // The record is listed in the same journal operation that creates it
+    journal_begin_operation();
+    if (snapshots == 0) {
+        snapshots = get_snapshot_directory(true);
+    }
+    uint16_t record = (snapshots != 0) ? create_file_in(snapshots, name, strlen(name)) : 0;
+    if (record == 0) {
+        journal_end_operation();
+        return ERROR_INVALID_INPUT;
+    }
+    int result = fill_record(record);
+    if (result == SUCCESS) {
+        sb->snapshot_records[sb->snapshot_count++] = record;
+        journal_dirty_metadata(SUPERBLOCK);
+    } else {
+        remove_directory_entry_n(snapshots, name, strlen(name));
+        name_index_remove(record, name, strlen(name));
+        free_snapshot_inode(record);
+    }
+    journal_end_operation();
+    return result;
+}
+
+// Takes a snapshot of the live tree named name (see the top of this file)
+// Returns SUCCESS, ERROR_PERMISSION_DENIED while a snapshot is mounted, or ERROR_INVALID_INPUT
+// (invalid name, a snapshot of that name exists, MAX_SNAPSHOTS snapshots exist, disk full)
+int fs_snapshot_create(const char *name)
+{
+    if (!is_valid_snapshot_name(name)) {
+        return ERROR_INVALID_INPUT;
+    }
+    if (session_config->read_only) {
+        return ERROR_PERMISSION_DENIED;
+    }
+
+    tree_freeze(); // Waits for the operations in flight, so each one is wholly before or after
+    snapshot_maintenance = true;
+    int result = create_snapshot(name);
+    snapshot_maintenance = false;
+    tree_thaw();
+    return result;
+}
+
+// Sets the bits of the copies only record's map holds in copies: a copy is shared by every
+// snapshot that saw the same version of an inode, and stays while another one maps it
+static void collect_copies(uint16_t record_number, uint8_t *copies)
+{
+    Superblock *sb = get_superblock();
+    uint32_t map_blocks = (MAX_INODES + MAP_ENTRIES_PER_BLOCK - 1) / MAP_ENTRIES_PER_BLOCK;
+    uint32_t record_block;
+    Inode *record = get_inode(record_number, &record_block);
+    for (uint32_t b = 0; b < map_blocks; b++) {
+        uint32_t block = inode_bmap(record, bitmap_blocks() + b, false);
+        if (block == 0) {
+            continue;
+        }
+        uint16_t *entries = (uint16_t *)bcache_get(block);
+        for (uint32_t i = 0; i < MAP_ENTRIES_PER_BLOCK; i++) {
+            if (entries[i] != 0) {
+                set_bit(copies, entries[i]);
+            }
+        }
+        for (uint32_t s = 0; s < sb->snapshot_count; s++) {
+            if (sb->snapshot_records[s] == record_number) {
+                continue;
+            }
+            uint32_t other_block;
+            Inode *other = get_inode(sb->snapshot_records[s], &other_block);
+            uint32_t other_map = inode_bmap(other, bitmap_blocks() + b, false);
+            bcache_put(other_block, false);
+            if (other_map == 0) {
+                continue;
+            }
+            uint16_t *other_entries = (uint16_t *)bcache_get(other_map);
+            for (uint32_t i = 0; i < MAP_ENTRIES_PER_BLOCK; i++) {
+                if (entries[i] != 0 && other_entries[i] == entries[i]) {
+                    clear_bit(copies, entries[i]);
+                }
+            }
+            bcache_put(other_map, false);
+        }
+        bcache_put(block, false);
+    }
+    bcache_put(record_block, false);
+}
+
+// fs_snapshot_delete() first part, called with the tree frozen: unlists the snapshot name and
+// sets *record and the bits of the copies to free in copies
+static int unlist_snapshot(const char *name, uint16_t *record, uint8_t *copies)
+{
+    *record = find_snapshot(name);
+    if (*record == 0) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    if (mount_counts[*record] > 0) {
+        return ERROR_PERMISSION_DENIED; // Mounted by a session
+    }
+    collect_copies(*record, copies);
+    if (file_open_among(copies)) {
+        return ERROR_PERMISSION_DENIED; // A file of it is open
+    }
+
+    journal_begin_operation();
+    remove_directory_entry_n(get_snapshot_directory(false), name, strlen(name));
+    name_index_remove(*record, name, strlen(name));
+    Superblock *sb = get_superblock();
+    int position = find_record(*record);
+    memmove(&sb->snapshot_records[position], &sb->snapshot_records[position + 1],
+            (sb->snapshot_count - position - 1) * sizeof(uint16_t));
+    sb->snapshot_count--;
+    journal_dirty_metadata(SUPERBLOCK);
+    journal_end_operation();
+    dcache_invalidate_all(); // Lookups cached under the copies must not outlive them
+    return SUCCESS;
+}
+
+// Deletes the snapshot name and gives its inodes and blocks back
+// The snapshot is unlisted with the tree frozen, then its copies and its record are freed while
+// the tree runs, each in a journal operation of its own: nothing refers to them any more, and a
+// crash part way through leaves unreachable inodes and blocks, never an entry naming a freed inode
+// A session whose current directory is inside the snapshot must change directory first
+// Returns SUCCESS, ERROR_FILE_NOT_FOUND if there is no such snapshot, ERROR_PERMISSION_DENIED
+// if a session has it mounted, a file of it is open or the calling session has a snapshot
+// mounted, or ERROR_INVALID_INPUT (invalid name, memory ran out)
+int fs_snapshot_delete(const char *name)
+{
+    if (!is_valid_snapshot_name(name)) {
+        return ERROR_INVALID_INPUT;
+    }
+    if (session_config->read_only) {
+        return ERROR_PERMISSION_DENIED;
+    }
+    uint8_t *copies = calloc(MAX_INODE_COUNT / 8, 1);
+    if (copies == NULL) {
+        return ERROR_INVALID_INPUT;
+    }
+
+    uint16_t record;
+    tree_freeze();
+    snapshot_maintenance = true;
+    int result = unlist_snapshot(name, &record, copies);
+    snapshot_maintenance = false;
+    tree_thaw();
+
+    if (result == SUCCESS) {
+        tree_lock_shared();
+        for (uint32_t copy = 1; copy < MAX_INODES; copy++) {
+            if (is_bit_set(copies, copy)) {
+                free_snapshot_inode(copy);
+            }
+        }
+        free_snapshot_inode(record);
+        tree_unlock_shared();
+    }
+    free(copies);
+    return result;
+}
+
+// Drops the calling session's mount, if it has one
+static void release_mount(void)
+{
+    if (session_config->snapshot != 0) {
+        __atomic_fetch_sub(&mount_counts[session_config->snapshot], 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Makes the snapshot name the calling session's root directory, read only, and changes to it
+// Returns SUCCESS, ERROR_FILE_NOT_FOUND if there is no such snapshot, or ERROR_INVALID_INPUT if
+// its root directory could not be copied (no free inode or block)
+int fs_snapshot_mount(const char *name)
+{
+    if (!is_valid_snapshot_name(name)) {
+        return ERROR_INVALID_INPUT;
+    }
+    tree_lock_shared(); // Not deleted while it is being mounted
+    uint16_t record = find_snapshot(name);
+    uint16_t root = 0;
+    int result = (record != 0) ? snapshot_resolve(record, 0, &root) : ERROR_FILE_NOT_FOUND;
+    if (result != SUCCESS) {
+        tree_unlock_shared();
+        return result;
+    }
+
+    release_mount();
+    __atomic_fetch_add(&mount_counts[record], 1, __ATOMIC_RELAXED);
+    session_config->snapshot = record;
+    session_config->root_inode = root;
+    session_config->read_only = true;
+    session_config->current_dir_inode = root;
+    strcpy(session_config->current_working_dir, "/");
+    tree_unlock_shared();
+    return SUCCESS;
+}
+
+// Returns the calling session to the live tree, in its root directory
+void fs_snapshot_unmount(void)
+{
+    tree_lock_shared();
+    release_mount();
+    session_config->snapshot = 0;
+    session_config->root_inode = 0;
+    session_config->read_only = false;
+    session_config->current_dir_inode = 0;
+    strcpy(session_config->current_working_dir, "/");
+    tree_unlock_shared();
+}
@@ -1,106 +1,931 @@
 #include "headers/utils.h"
 #include "headers/common.h"
+#include "headers/journal.h"
+#include "headers/bcache.h"
+#include "headers/disk_image.h"
+#include "headers/locks.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
+
+// The allocation bitmaps are regions of one or more blocks: the inode bitmap starts at
+// FREE_INODE_BITMAP (one bit per inode), the data bitmap at FREE_DATA_BITMAP (one bit per data
+// block, bit 0 is block DATA_START). Their blocks stay pinned in the block cache. A block holds
+// BLOCK_SIZE_BYTES * 8 bits, a whole number of 64-bit words, so a word never crosses a block
 
-// Bitmap is stored in HARD_DISK[FREE_BITMAP] block (block 1, 2048 bytes = 16384 bits)
-// Layout: First 16384 bits for inodes, remaining bits for data blocks
-// Since we have 16384 bits total and need to track 16384 inodes + 15870 data blocks,
-// we'll use a compact approach: track inodes in first 16384 bits, and data blocks
-// in a compressed format or use the remaining space efficiently
-// 
-// For now, we'll use: 
-// - Bits 0-16383: inode allocation (16384 bits = 2048 bytes, uses full block)
-// - For data blocks, we'll use a simple linear search or track in a second mechanism
-//   Since block 1 is full with inodes, we'll implement data block tracking separately
-//   or use a different allocation strategy
-
-#define MAX_INODES ((INODE_END - INODE_START + 1) * (BLOCK_SIZE_BYTES / sizeof(Inode))) // 16384
-#define MAX_DATA_BLOCKS (DATA_END - DATA_START + 1) // 15870
 #define INODE_OFFSET 1 // Often inode 0 is reserved
-#define INODE_BITMAP_SIZE (MAX_INODES / 8) // 2048 bytes - uses entire block 1
+#define BITMAP_BITS_PER_BLOCK (BLOCK_SIZE_BYTES * 8)
+#define BITMAP_WORDS_PER_BLOCK (BLOCK_SIZE_BYTES / sizeof(uint64_t))
+
+// How inode_bmap_slot() treats the pointer blocks on the way to a slot
+typedef enum {
+    BMAP_READ,     // follow existing pointer blocks
+    BMAP_MODIFY,   // also replace shared ones by private copies, so the slot can be changed
+    BMAP_ALLOCATE, // also allocate missing ones
+} BmapMode;
 
-// External reference to hard disk (defined in file_operations.c)
-extern uint8_t HARD_DISK[BLOCK_NUM][BLOCK_SIZE_BYTES];
+// Allocator locks: each bitmap and its superblock count/hint are only changed under its lock
+static pthread_mutex_t inode_bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t data_bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
 
-int is_bit_set(uint8_t *bitmap, uint16_t index)
+int is_bit_set(uint8_t *bitmap, uint32_t index)
 {
-    uint16_t byte_index = index / 8;              // array index represents bytes
+    uint32_t byte_index = index / 8;              // array index represents bytes
     uint8_t bit_index = index % 8;                // bit position within that byte
     return (bitmap[byte_index] >> bit_index) & 1; // return 1 if bit is set to 1, 0 otherwise
 }
 
-void set_bit(uint8_t *bitmap, uint16_t index)
+void set_bit(uint8_t *bitmap, uint32_t index)
 {
-    uint16_t byte_index = index / 8;
+    uint32_t byte_index = index / 8;
     uint8_t bit_index = index % 8;
     bitmap[byte_index] |= (1 << bit_index);
 }
 
-void clear_bit(uint8_t *bitmap, uint16_t index)
+void clear_bit(uint8_t *bitmap, uint32_t index)
 {
-    uint16_t byte_index = index / 8;
+    uint32_t byte_index = index / 8;
     uint8_t bit_index = index % 8;
     bitmap[byte_index] &= ~(1 << bit_index);
 }
 
-// Get pointer to inode bitmap in hard disk (block FREE_INODE_BITMAP = 1)
-uint8_t* get_inode_bitmap()
+// Get pointer to the superblock (block SUPERBLOCK = 0), holds allocator hints and free counts
+// The superblock is pinned in the block cache, so it needs no bcache_put()
+Superblock* get_superblock()
 {
-    return HARD_DISK[FREE_INODE_BITMAP];
+    return (Superblock *)bcache_pin(SUPERBLOCK);
 }
 
-// Get pointer to data bitmap in hard disk (block FREE_DATA_BITMAP = 2)
-uint8_t* get_data_bitmap()
+// Loads the 64-bit bitmap word that holds bits [word_index * 64, word_index * 64 + 63]
+// Bit i of the word is bit i % 8 of byte i / 8, the same numbering as is_bit_set() (little endian)
+static uint64_t load_bitmap_word(uint32_t bitmap_start, uint32_t word_index)
 {
-    return HARD_DISK[FREE_DATA_BITMAP];
+    uint64_t word;
+    uint8_t *block = bcache_pin(bitmap_start + word_index / BITMAP_WORDS_PER_BLOCK);
+    memcpy(&word, block + (word_index % BITMAP_WORDS_PER_BLOCK) * sizeof(uint64_t), sizeof(uint64_t));
+    return word;
 }
 
-uint16_t find_free_inode()
+static bool bitmap_bit_is_set(uint32_t bitmap_start, uint32_t index)
+{
+    return is_bit_set(bcache_pin(bitmap_start + index / BITMAP_BITS_PER_BLOCK), index % BITMAP_BITS_PER_BLOCK);
+}
+
+// Sets or clears a bitmap bit and records the change of its block in the journal
+static void change_bitmap_bit(uint32_t bitmap_start, uint32_t index, bool allocated)
+{
+    uint32_t block = bitmap_start + index / BITMAP_BITS_PER_BLOCK;
+    if (allocated) {
+        set_bit(bcache_pin(block), index % BITMAP_BITS_PER_BLOCK);
+    } else {
+        clear_bit(bcache_pin(block), index % BITMAP_BITS_PER_BLOCK);
+    }
+    journal_dirty_metadata(block);
+}
+
+// Returns a mask of the bits in a word that are outside [first_bit, nbits) and can never be allocated
+static uint64_t unusable_bits_mask(uint32_t word_index, uint32_t first_bit, uint32_t nbits)
 {
-    uint8_t *inode_bitmap = get_inode_bitmap();
-    // Start from first non-reserved inode
-    for (uint16_t i = INODE_OFFSET; i < MAX_INODES; i++)
-    {
-        if (!is_bit_set(inode_bitmap, i))
-        {
-            set_bit(inode_bitmap, i); // Mark as allocated
-            return i;
+    uint64_t mask = 0;
+    uint32_t word_start = word_index * 64;
+    if (first_bit > word_start) {
+        uint32_t below = first_bit - word_start;
+        mask |= (below >= 64) ? ~0ULL : ((1ULL << below) - 1);
+    }
+    if (nbits < word_start + 64) {
+        uint32_t valid = (nbits > word_start) ? nbits - word_start : 0;
+        mask |= (valid == 0) ? ~0ULL : ~((1ULL << valid) - 1);
+    }
+    return mask;
+}
+
+// Finds a clear bit in [first_bit, nbits) a word at a time, starting at *hint and wrapping around
+// Sets the bit, advances *hint past it (next-fit) and returns its index, or -1 if all bits are set
+static int64_t allocate_bitmap_bit(uint32_t bitmap_start, uint32_t first_bit, uint32_t nbits, uint32_t *hint)
+{
+    uint32_t nwords = (nbits + 63) / 64;
+    uint32_t start = (*hint >= first_bit && *hint < nbits) ? *hint : first_bit;
+    uint32_t word_index = start / 64;
+
+    // One extra step revisits the start word so bits below the hint are also checked
+    for (uint32_t step = 0; step <= nwords; step++) {
+        uint64_t used = load_bitmap_word(bitmap_start, word_index) | unusable_bits_mask(word_index, first_bit, nbits);
+        if (step == 0) {
+            used |= (1ULL << (start % 64)) - 1; // Bits before the hint are checked last
         }
+        if (~used != 0) {
+            uint32_t index = word_index * 64 + (uint32_t)__builtin_ctzll(~used);
+            change_bitmap_bit(bitmap_start, index, true); // Mark as allocated
+            *hint = (index + 1 < nbits) ? index + 1 : first_bit;
+            return index;
+        }
+        word_index = (word_index + 1 < nwords) ? word_index + 1 : 0;
+    }
+    return -1;
+}
+
+// Counts clear bits in [first_bit, nbits) a word at a time
+static uint32_t count_free_bits(uint32_t bitmap_start, uint32_t first_bit, uint32_t nbits)
+{
+    uint32_t nwords = (nbits + 63) / 64;
+    uint32_t free_bits = 0;
+    for (uint32_t w = 0; w < nwords; w++) {
+        uint64_t used = load_bitmap_word(bitmap_start, w) | unusable_bits_mask(w, first_bit, nbits);
+        free_bits += 64 - (uint32_t)__builtin_popcountll(used);
     }
-    return 0; // 0 indicates no free inodes (since inode 0 is reserved)
+    return free_bits;
+}
+
+// Recomputes the superblock free counts from the bitmaps (after formatting or mounting)
+void recount_free_blocks()
+{
+    Superblock *sb = get_superblock();
+    pthread_mutex_lock(&inode_bitmap_lock);
+    sb->free_inodes = count_free_bits(FREE_INODE_BITMAP, INODE_OFFSET, MAX_INODES);
+    pthread_mutex_unlock(&inode_bitmap_lock);
+    pthread_mutex_lock(&data_bitmap_lock);
+    sb->free_data_blocks = count_free_bits(FREE_DATA_BITMAP, 0, MAX_DATA_BLOCKS);
+    pthread_mutex_unlock(&data_bitmap_lock);
+}
+
+// Whether an inode is allocated in the inode bitmap
+bool is_inode_allocated(uint16_t inode_number)
+{
+    return inode_number < MAX_INODES && bitmap_bit_is_set(FREE_INODE_BITMAP, inode_number);
 }
 
-uint16_t find_free_data_block()
+// Whether a data block is allocated in the data bitmap
+bool is_data_block_allocated(uint32_t block_number)
 {
-    uint8_t *data_bitmap = get_data_bitmap();
+    return block_number >= DATA_START && block_number < DATA_END &&
+           bitmap_bit_is_set(FREE_DATA_BITMAP, block_number - DATA_START);
+}
+
+uint16_t find_free_inode()
+{
+    Superblock *sb = get_superblock();
+    pthread_mutex_lock(&inode_bitmap_lock);
+    if (sb->free_inodes == 0) {
+        pthread_mutex_unlock(&inode_bitmap_lock);
+        return 0; // 0 indicates no free inodes (since inode 0 is reserved)
+    }
+    // Start from the next-fit hint, never below the first non-reserved inode
+    int64_t index = allocate_bitmap_bit(FREE_INODE_BITMAP, INODE_OFFSET, MAX_INODES, &sb->inode_hint);
+    if (index < 0) {
+        sb->free_inodes = 0; // Count was stale, bitmap is full
+    } else {
+        sb->free_inodes--;
+    }
+    pthread_mutex_unlock(&inode_bitmap_lock);
+    return (index < 0) ? 0 : (uint16_t)index;
+}
+
+uint32_t find_free_data_block()
+{
+    Superblock *sb = get_superblock();
+    pthread_mutex_lock(&data_bitmap_lock);
+    if (sb->free_data_blocks == 0) {
+        pthread_mutex_unlock(&data_bitmap_lock);
+        return 0; // 0 indicates no free data blocks
+    }
     // Bitmap index 0 corresponds to block DATA_START, index 1 to DATA_START+1, etc.
-    for (uint16_t i = 0; i < MAX_DATA_BLOCKS; i++)
-    {
-        if (!is_bit_set(data_bitmap, i))
-        {
-            set_bit(data_bitmap, i); // Mark as allocated
-            return DATA_START + i; // Map bitmap index to actual block number
+    int64_t index = allocate_bitmap_bit(FREE_DATA_BITMAP, 0, MAX_DATA_BLOCKS, &sb->data_hint);
+    if (index < 0) {
+        sb->free_data_blocks = 0; // Count was stale, bitmap is full
+    } else {
+        sb->free_data_blocks--;
+    }
+    pthread_mutex_unlock(&data_bitmap_lock);
+    if (index < 0) {
+        return 0;
+    }
+    zero_stale_blocks(DATA_START + index, 1); // Never used since the format
+    return DATA_START + (uint32_t)index; // Map bitmap index to actual block number
+}
+
+// Looks for a run of clear bits in [from, to), stopping at the first run of length >= want
+// Otherwise leaves the longest shorter run in *best_start/*best_len (*best_len = 0 if none)
+static void find_free_run(uint32_t bitmap_start, uint32_t from, uint32_t to, uint32_t nbits, uint32_t want,
+                          uint32_t *best_start, uint32_t *best_len)
+{
+    uint32_t i = from;
+    while (i < to && *best_len < want) {
+        uint32_t word_index = i / 64;
+        uint64_t used = load_bitmap_word(bitmap_start, word_index) | unusable_bits_mask(word_index, 0, nbits);
+        used |= (1ULL << (i % 64)) - 1; // Bits before i were already looked at
+        if (~used == 0) {
+            i = (word_index + 1) * 64; // Whole word allocated, skip it
+            continue;
+        }
+
+        uint32_t run_start = word_index * 64 + (uint32_t)__builtin_ctzll(~used);
+        if (run_start >= to) {
+            break;
         }
+
+        // Extend the run a word at a time until a set bit, the end of the range, or want
+        uint32_t run_end = run_start;
+        while (run_end < to && run_end - run_start < want) {
+            uint32_t w = run_end / 64;
+            uint64_t rest = (load_bitmap_word(bitmap_start, w) | unusable_bits_mask(w, 0, nbits)) >> (run_end % 64);
+            if (rest != 0) {
+                run_end += (uint32_t)__builtin_ctzll(rest);
+                break;
+            }
+            run_end = (w + 1) * 64;
+        }
+        if (run_end > to) run_end = to;
+        if (run_end - run_start > want) run_end = run_start + want;
+
+        if (run_end - run_start > *best_len) {
+            *best_start = run_start;
+            *best_len = run_end - run_start;
+        }
+        i = run_end + 1; // Bit at run_end is allocated (or the run was long enough)
     }
-    return 0; // 0 indicates no free data blocks
+}
+
+// Allocates up to want physically adjacent data blocks in one pass over the data bitmap
+// The search starts at the next-fit hint; the first run of want free blocks wins, otherwise
+// the longest run found is returned. Returns the first block number and sets *got to the
+// run length, or returns 0 (and *got = 0) if no data blocks are free
+uint32_t allocate_extent(uint32_t want, uint32_t *got)
+{
+    *got = 0;
+    Superblock *sb = get_superblock();
+    if (want == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&data_bitmap_lock);
+    if (sb->free_data_blocks == 0) {
+        pthread_mutex_unlock(&data_bitmap_lock);
+        return 0;
+    }
+
+    uint32_t hint = (sb->data_hint < MAX_DATA_BLOCKS) ? sb->data_hint : 0;
+    uint32_t best_start = 0;
+    uint32_t best_len = 0;
+
+    // Runs cannot wrap around the end of the disk, so look after the hint and then before it
+    find_free_run(FREE_DATA_BITMAP, hint, MAX_DATA_BLOCKS, MAX_DATA_BLOCKS, want, &best_start, &best_len);
+    if (best_len < want && hint > 0) {
+        find_free_run(FREE_DATA_BITMAP, 0, hint, MAX_DATA_BLOCKS, want, &best_start, &best_len);
+    }
+    if (best_len == 0) {
+        sb->free_data_blocks = 0; // Count was stale, bitmap is full
+        pthread_mutex_unlock(&data_bitmap_lock);
+        return 0;
+    }
+
+    // Set the bits of the run a bitmap block at a time, journaling each block once
+    uint32_t i = best_start;
+    while (i < best_start + best_len) {
+        uint32_t block = FREE_DATA_BITMAP + i / BITMAP_BITS_PER_BLOCK;
+        uint8_t *bitmap = bcache_pin(block);
+        do {
+            set_bit(bitmap, i % BITMAP_BITS_PER_BLOCK); // Mark as allocated
+            i++;
+        } while (i < best_start + best_len && i % BITMAP_BITS_PER_BLOCK != 0);
+        journal_dirty_metadata(block);
+    }
+    sb->free_data_blocks -= best_len;
+    sb->data_hint = (best_start + best_len < MAX_DATA_BLOCKS) ? best_start + best_len : 0;
+    pthread_mutex_unlock(&data_bitmap_lock);
+    zero_stale_blocks(DATA_START + best_start, best_len);
+
+    *got = best_len;
+    return DATA_START + best_start; // Map bitmap index to actual block number
 }
 
 void free_inode(uint16_t inode_number)
 {
-    if (inode_number == 0) return; // Don't free reserved inode 0
-    uint8_t *inode_bitmap = get_inode_bitmap();
-    clear_bit(inode_bitmap, inode_number);
+    if (inode_number == 0 || inode_number >= MAX_INODES) return; // Don't free reserved inode 0
+    pthread_mutex_lock(&inode_bitmap_lock);
+    if (bitmap_bit_is_set(FREE_INODE_BITMAP, inode_number)) { // Ignore if already free
+        change_bitmap_bit(FREE_INODE_BITMAP, inode_number, false);
+        get_superblock()->free_inodes++;
+    }
+    pthread_mutex_unlock(&inode_bitmap_lock);
+}
+
+// Block sharing (copy on write)
+// A data block referenced from more than one place (inodes of cloned files, pointer blocks) has a
+// share count in the REFCOUNT blocks: the number of references beyond the first. Unshared blocks
+// count 0, so ordinary allocation and freeing never touch the table. A shared block is never
+// written in place; a writer replaces its reference with a private copy first
+// The counts are only changed under data_bitmap_lock, together with the bitmap. The table grows
+// with the disk, so unlike the bitmaps its blocks go through the cache like any other block
+
+// Returns the share count of a data block and sets *table_block to the REFCOUNT block holding it,
+// which the caller releases with bcache_put()
+static uint32_t* get_share_count(uint32_t block_number, uint32_t *table_block)
+{
+    uint32_t index = block_number - DATA_START;
+    *table_block = REFCOUNT_START + index / SHARES_PER_BLOCK;
+    return (uint32_t *)bcache_get(*table_block) + index % SHARES_PER_BLOCK;
+}
+
+// Number of references to a data block beyond the first (0 if it is not shared)
+uint32_t get_block_shares(uint32_t block_number)
+{
+    if (block_number < DATA_START || block_number >= DATA_END) return 0;
+    uint32_t table_block;
+    uint32_t shares = __atomic_load_n(get_share_count(block_number, &table_block), __ATOMIC_RELAXED);
+    bcache_put(table_block, false);
+    return shares;
+}
+
+// Adds a reference to an allocated data block
+void share_data_block(uint32_t block_number)
+{
+    if (block_number < DATA_START || block_number >= DATA_END) return;
+    uint32_t table_block;
+    pthread_mutex_lock(&data_bitmap_lock);
+    uint32_t *shares = get_share_count(block_number, &table_block);
+    __atomic_store_n(shares, *shares + 1, __ATOMIC_RELAXED);
+    journal_dirty_metadata(table_block);
+    bcache_put(table_block, true);
+    pthread_mutex_unlock(&data_bitmap_lock);
+}
+
+// Drops a reference to a shared data block; returns false (and changes nothing) if the caller
+// holds the only reference
+static bool drop_shared_reference(uint32_t block_number)
+{
+    uint32_t table_block;
+    pthread_mutex_lock(&data_bitmap_lock);
+    uint32_t *shares = get_share_count(block_number, &table_block);
+    bool shared = (*shares > 0);
+    if (shared) {
+        __atomic_store_n(shares, *shares - 1, __ATOMIC_RELAXED);
+        journal_dirty_metadata(table_block);
+    }
+    bcache_put(table_block, shared);
+    pthread_mutex_unlock(&data_bitmap_lock);
+    return shared;
+}
+
+// Adjacent data blocks released together by free_data_extent()
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} FreeRun;
+
+// Adds a block to be freed to the run, freeing the run first if the block does not extend it
+static void free_run_add(FreeRun *run, uint32_t block_number)
+{
+    if (run->count > 0 && block_number == run->first + run->count) {
+        run->count++;
+        return;
+    }
+    free_data_extent(run->first, run->count);
+    run->first = block_number;
+    run->count = 1;
+}
+
+// Drops one reference to a block of a block map like release_block(), adding the blocks that
+// lose their last reference to run
+static void release_block_into(uint32_t block_number, int levels, FreeRun *run)
+{
+    if (block_number < DATA_START || block_number >= DATA_END) return;
+    if (levels > 0) {
+        if (drop_shared_reference(block_number)) {
+            return; // Still referenced from elsewhere
+        }
+        // Only reference: no one else can reach the pointer block any more
+        uint32_t *pointers = (uint32_t *)bcache_get(block_number);
+        for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++) {
+            if (pointers[i] != 0) {
+                release_block_into(pointers[i], levels - 1, run);
+            }
+        }
+        bcache_put(block_number, false);
+    }
+    free_run_add(run, block_number); // A shared data block only drops a share when the run is freed
+}
+
+// Drops one reference to a block of a block map: levels is 0 for a data block, 1 for an indirect
+// block and 2 for a second level indirect block. The last reference frees the block, and for a
+// pointer block first drops its references to the blocks it points at
+void release_block(uint32_t block_number, int levels)
+{
+    FreeRun run = { 0, 0 };
+    release_block_into(block_number, levels, &run);
+    free_data_extent(run.first, run.count);
+}
+
+// Data blocks viewed through fs_read_view(), in a hash table with linear probing
+// A block freed while viewed keeps its bitmap bit until the last view of it is released, so it is
+// not handed to another file under the reader; if the system stops first, the block stays
+// allocated but unreferenced (the same as a block leaked by a crash)
+typedef struct {
+    uint32_t block; // 0 if the slot is empty
+    uint32_t views;
+    bool freed;     // freed while viewed, freed for real by the last release
+} ViewedBlock;
+
+#define VIEWED_SLOTS (2 * FS_VIEW_MAX_PINNED) // never more than half full
+
+static ViewedBlock viewed_blocks[VIEWED_SLOTS];
+static uint32_t viewed_total; // views held, at most FS_VIEW_MAX_PINNED
+static pthread_mutex_t viewed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the slot of block, or the empty slot it would go in; called with viewed_lock held
+static uint32_t viewed_slot(uint32_t block_number)
+{
+    uint32_t slot = block_number % VIEWED_SLOTS;
+    while (viewed_blocks[slot].block != 0 && viewed_blocks[slot].block != block_number) {
+        slot = (slot + 1) % VIEWED_SLOTS;
+    }
+    return slot;
+}
+
+// Empties a slot, moving later entries of its probe chain back so lookups still find them
+static void viewed_remove(uint32_t slot)
+{
+    uint32_t hole = slot;
+    uint32_t next = (slot + 1) % VIEWED_SLOTS;
+    while (viewed_blocks[next].block != 0) {
+        uint32_t home = viewed_blocks[next].block % VIEWED_SLOTS;
+        // The entry may move to the hole unless its home lies after the hole (cyclically)
+        bool stays = (hole <= next) ? (home > hole && home <= next) : (home > hole || home <= next);
+        if (!stays) {
+            viewed_blocks[hole] = viewed_blocks[next];
+            hole = next;
+        }
+        next = (next + 1) % VIEWED_SLOTS;
+    }
+    viewed_blocks[hole].block = 0;
+}
+
+// Records one more view of a data block
+// Returns false if FS_VIEW_MAX_PINNED views are held already
+bool view_block_hold(uint32_t block_number)
+{
+    pthread_mutex_lock(&viewed_lock);
+    if (viewed_total >= FS_VIEW_MAX_PINNED) {
+        pthread_mutex_unlock(&viewed_lock);
+        return false;
+    }
+    uint32_t slot = viewed_slot(block_number);
+    if (viewed_blocks[slot].block == 0) {
+        viewed_blocks[slot].block = block_number;
+        viewed_blocks[slot].views = 0;
+        viewed_blocks[slot].freed = false;
+    }
+    viewed_blocks[slot].views++;
+    __atomic_store_n(&viewed_total, viewed_total + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&viewed_lock);
+    return true;
+}
+
+// Drops one view of a data block, freeing the block if it was freed while viewed
+void view_block_release(uint32_t block_number)
+{
+    pthread_mutex_lock(&viewed_lock);
+    uint32_t slot = viewed_slot(block_number);
+    if (viewed_blocks[slot].block == 0) {
+        pthread_mutex_unlock(&viewed_lock);
+        return;
+    }
+    __atomic_store_n(&viewed_total, viewed_total - 1, __ATOMIC_RELAXED);
+    bool free_now = false;
+    if (--viewed_blocks[slot].views == 0) {
+        free_now = viewed_blocks[slot].freed;
+        viewed_remove(slot);
+    }
+    pthread_mutex_unlock(&viewed_lock);
+    if (free_now) {
+        journal_begin_operation();
+        free_data_block(block_number);
+        journal_end_operation();
+    }
+}
+
+// Marks a viewed block to be freed by its last release instead of now
+// Returns false if the block is not viewed; called with data_bitmap_lock held
+static bool defer_viewed_free(uint32_t block_number)
+{
+    if (__atomic_load_n(&viewed_total, __ATOMIC_RELAXED) == 0) {
+        return false; // Nothing viewed, the common case
+    }
+    pthread_mutex_lock(&viewed_lock);
+    uint32_t slot = viewed_slot(block_number);
+    bool viewed = (viewed_blocks[slot].block != 0);
+    if (viewed) {
+        viewed_blocks[slot].freed = true;
+    }
+    pthread_mutex_unlock(&viewed_lock);
+    return viewed;
 }
 
-void free_data_block(uint16_t block_number)
+// free_data_extent() body; stale says the blocks may hold old data, to be zero filled on reuse
+static void free_extent(uint32_t first, uint32_t count, bool stale)
 {
-    if (block_number < DATA_START || block_number > DATA_END) return;
-    uint8_t *data_bitmap = get_data_bitmap();
-    uint16_t bitmap_index = block_number - DATA_START; // Map block number to bitmap index
-    clear_bit(data_bitmap, bitmap_index); // Clear bitmap bit
-    // Clear the block by zeroing it out
-    memset(HARD_DISK[block_number], 0, BLOCK_SIZE_BYTES);
+    if (count == 0 || first < DATA_START || first >= DATA_END || count > DATA_END - first) return;
+    Superblock *sb = get_superblock();
+    uint32_t end = first + count;
+    uint32_t block_number = first;
+    pthread_mutex_lock(&data_bitmap_lock);
+    while (block_number < end) {
+        uint32_t bitmap_block = FREE_DATA_BITMAP + (block_number - DATA_START) / BITMAP_BITS_PER_BLOCK;
+        uint8_t *bitmap = bcache_pin(bitmap_block);
+        bool changed = false;
+        do {
+            uint32_t bitmap_index = (block_number - DATA_START) % BITMAP_BITS_PER_BLOCK;
+            uint32_t table_block;
+            uint32_t *shares = get_share_count(block_number, &table_block);
+            bool shared = (*shares > 0);
+            if (shared) {
+                __atomic_store_n(shares, *shares - 1, __ATOMIC_RELAXED); // Another reference keeps it
+                journal_dirty_metadata(table_block);
+            }
+            bcache_put(table_block, shared);
+            if (!shared && is_bit_set(bitmap, bitmap_index) && !defer_viewed_free(block_number)) { // Ignore if already free
+                if (stale) {
+                    mark_stale_blocks(block_number, 1); // Zero filled when allocated again
+                }
+                clear_bit(bitmap, bitmap_index);
+                sb->free_data_blocks++;
+                changed = true;
+            }
+            block_number++;
+        } while (block_number < end && (block_number - DATA_START) % BITMAP_BITS_PER_BLOCK != 0);
+        if (changed) {
+            journal_dirty_metadata(bitmap_block);
+        }
+    }
+    pthread_mutex_unlock(&data_bitmap_lock);
+}
+
+// Frees count adjacent data blocks starting at first, clearing their bitmap bits a bitmap block
+// at a time and journaling each bitmap block once; shared blocks only drop one reference
+// The blocks are not written: they keep their contents until they are allocated again, and
+// are zero filled then (zero_stale_blocks()), so freeing costs nothing per byte
+// A block with an unreleased view is freed when the view is released (view_block_release())
+void free_data_extent(uint32_t first, uint32_t count)
+{
+    free_extent(first, count, true);
+}
+
+// Gives back blocks reserved by allocate_extent() that were never written: they were zero filled
+// by the allocation, so unlike free_data_extent() they are not zero filled again when reused
+void free_unused_extent(uint32_t first, uint32_t count)
+{
+    free_extent(first, count, false);
+}
+
+// Frees a data block, or drops one reference to it if it is shared
+void free_data_block(uint32_t block_number)
+{
+    if (block_number < DATA_START || block_number >= DATA_END) return;
+    uint32_t bitmap_index = block_number - DATA_START; // Map block number to bitmap index
+    uint32_t table_block;
+    pthread_mutex_lock(&data_bitmap_lock);
+    uint32_t *shares = get_share_count(block_number, &table_block);
+    bool shared = (*shares > 0);
+    if (shared) {
+        __atomic_store_n(shares, *shares - 1, __ATOMIC_RELAXED); // Another reference keeps it
+        journal_dirty_metadata(table_block);
+    }
+    bcache_put(table_block, shared);
+    if (!shared && bitmap_bit_is_set(FREE_DATA_BITMAP, bitmap_index) && !defer_viewed_free(block_number)) { // Ignore if already free
+        mark_stale_blocks(block_number, 1); // Zero filled when allocated again, not now
+        change_bitmap_bit(FREE_DATA_BITMAP, bitmap_index, false); // Clear bitmap bit
+        get_superblock()->free_data_blocks++;
+    }
+    pthread_mutex_unlock(&data_bitmap_lock);
+}
+
+// Returns a new zero filled block for holding block pointers, or 0 if the disk is full
+static uint32_t allocate_pointer_block()
+{
+    uint32_t block = find_free_data_block();
+    if (block != 0) {
+        memset(bcache_get(block), 0, BLOCK_SIZE_BYTES);
+        journal_dirty_metadata(block);
+        bcache_put(block, true);
+    }
+    return block;
+}
+
+// Replaces the shared pointer block in *pointer with a private copy: the blocks it points at gain
+// a reference from the copy and the shared block loses this one (levels as for release_block())
+// Returns false if the disk is full
+static bool unshare_pointer_block(uint32_t *pointer, int levels)
+{
+    uint32_t copy = find_free_data_block();
+    if (copy == 0) {
+        return false;
+    }
+    uint32_t *pointers = (uint32_t *)bcache_get(copy);
+    memcpy(pointers, bcache_get(*pointer), BLOCK_SIZE_BYTES);
+    bcache_put(*pointer, false);
+    for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++) {
+        if (pointers[i] != 0) {
+            share_data_block(pointers[i]);
+        }
+    }
+    journal_dirty_metadata(copy);
+    bcache_put(copy, true);
+    release_block(*pointer, levels);
+    *pointer = copy;
+    journal_dirty_address(pointer); // In the inode or in the first level pointer block
+    return true;
+}
+
+// Follows the pointer block stored in *pointer; BMAP_MODIFY makes it private first if it is
+// shared, BMAP_ALLOCATE also creates it if it is missing (levels as for release_block())
+// Returns the pointer array of that block and sets *block to its number (release it with
+// bcache_put()), or returns NULL if it is missing or the disk is full
+static uint32_t* get_pointer_block(uint32_t *pointer, BmapMode mode, int levels, uint32_t *block)
+{
+    if (*pointer == 0) {
+        if (mode != BMAP_ALLOCATE) {
+            return NULL;
+        }
+        *pointer = allocate_pointer_block();
+        if (*pointer == 0) {
+            return NULL; // No free blocks for the pointer block
+        }
+        journal_dirty_address(pointer); // In the inode or in the first level pointer block
+    } else if (mode != BMAP_READ && get_block_shares(*pointer) > 0) {
+        if (!unshare_pointer_block(pointer, levels)) {
+            return NULL; // No free block for the copy
+        }
+    }
+    *block = *pointer;
+    return (uint32_t *)bcache_get(*pointer);
+}
+
+// Finds the slot that holds the data block number of a logical file block:
+// directBlocks[0..5], then the indirect block (POINTERS_PER_BLOCK pointers), then the second
+// level indirect block (POINTERS_PER_BLOCK indirect blocks of POINTERS_PER_BLOCK pointers each)
+// Pointer blocks on the way are made private (BMAP_MODIFY) and allocated (BMAP_ALLOCATE)
+// Sets *slot_block to the pointer block holding the slot (0 for a slot in the inode), which the
+// caller releases with bcache_put()
+// Returns NULL if logical_block is past the largest file, a pointer block is missing or the
+// inode stores its data inline
+static uint32_t* inode_bmap_slot(Inode *inode, uint32_t logical_block, BmapMode mode, uint32_t *slot_block)
+{
+    *slot_block = 0;
+    if ((inode->flags & INLINE_DATA_FLAG) != 0) {
+        return NULL; // The block map holds the file's data
+    }
+    if (logical_block < DIRECT_BLOCKS) {
+        return &inode->directBlocks[logical_block];
+    }
+    logical_block -= DIRECT_BLOCKS;
+
+    if (logical_block < POINTERS_PER_BLOCK) {
+        uint32_t *pointers = get_pointer_block(&inode->indirect, mode, 1, slot_block);
+        return pointers ? &pointers[logical_block] : NULL;
+    }
+    logical_block -= POINTERS_PER_BLOCK;
+
+    if (logical_block < POINTERS_PER_BLOCK * POINTERS_PER_BLOCK) {
+        uint32_t first_block;
+        uint32_t *first_level = get_pointer_block(&inode->second_level_indirect, mode, 2, &first_block);
+        if (first_level == NULL) {
+            return NULL;
+        }
+        uint32_t *second_level = get_pointer_block(&first_level[logical_block / POINTERS_PER_BLOCK], mode, 1, slot_block);
+        bcache_put(first_block, mode != BMAP_READ);
+        return second_level ? &second_level[logical_block % POINTERS_PER_BLOCK] : NULL;
+    }
+
+    return NULL; // Past the largest file
+}
+
+// Maps a logical block of a file or directory to its data block
+// With allocate, missing pointer blocks and the data block itself are allocated
+// Returns the data block number, or 0 if it is not allocated (or the disk is full)
+uint32_t inode_bmap(Inode *inode, uint32_t logical_block, bool allocate)
+{
+    uint32_t slot_block;
+    uint32_t *slot = inode_bmap_slot(inode, logical_block, allocate ? BMAP_ALLOCATE : BMAP_READ, &slot_block);
+    if (slot == NULL) {
+        return 0;
+    }
+    bool changed = false;
+    if (*slot == 0 && allocate) {
+        *slot = find_free_data_block();
+        journal_dirty_address(slot);
+        changed = true;
+    }
+    uint32_t data_block = *slot;
+    if (slot_block != 0) {
+        bcache_put(slot_block, changed);
+    }
+    return data_block;
+}
+
+// Stores an already allocated data block (e.g. from allocate_extent) at a logical block,
+// allocating pointer blocks as needed
+// Returns SUCCESS, or ERROR_INVALID_INPUT if the block is out of range or no pointer block is free
+int inode_bmap_assign(Inode *inode, uint32_t logical_block, uint32_t data_block)
+{
+    uint32_t slot_block;
+    uint32_t *slot = inode_bmap_slot(inode, logical_block, BMAP_ALLOCATE, &slot_block);
+    if (slot == NULL) {
+        return ERROR_INVALID_INPUT;
+    }
+    *slot = data_block;
+    journal_dirty_address(slot);
+    if (slot_block != 0) {
+        bcache_put(slot_block, true);
+    }
+    return SUCCESS;
+}
+
+// Sets *data_block to the data block of a logical block, ready to be written in place (0 if it is
+// not allocated): if it or a pointer block on the way is shared with another file, this file's
+// reference is first replaced by a private copy (copy on write)
+// Returns SUCCESS, or ERROR_INVALID_INPUT if the disk is too full for the copies
+int inode_bmap_writable(Inode *inode, uint32_t logical_block, uint32_t *data_block)
+{
+    *data_block = 0;
+    uint32_t slot_block;
+    uint32_t *slot = inode_bmap_slot(inode, logical_block, BMAP_MODIFY, &slot_block);
+    if (slot == NULL) {
+        // Either not allocated, or a pointer block could not be copied
+        return (inode_bmap(inode, logical_block, false) == 0) ? SUCCESS : ERROR_INVALID_INPUT;
+    }
+    int result = SUCCESS;
+    bool changed = false;
+    if (*slot != 0 && get_block_shares(*slot) > 0) {
+        uint32_t copy = find_free_data_block();
+        if (copy == 0) {
+            result = ERROR_INVALID_INPUT;
+        } else {
+            memcpy(bcache_get(copy), bcache_get(*slot), BLOCK_SIZE_BYTES);
+            bcache_put(*slot, false);
+            journal_dirty_data(copy);
+            bcache_put(copy, true);
+            free_data_block(*slot); // Drops this file's reference
+            *slot = copy;
+            journal_dirty_address(slot);
+            changed = true;
+        }
+    }
+    if (result == SUCCESS) {
+        *data_block = *slot;
+    }
+    if (slot_block != 0) {
+        bcache_put(slot_block, changed);
+    }
+    return result;
+}
+
+// Releases the entries from index first on of a pointer block (levels as for release_block()),
+// which the caller has made private; the blocks that lose their last reference are added to run
+static void release_pointers_from(uint32_t pointer_block, uint32_t first, int levels, FreeRun *run)
+{
+    uint32_t *pointers = (uint32_t *)bcache_get(pointer_block);
+    bool changed = false;
+    for (uint32_t i = first; i < POINTERS_PER_BLOCK; i++) {
+        if (pointers[i] != 0) {
+            release_block_into(pointers[i], levels - 1, run);
+            pointers[i] = 0;
+            changed = true;
+        }
+    }
+    if (changed) {
+        journal_dirty_metadata(pointer_block);
+    }
+    bcache_put(pointer_block, changed);
+}
+
+// Drops logical blocks first_block and up from the block map of a file, with the pointer blocks
+// that only served them; freed blocks go back to the data bitmap in runs (see free_data_extent())
+// and blocks shared with clones only lose this file's reference. The caller holds the write lock
+// and journals the inode
+// Returns SUCCESS, or ERROR_INVALID_INPUT if a shared pointer block that keeps some entries
+// could not be copied (disk full); the blocks dropped before that stay dropped
+int inode_truncate_blocks(Inode *inode, uint32_t first_block)
+{
+    if ((inode->flags & INLINE_DATA_FLAG) != 0) {
+        return SUCCESS; // No block map
+    }
+    FreeRun run = { 0, 0 };
+    int result = SUCCESS;
+    for (uint32_t i = first_block; i < DIRECT_BLOCKS; i++) {
+        if (inode->directBlocks[i] != 0) {
+            free_run_add(&run, inode->directBlocks[i]);
+            inode->directBlocks[i] = 0;
+        }
+    }
+
+    // Indirect block: dropped whole, or its tail entries
+    uint32_t pointer_block;
+    if (first_block <= DIRECT_BLOCKS) {
+        release_block_into(inode->indirect, 1, &run);
+        inode->indirect = 0;
+    } else if (first_block < DIRECT_BLOCKS + POINTERS_PER_BLOCK && inode->indirect != 0) {
+        if (get_pointer_block(&inode->indirect, BMAP_MODIFY, 1, &pointer_block) == NULL) {
+            result = ERROR_INVALID_INPUT;
+        } else {
+            bcache_put(pointer_block, false);
+            release_pointers_from(pointer_block, first_block - DIRECT_BLOCKS, 1, &run);
+        }
+    }
+
+    // Second level indirect block: dropped whole, or its tail indirect blocks and the tail
+    // entries of the one the new end falls in
+    uint32_t sli_first = DIRECT_BLOCKS + POINTERS_PER_BLOCK;
+    if (first_block <= sli_first) {
+        release_block_into(inode->second_level_indirect, 2, &run);
+        inode->second_level_indirect = 0;
+    } else if (first_block - sli_first < POINTERS_PER_BLOCK * POINTERS_PER_BLOCK &&
+               inode->second_level_indirect != 0 && result == SUCCESS) {
+        uint32_t keep = first_block - sli_first;
+        uint32_t *first_level = get_pointer_block(&inode->second_level_indirect, BMAP_MODIFY, 2, &pointer_block);
+        if (first_level == NULL) {
+            result = ERROR_INVALID_INPUT;
+        } else {
+            uint32_t partial = keep / POINTERS_PER_BLOCK;
+            uint32_t second_block;
+            if (keep % POINTERS_PER_BLOCK != 0 && first_level[partial] != 0) {
+                if (get_pointer_block(&first_level[partial], BMAP_MODIFY, 1, &second_block) == NULL) {
+                    result = ERROR_INVALID_INPUT;
+                } else {
+                    bcache_put(second_block, false);
+                    release_pointers_from(second_block, keep % POINTERS_PER_BLOCK, 1, &run);
+                }
+                partial++;
+            }
+            bcache_put(pointer_block, true); // May hold a new private copy of the partial block
+            if (result == SUCCESS) {
+                release_pointers_from(pointer_block, partial, 2, &run);
+            }
+        }
+    }
+
+    free_data_extent(run.first, run.count);
+    return result;
+}
+
+// Ends the journal operation of a long write, copy or truncate and continues in a new one, so
+// the transaction can be committed in between (see journal_operation_full()); the caller made the
+// inodes consistent and journaled them first. write_inode is write locked and read_inode (0 for
+// none) read locked; both locks are dropped in between and taken again in inode number order
+void restart_long_operation(uint16_t write_inode, uint16_t read_inode)
+{
+    if (read_inode != 0) {
+        inode_unlock(read_inode);
+    }
+    inode_unlock(write_inode);
+    journal_end_operation();
+    journal_begin_operation();
+    if (read_inode != 0 && read_inode < write_inode) {
+        inode_read_lock(read_inode);
+    }
+    inode_write_lock(write_inode);
+    if (read_inode != 0 && read_inode > write_inode) {
+        inode_read_lock(read_inode);
+    }
+}
+
+// inode_truncate_blocks() for a file of any size: the blocks from first_block on are released a
+// step at a time from end_block (one past the last block the file may have) down, each step at
+// most TRUNCATE_STEP_POINTER_BLOCKS whole second level pointer blocks' worth, and the journal
+// operation is restarted between steps once it is full, so a truncate never outgrows the journal
+// A shared second level indirect block is not stepped through: dropping it whole only drops a
+// reference, and stepping would copy it first
+// The caller holds the write lock of inode_number inside one journal operation and has set the
+// new file size: between steps the file only has blocks past its end left, and blocks a writer
+// added below its size meanwhile are kept
+int inode_truncate_blocks_stepwise(uint16_t inode_number, Inode *inode, uint32_t first_block, uint32_t end_block)
+{
+    if ((inode->flags & INLINE_DATA_FLAG) != 0) {
+        return SUCCESS; // No block map
+    }
+    uint32_t sli_first = DIRECT_BLOCKS + POINTERS_PER_BLOCK;
+    uint32_t step = TRUNCATE_STEP_POINTER_BLOCKS * POINTERS_PER_BLOCK;
+    for (;;) {
+        // Steps start at whole steps into the second level range; below it, one step takes the rest
+        uint32_t step_first = first_block;
+        bool private_sli = inode->second_level_indirect != 0 && get_block_shares(inode->second_level_indirect) == 0;
+        if (private_sli && end_block > sli_first && sli_first + (end_block - 1 - sli_first) / step * step > first_block) {
+            step_first = sli_first + (end_block - 1 - sli_first) / step * step;
+        }
+        int result = inode_truncate_blocks(inode, step_first);
+        if (result != SUCCESS || step_first == first_block) {
+            return result;
+        }
+        end_block = step_first;
+        if (journal_operation_full()) {
+            journal_dirty_address(inode);
+            restart_long_operation(inode_number, 0);
+            uint32_t size_blocks = (uint32_t)(((uint64_t)inode->file_size + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES);
+            if (size_blocks >= end_block) {
+                return SUCCESS; // Written up to here meanwhile, the rest is file data
+            }
+            if (size_blocks > first_block) {
+                first_block = size_blocks;
+            }
+        }
+    }
 }
\ No newline at end of file